@@ -0,0 +1,282 @@
+/*
+ * A micro-benchmark of the Sensapex micromanipulator SDK (umsdk) message paths
+ *
+ * Runs on the loopback interface without devices. Measures the per call cost of
+ * sending a command and the per message cost of processing received position
+ * and full size uMa sample notifications. The same socket operations without
+ * the SDK are measured as well, the difference is the SDK overhead.
+ *
+ * Copyright (c) 2016-2024, Sensapex Oy
+ * All rights reserved.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA,
+ * OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE          // recvmmsg
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "libum.h"
+#include "smcp1.h"
+
+#define DEV          1
+#define ROUNDS       41           // Odd, for the median
+#define SEND_CALLS   2000
+#define RECV_BATCH   16           // Notifications queued before each drain
+#define RECV_BATCHES 100
+#define UMA_WORDS    ((1500 - SMCP1_FRAME_SIZE - SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t))
+
+typedef struct bench_s
+{
+    um_state *handle;
+    SOCKET sock;                  // Sends the notifications and the plain requests
+    SOCKET receiver;              // Plain socket for receiving without the SDK
+    IPADDR handle_addr;
+    IPADDR receiver_addr;
+} bench;
+
+// Queue a batch of notifications with the given count of data words to the given socket
+static int queue_notifications(SOCKET sock, const IPADDR *to, const int type, const int words, const int count,
+                               const int first_id) {
+    unsigned char buf[LIBUM_MAX_MESSAGE_SIZE];
+    smcp1_frame *frame = (smcp1_frame *) buf;
+    smcp1_subblock_header *sub_block = (smcp1_subblock_header *) (buf + SMCP1_FRAME_SIZE);
+    int32_t *data = (int32_t *) (buf + SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE);
+    size_t size = SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE + words * sizeof (int32_t);
+    int i, j;
+
+    memset(buf, 0, sizeof (buf));
+    frame->version = SMCP1_VERSION;
+    frame->sender_id = htons(DEV);
+    frame->receiver_id = htons(SMCP1_ALL_CUS_OR_PCS);
+    frame->type = htons(type);
+    frame->options = htonl(SMCP1_OPT_NOTIFY);
+    frame->sub_blocks = htons(1);
+    sub_block->data_type = htons(SMCP1_DATA_INT32);
+    sub_block->data_size = htons(words);
+    for (i = 0; i < count; i++) {
+        frame->message_id = htons(first_id + i);
+        for (j = 0; j < words; j++) {
+            data[j] = htonl(1000 * (i + j));
+        }
+        if (sendto (sock, (const char *) buf, size, 0, (const struct sockaddr *) to, sizeof (IPADDR)) < 0) {
+            return -1;
+        }
+    }
+    return count;
+}
+
+// Sample consumer, just touches the converted words
+static void on_uma_samples(um_state *hndl, const int dev, const int type, const void *payload, void *arg) {
+    const um_notify_uma_samples *samples = (const um_notify_uma_samples *) payload;
+    (void) hndl;
+    (void) dev;
+    (void) type;
+    *(uint32_t *) arg += samples->words[samples->word_count - 1];
+}
+
+// Read a queued batch the way the SDK does, without processing
+static int read_queued(SOCKET sock, const int count) {
+    static unsigned char bufs[RECV_BATCH][LIBUM_MAX_MESSAGE_SIZE];
+    int i;
+#ifdef __linux__
+    static struct mmsghdr hdrs[RECV_BATCH];
+    static struct iovec iovs[RECV_BATCH];
+    for (i = 0; i < count; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = sizeof (bufs[i]);
+        memset(&hdrs[i], 0, sizeof (hdrs[i]));
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return recvmmsg (sock, hdrs, count, MSG_DONTWAIT, NULL);
+#else
+    for (i = 0; i < count; i++) {
+        if (recvfrom (sock, (char *) bufs[i], sizeof (bufs[i]), 0, NULL, NULL) < 0) {
+            break;
+        }
+    }
+    return i;
+#endif
+}
+
+// A take step request, the same size as sent by the SDK, without the SDK
+static double send_raw(bench *b) {
+    unsigned char buf[SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE + 9 * sizeof (int32_t)];
+    unsigned long long start;
+    int i;
+
+    memset(buf, 0, sizeof (buf));
+    start = um_get_timestamp_ns ();
+    for (i = 0; i < SEND_CALLS; i++) {
+        sendto (b->sock, (const char *) buf, sizeof (buf), 0, (const struct sockaddr *) &b->handle->raddr,
+                sizeof (IPADDR));
+    }
+    return (double) (um_get_timestamp_ns () - start) / SEND_CALLS;
+}
+
+static double send_sdk(bench *b) {
+    int args[9] = {1000, 1000, 1000, 0, 100, 100, 100, 0, 0};
+    unsigned long long start;
+    int i;
+
+    start = um_get_timestamp_ns ();
+    for (i = 0; i < SEND_CALLS; i++) {
+        // Group id, no ACK requested
+        um_cmd (b->handle, SMCP1_ALL_DEVICES, SMCP1_CMD_TAKE_STEP, 9, args);
+    }
+    return (double) (um_get_timestamp_ns () - start) / SEND_CALLS;
+}
+
+static double receive_raw(bench *b) {
+    unsigned long long start, elapsed = 0;
+    int i, received = 0;
+
+    for (i = 0; i < RECV_BATCHES; i++) {
+        queue_notifications (b->sock, &b->receiver_addr, SMCP1_NOTIFY_POSITION_CHANGED, 3, RECV_BATCH,
+                             i * RECV_BATCH);
+        start = um_get_timestamp_ns ();
+        received += read_queued (b->receiver, RECV_BATCH);
+        elapsed += um_get_timestamp_ns () - start;
+    }
+    return received > 0 ? (double) elapsed / received : -1.0;
+}
+
+static double receive_sdk(bench *b) {
+    unsigned long long start, elapsed = 0;
+    int i, received = 0;
+
+    for (i = 0; i < RECV_BATCHES; i++) {
+        queue_notifications (b->sock, &b->handle_addr, SMCP1_NOTIFY_POSITION_CHANGED, 3, RECV_BATCH,
+                             i * RECV_BATCH);
+        start = um_get_timestamp_ns ();
+        received += um_receive (b->handle, 0);
+        elapsed += um_get_timestamp_ns () - start;
+    }
+    return received > 0 ? (double) elapsed / received : -1.0;
+}
+
+// Full datagrams of uMa samples read one by one, as by um_recv_ext
+static double receive_uma_raw(bench *b) {
+    static um_message msg;
+    unsigned long long start, elapsed = 0;
+    int i, j, received = 0;
+
+    for (i = 0; i < RECV_BATCHES; i++) {
+        queue_notifications (b->sock, &b->receiver_addr, SMCP1_NOTIFY_UMA_SAMPLES, UMA_WORDS, RECV_BATCH,
+                             i * RECV_BATCH);
+        start = um_get_timestamp_ns ();
+        for (j = 0; j < RECV_BATCH; j++) {
+            if (recvfrom (b->receiver, (char *) msg, sizeof (msg), 0, NULL, NULL) > 0) {
+                received++;
+            }
+        }
+        elapsed += um_get_timestamp_ns () - start;
+    }
+    return received > 0 ? (double) elapsed / received : -1.0;
+}
+
+static double receive_uma_sdk(bench *b) {
+    static um_message msg;
+    unsigned long long start, elapsed = 0;
+    int i, j, ext_data_type, received = 0;
+
+    for (i = 0; i < RECV_BATCHES; i++) {
+        queue_notifications (b->sock, &b->handle_addr, SMCP1_NOTIFY_UMA_SAMPLES, UMA_WORDS, RECV_BATCH,
+                             i * RECV_BATCH);
+        start = um_get_timestamp_ns ();
+        for (j = 0; j < RECV_BATCH; j++) {
+            if (um_recv_ext (b->handle, &msg, &ext_data_type, NULL, 0) > 0) {
+                received++;
+            }
+        }
+        elapsed += um_get_timestamp_ns () - start;
+    }
+    return received > 0 ? (double) elapsed / received : -1.0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double median(double *values) {
+    qsort (values, ROUNDS, sizeof (double), compare_doubles);
+    return values[ROUNDS / 2];
+}
+
+// The SDK and the plain runs interleaved, so that a disturbance hits both. Prints the medians
+static void run(bench *b, const char *name, const char *unit, double (*raw)(bench *), double (*sdk)(bench *)) {
+    double totals[ROUNDS], plains[ROUNDS], overheads[ROUNDS];
+    int round;
+
+    for (round = 0; round < ROUNDS; round++) {
+        plains[round] = raw (b);
+        totals[round] = sdk (b);
+        overheads[round] = totals[round] - plains[round];
+    }
+    printf("%-20s %8.1f        %8.1f        %8.1f ns/%s\n", name, median (totals), median (plains),
+           median (overheads), unit);
+}
+
+static SOCKET open_socket(IPADDR *addr) {
+    SOCKET sock;
+    socklen_t len = sizeof (IPADDR);
+    memset(addr, 0, sizeof (IPADDR));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = inet_addr ("127.0.0.1");
+    if ((sock = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+        return sock;
+    }
+    if (bind (sock, (struct sockaddr *) addr, sizeof (IPADDR)) < 0 ||
+        getsockname (sock, (struct sockaddr *) addr, &len) < 0) {
+        closesocket (sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+int main(int argc, char *argv[]) {
+    bench b;
+    IPADDR addr;
+    uint32_t checksum = 0;
+    socklen_t len = sizeof (IPADDR);
+    (void) argc;
+    (void) argv;
+
+    if ((b.handle = um_open ("127.0.0.1", 100, 0)) == NULL) {
+        fprintf(stderr, "Open failed - %s\n", um_last_errorstr (b.handle));
+        return 1;
+    }
+    getsockname (b.handle->socket, (struct sockaddr *) &b.handle_addr, &len);
+    b.handle_addr.sin_addr.s_addr = inet_addr ("127.0.0.1");
+    if ((b.sock = open_socket (&addr)) == INVALID_SOCKET ||
+        (b.receiver = open_socket (&b.receiver_addr)) == INVALID_SOCKET) {
+        fprintf(stderr, "Socket create failed\n");
+        um_close (b.handle);
+        return 1;
+    }
+    printf("libum %s, medians of %d rounds\n", um_get_version (), ROUNDS);
+    printf("                        total    sockets only    SDK overhead\n");
+    run (&b, "send command:", "call", send_raw, send_sdk);
+    run (&b, "receive positions:", "message", receive_raw, receive_sdk);
+    um_set_notify_handler (b.handle, SMCP1_NOTIFY_UMA_SAMPLES, on_uma_samples, &checksum);
+    run (&b, "receive uMa samples:", "message", receive_uma_raw, receive_uma_sdk);
+    closesocket (b.receiver);
+    closesocket (b.sock);
+    um_close (b.handle);
+    return 0;
+}
@@ -74,6 +74,7 @@ typedef struct sockaddr_in IPADDR;          /**< alias for sockaddr_in */
 #endif
 
 #include <math.h>
+#include <stdint.h>
 
 #ifdef _WINDOWS
 # ifndef LIBUM_SHARED_DO_NOT_EXPORT
@@ -147,6 +148,14 @@ typedef enum um_status_e
 #define LIBUM_FEATURE_VIRTUALX    0        /**< id number for virtual X axis feature */
 
 #define LIBUM_MAX_DEVS            0xFFFF   /**< Max count of concurrent devices supported by this SDK version*/
+#define LIBUM_MAX_PENDING         64       /**< Max count of outstanding requests per session, see #um_cmd_async */
+#define LIBUM_MAX_POSITION_HISTORY 65536   /**< Max position history size per device, see #um_set_position_history */
+#define LIBUM_MAX_UMA_RING        65536    /**< Max uMa sample ring size in blocks, see #um_set_uma_ring */
+#define LIBUM_UMA_BLOCK_WORDS     370      /**< Max count of sample words in a uMa datagram */
+#define LIBUM_UMA_RECORD_MAGIC    "UMAREC1" /**< uMa recording file identifier, see #um_uma_record_header */
+#define LIBUM_UMA_RECORD_REGS     10       /**< Count of uMa registers in the recording header, UMA_REG_COUNT of smcp1.h */
+#define LIBUM_UMA_RECORD_INDEX    1024     /**< Max count of the time index entries in the recording header */
+
 #define LIBUM_DEF_REFRESH_TIME    20       /**< The default positions refresh period in ms */
 #define LIBUM_MAX_POSITION        125000   /**< The upper absolute position limit */
 
@@ -167,13 +176,157 @@ typedef struct um_positions_s
     int y;                 /**< Y-actuator position */
     int z;                 /**< Z-actuator position */
     int d;                 /**< D-actuator position */
-    float speed_x;         /**< X-actuator movement speed between last two position updates */
-    float speed_y;         /**< Y-actuator movement speed between last two position updates */
-    float speed_z;         /**< Z-actuator movement speed between last two position updates */
-    float speed_d;         /**< D-actuator movement speed between last two position updates */
-    unsigned long long updated_us; /**< Timestamp (in microseconds) when positions were updated */
+    float speed_x;         /**< X-actuator movement speed in µm/s, filtered over the position updates */
+    float speed_y;         /**< Y-actuator movement speed in µm/s, filtered over the position updates */
+    float speed_z;         /**< Z-actuator movement speed in µm/s, filtered over the position updates */
+    float speed_d;         /**< D-actuator movement speed in µm/s, filtered over the position updates */
+    unsigned long long updated_us; /**< Monotonic timestamp (in microseconds) when positions arrived, the kernel receive time on Linux, see #um_get_timestamp_ns */
 } um_positions;
 
+/**
+ * @brief Position history sample, see #um_get_position_history
+ */
+typedef struct um_position_sample_s
+{
+    unsigned long long timestamp_us; /**< Monotonic timestamp (in microseconds) when the positions arrived */
+    unsigned long long processed_us; /**< Monotonic timestamp (in microseconds) when the SDK processed them */
+    int x;                 /**< X-actuator position */
+    int y;                 /**< Y-actuator position */
+    int z;                 /**< Z-actuator position */
+    int d;                 /**< D-actuator position */
+} um_position_sample;
+
+#define LIBUM_NOTIFY_HANDLER_COUNT 5       /**< Count of the notification types with a handler, see #um_set_notify_handler */
+#define LIBUM_NOTIFY_MAX_CHANNELS  8       /**< Max count of pressure channels in #um_notify_pressure */
+
+/**
+ * @brief Payload of SMCP1_NOTIFY_POSITION_CHANGED
+ */
+typedef struct um_notify_positions_s
+{
+    int axis_count;         /**< Count of the positions in the notification */
+    um_positions positions; /**< Updated position cache entry, positions in nanometers */
+} um_notify_positions;
+
+/**
+ * @brief Payload of SMCP1_NOTIFY_STATUS_CHANGED
+ */
+typedef struct um_notify_status_s
+{
+    int status;             /**< Device status bits, see #um_status */
+} um_notify_status;
+
+/**
+ * @brief Payload of SMCP1_NOTIFY_GOTO_POS_COMPLETED, duplicates are not passed to the handler
+ */
+typedef struct um_notify_drive_completed_s
+{
+    int error_code;         /**< Drive result reported by the device, zero for ok */
+    int drive_status;       /**< #LIBUM_POS_DRIVE_COMPLETED or #LIBUM_POS_DRIVE_FAILED */
+} um_notify_drive_completed;
+
+/**
+ * @brief Payload of SMCP1_NOTIFY_PRESSURE_CHANGED
+ */
+typedef struct um_notify_pressure_s
+{
+    int valves;                                    /**< Valve states, a bit per channel */
+    int channel_count;                             /**< Count of the pressure values */
+    int pressures[LIBUM_NOTIFY_MAX_CHANNELS];      /**< Pressures in Pascals */
+} um_notify_pressure;
+
+/**
+ * @brief Payload of SMCP1_NOTIFY_UMA_SAMPLES
+ */
+typedef struct um_notify_uma_samples_s
+{
+    int word_count;         /**< Count of the sample words */
+    const uint32_t *words;  /**< Sample words in host byte order, valid only during the callback */
+} um_notify_uma_samples;
+
+/**
+ * @brief Block of uMa samples in the ring, see #um_set_uma_ring
+ */
+typedef struct um_uma_block_s
+{
+    unsigned long long timestamp_us; /**< Monotonic timestamp (in microseconds) when the datagram arrived */
+    int dev;                /**< Device ID of the sender */
+    int message_id;         /**< Message id of the datagram */
+    int gap;                /**< Count of message ids skipped by the sender after the previous datagram, lost on the way */
+    int dropped;            /**< Count of blocks dropped before this one because the ring was full */
+    int word_count;         /**< Count of the sample words */
+    uint32_t words[LIBUM_UMA_BLOCK_WORDS]; /**< Sample words in host byte order */
+} um_uma_block;
+
+/**
+ * @brief Time index entry of a uMa recording, see #um_uma_record_header
+ */
+typedef struct um_uma_record_index_s
+{
+    uint64_t timestamp_us;  /**< Arrival timestamp of the block */
+    uint64_t offset;        /**< File offset of the block */
+} um_uma_record_index;
+
+/**
+ * @brief Header of a uMa recording file, see #um_start_uma_recorder
+ *
+ * The header is followed by the blocks, each a #um_uma_record_block followed by its sample words
+ * padded to an even count. All values are in the byte order of the recording host.
+ * To find the samples of a moment, look up the latest index entry not newer than it and walk
+ * the blocks from its offset, at most index_stride of them.
+ */
+typedef struct um_uma_record_header_s
+{
+    char magic[8];          /**< #LIBUM_UMA_RECORD_MAGIC */
+    uint32_t header_size;   /**< Size of this header, the file offset of the first block */
+    int32_t dev;            /**< Device ID of the recorded uMa */
+    int32_t reg_count;      /**< Count of the register values, zero if those could not be read */
+    int32_t regs[LIBUM_UMA_RECORD_REGS]; /**< uMa registers at the start, see #um_get_uma_regs */
+    uint64_t start_us;      /**< Monotonic timestamp (in microseconds) at the start, the time base of the blocks */
+    uint64_t start_time_ms; /**< Wall clock time in milliseconds at the start, see #um_get_timestamp_ms */
+    uint64_t data_size;     /**< Total size of the blocks in bytes */
+    uint64_t block_count;   /**< Count of the blocks */
+    uint64_t missing;       /**< Count of the datagrams lost on the way, see #um_uma_block */
+    uint32_t index_count;   /**< Count of the index entries */
+    uint32_t index_stride;  /**< Count of blocks between the index entries, doubled when the index gets full */
+    um_uma_record_index index[LIBUM_UMA_RECORD_INDEX]; /**< Every index_stride-th block, oldest first */
+} um_uma_record_header;
+
+/**
+ * @brief Block header in a uMa recording, see #um_uma_record_header
+ */
+typedef struct um_uma_record_block_s
+{
+    uint64_t timestamp_us;  /**< Monotonic timestamp (in microseconds) when the datagram arrived */
+    int32_t message_id;     /**< Message id of the datagram */
+    int32_t gap;            /**< Count of datagrams lost on the way before this one */
+    int32_t word_count;     /**< Count of the sample words following this header */
+    int32_t reserved;       /**< Zero */
+} um_uma_record_block;
+
+struct um_state_s;
+
+/**
+ * @brief Prototype for the notification handler, see #um_set_notify_handler
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   dev     Device ID of the sender
+ * @param   type    Notification type e.g. SMCP1_NOTIFY_POSITION_CHANGED
+ * @param   payload Pointer to the decoded payload, e.g. #um_notify_positions, valid only during the callback
+ * @param   arg     Argument given on the registration
+ */
+
+typedef void (*um_notify_func)(struct um_state_s *hndl, const int dev, const int type, const void *payload, void *arg);
+
+/**
+ * @brief Registered notification handler
+ */
+typedef struct um_notify_handler_s
+{
+    um_notify_func func;    /**< Handler function, NULL if not registered */
+    void *arg;              /**< Argument for the above */
+} um_notify_handler;
+
 /**
  * @brief Prototype for the log print callback function
  *
@@ -205,11 +358,21 @@ typedef struct um_state_s
     int timeout;                                        /**< UDP transport message timeout */
     int udp_port;                                       /**< Target UDP port */
     int local_port;                                     /**< Local UDP port */
+    /*
+     * Define LIBUM_SPARSE_DEVICE_TABLE (cmake option of the same name) to keep the per device
+     * caches only for the devices actually seen, in a compact table keyed by the device ID,
+     * instead of the #LIBUM_MAX_DEVS sized arrays below. This reduces the size of the
+     * session handle from megabytes to a few kilobytes. The define needs to be the same for
+     * the SDK library and the application, the per device arrays are then not available,
+     * use the API functions to access the caches.
+     */
+#ifndef LIBUM_SPARSE_DEVICE_TABLE
     int last_status[LIBUM_MAX_DEVS];                    /**< Status cache per device */
     int drive_status[LIBUM_MAX_DEVS];                   /**< Position drive state per device #LIBUM_POS_DRIVE_BUSY, #LIBUM_POS_DRIVE_COMPLETED or #LIBUM_POS_DRIVE_FAILED */
     unsigned short drive_status_id[LIBUM_MAX_DEVS];     /**< Message ids of the above notifications, used to detect duplicates */
     IPADDR addresses[LIBUM_MAX_DEVS];                   /**< Address cache per device */
     um_positions last_positions[LIBUM_MAX_DEVS];        /**< Position cache per device */
+#endif
     IPADDR laddr;                                       /**< UDP local address */
     IPADDR raddr;                                       /**< UDP remote address */
     char errorstr_buffer[LIBUM_MAX_LOG_LINE_LENGTH];    /**< The work buffer of the latest error string handler */
@@ -224,8 +387,21 @@ typedef struct um_state_s
                                                         SMCP1_OPT_REQ_RESP       0x00000020 // request ACK, 0 = no ACK requested
                                                         SMCP1_OPT_REQ_ACK        0x00000010 // request ACK, 0 = no ACK requested
                                                         */
+#ifndef LIBUM_SPARSE_DEVICE_TABLE
     unsigned long long drive_status_ts[LIBUM_MAX_DEVS]; /**< position drive state check timestamp per device - last time PWM seen busy, updated by get_drive_status */
-    unsigned long long last_msg_ts[LIBUM_MAX_DEVS];     /**< Time stamp of last sent packet per device */
+    unsigned long long last_msg_ts[LIBUM_MAX_DEVS];     /**< Monotonic time stamp in ms of last sent packet per device */
+#endif
+    struct um_device_table_s *devices;                  /**< SDK internal per device state table */
+    struct um_receiver_s *volatile receiver;            /**< SDK internal background receiver, NULL if not running */
+    struct um_lock_s *lock;                             /**< SDK internal state lock, kept for the handle lifetime */
+    struct um_request_table_s *requests;                /**< SDK internal outstanding requests, matched by message id */
+    struct um_recv_batch_s *recv_batch;                 /**< SDK internal receive buffers, allocated on the first use */
+    um_notify_handler notify_handlers[LIBUM_NOTIFY_HANDLER_COUNT]; /**< Notification handlers, see um_set_notify_handler */
+    int rx_timestamps;                                  /**< Non-zero if the socket delivers kernel receive timestamps */
+    long long rx_clock_offset_us;                       /**< SDK internal offset from the wall clock to the SDK time base */
+    unsigned long long rx_clock_checked_us;             /**< SDK internal time the above was read */
+    struct um_uma_ring_s *uma_ring;                     /**< SDK internal uMa sample ring, NULL if not enabled */
+    struct um_uma_recorder_s *uma_recorder;             /**< SDK internal uMa recorder, NULL if not recording */
 } um_state;
 
 /**
@@ -309,6 +485,31 @@ LIBUM_SHARED_EXPORT const char *um_last_errorstr(um_state *hndl);
 LIBUM_SHARED_EXPORT int um_set_log_func(um_state *hndl, const int verbose_level,
                                           um_log_print_func func, const void *arg);
 
+/**
+ * @brief Register a handler called for every received notification of a type
+ *
+ * The handler gets the decoded payload right after the caches have been updated. It is called
+ * from the thread reading the socket, i.e. the receiver thread (see um_start_receiver()) or the
+ * thread calling um_receive(), um_process_readable() or waiting for a response. The SDK internal
+ * lock may be held meanwhile, always when called by the receiver thread, the other threads
+ * updating the caches or waiting for a response then wait for the handler to return.
+ * Keep the handler short. Commands may be sent from it, e.g. to start the next move. While
+ * waiting for a response, the handler is called recursively for the notifications received
+ * meanwhile. Messages already queued otherwise are processed after the handler returns,
+ * e.g. um_get_positions_nowait() called from the handler only reads the cache.
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   type    SMCP1_NOTIFY_POSITION_CHANGED (#um_notify_positions), SMCP1_NOTIFY_STATUS_CHANGED
+ *                  (#um_notify_status), SMCP1_NOTIFY_GOTO_POS_COMPLETED (#um_notify_drive_completed),
+ *                  SMCP1_NOTIFY_PRESSURE_CHANGED (#um_notify_pressure) or SMCP1_NOTIFY_UMA_SAMPLES
+ *                  (#um_notify_uma_samples)
+ * @param   func    Handler function, NULL to unregister
+ * @param   arg     Argument passed to the handler, may be NULL
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_set_notify_handler(um_state *hndl, const int type, um_notify_func func, void *arg);
+
 /**
  * @brief Get SDK library version
  *
@@ -352,6 +553,8 @@ LIBUM_SHARED_EXPORT int um_get_drive_status(um_state *hndl, const int dev);
 /**
  * @brief Read device firmware version.
  *
+ * The version is cached per device until the device reboots or its address changes.
+ *
  * @param   hndl    Pointer to session handle
  * @param   dev     Device ID
  * @param[out]  version   Pointer to an allocated buffer for firmware numbers
@@ -366,6 +569,8 @@ LIBUM_SHARED_EXPORT int um_read_version(um_state *hndl, const int dev,
 /**
  * @brief Read uMp or uMs axis count
  *
+ * The value is cached per device until the device reboots or its address changes.
+ *
  * @param   hndl    Pointer to session handle
  * @param   dev     Device ID
  *
@@ -479,6 +684,71 @@ LIBUM_SHARED_EXPORT int um_stop(um_state * hndl, const int dev);
 
 LIBUM_SHARED_EXPORT int um_receive(um_state *hndl, const int timelimit);
 
+/**
+ * @brief Start a background thread receiving the incoming messages
+ *
+ * The thread owns the socket read side. It updates the position, status and drive status
+ * caches from the notifications and passes the ACKs and responses to the waiting API calls.
+ * It also retransmits or expires the requests nobody is waiting for, e.g. the position
+ * refreshes of um_get_positions_nowait().
+ * Cache reads like um_get_positions() with #LIBUM_TIMELIMIT_CACHE_ONLY or um_get_drive_status()
+ * are then kept up to date without calling um_receive(), and they do not block the receiver.
+ * While the receiver is running, um_receive() just waits the given time and returns
+ * the count of messages processed meanwhile, um_recv_ext() is not available.
+ *
+ * @param   hndl    Pointer to session handle
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_start_receiver(um_state *hndl);
+
+/**
+ * @brief Stop the background receiver thread started with um_start_receiver()
+ *
+ * May be called while other threads use the session, API calls waiting for a response
+ * then read the socket themselves.
+ *
+ * @param   hndl    Pointer to session handle
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_stop_receiver(um_state *hndl);
+
+/**
+ * @brief Get the socket of the session for an external event loop
+ *
+ * Instead of blocking in the SDK, an application may wait for the socket to become readable
+ * in its own poll/epoll/libuv loop and then call um_process_readable(). Outstanding requests
+ * (see um_cmd_async()) need um_process_readable() also when um_next_deadline_ms() expires.
+ * The socket must not be read or closed by the application.
+ *
+ * @param   hndl    Pointer to session handle
+ * @return  Negative value if an error occurred. Socket file descriptor (SOCKET on Windows) otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_socket_fd(um_state *hndl);
+
+/**
+ * @brief Process the messages already received without blocking and service the request retransmits
+ *
+ * @param   hndl     Pointer to session handle
+ * @param   max_msgs Max count of messages to process, zero or negative value for all of them
+ * @return  Negative value if an error occurred. Count of the messages processed otherwise.
+ *          #LIBUM_INVALID_ARG if the receiver thread is running
+ */
+
+LIBUM_SHARED_EXPORT int um_process_readable(um_state *hndl, const int max_msgs);
+
+/**
+ * @brief Get the time to the next retransmit or timeout of the outstanding requests
+ *
+ * @param   hndl    Pointer to session handle
+ * @return  Milliseconds until um_process_readable() needs to be called, -1 if no requests are
+ *          outstanding, suitable as such for the poll timeout. #LIBUM_NOT_OPEN if hndl is NULL
+ */
+
+LIBUM_SHARED_EXPORT int um_next_deadline_ms(um_state *hndl);
+
 /**
  * @brief Read device position, possibly from a cache.
  *
@@ -499,6 +769,162 @@ LIBUM_SHARED_EXPORT int um_receive(um_state *hndl, const int timelimit);
 LIBUM_SHARED_EXPORT int um_get_positions(um_state *hndl, const int dev, const int time_limit,
                                          float *x, float *y, float *z, float *d, int *elapsedptr);
 
+/**
+ * @brief Read device position from the cache without blocking, refresh it in the background.
+ *
+ * Stale-while-revalidate variant of um_get_positions(). The cached values are returned immediately,
+ * and if older than the time limit, a position request is sent unless one is already in flight
+ * for the device. The response updates the cache when it arrives: processed by the receiver thread
+ * if running, otherwise by the next call of this, um_receive() or um_process_readable().
+ *
+ * @param       hndl        Pointer to session handle
+ * @param       dev         Device ID
+ * @param       time_limit  Maximum age of the cached values in milliseconds before a refresh is requested.
+ *                          Pass zero (LIBUM_TIMELIMIT_CACHE_ONLY) to request only if nothing is cached,
+ *                          -1 (LIBUM_TIMELIMIT_DISABLED) to request on every call.
+ * @param[out]  x           Pointer to an allocated buffer for x-actuator position
+ * @param[out]  y           Pointer to an allocated buffer for y-actuator position
+ * @param[out]  z           Pointer to an allocated buffer for z-actuator position
+ * @param[out]  d           Pointer to an allocated buffer for d-actuator position
+ * @param[out]  elapsedptr  Pointer to an allocated buffer for the age of the cached values in ms, -1 if none
+ *
+ * @return  Negative value if an error occurred, otherwise the count of the axes read from the cache,
+ *          zero if no positions have been received yet
+ */
+
+LIBUM_SHARED_EXPORT int um_get_positions_nowait(um_state *hndl, const int dev, const int time_limit,
+                                                float *x, float *y, float *z, float *d, int *elapsedptr);
+
+/**
+ * @brief Read positions of several devices, possibly from the cache.
+ *
+ * Entries new enough are served from the cache. Requests for the stale ones are sent back to back
+ * and the responses gathered as they arrive, thus the total latency is close to a single round trip.
+ * Entries of the devices not responding are left with the cached values, check the update timestamps.
+ *
+ * @param       hndl        Pointer to session handle
+ * @param       devs        Device IDs
+ * @param       count       Count of the devices
+ * @param       time_limit  Maximum age of acceptable cache value in milliseconds. Pass
+ *                          zero (LIBUM_TIMELIMIT_CACHE_ONLY) to always use cached positions.
+ *                          Pass -1 (LIBUM_TIMELIMIT_DISABLED) to force device read.
+ * @param[out]  positions   Pointer to an allocated array of count entries, positions in nanometers
+ * @return  Negative value if an error occurred. Count of the up-to-date entries otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_positions_multi(um_state *hndl, const int *devs, const int count, const int time_limit,
+                                               um_positions *positions);
+
+/**
+ * @brief Keep a history of the latest positions per device
+ *
+ * Every position cache update, by a notification or a position read, is appended to a ring
+ * of the given size per device. The rings are allocated on the first update of each device.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   capacity    Count of samples kept per device, zero to disable the history
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_set_position_history(um_state *hndl, const int capacity);
+
+/**
+ * @brief Copy the position history of a device, see #um_set_position_history
+ *
+ * Does not block the thread updating the positions.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   dev         Device ID
+ * @param   since_us    Copy only samples newer than this timestamp in microseconds, zero for all.
+ *                      Pass the timestamp of the latest sample got to continue from it
+ * @param[out] samples  Pointer to an allocated array, filled oldest first
+ * @param   size        Size of the array
+ * @return  Negative value if an error occurred. Count of the samples copied otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_position_history(um_state *hndl, const int dev, const unsigned long long since_us,
+                                                um_position_sample *samples, const int size);
+
+/**
+ * @brief Keep the received uMa samples in a ring until the application reads them
+ *
+ * Every SMCP1_NOTIFY_UMA_SAMPLES datagram is converted in place to a block of the ring by the
+ * thread reading the socket. The application reads the blocks from another thread at its own pace
+ * with #um_read_uma_ring, without locking and without copying. If the ring is full, the new blocks
+ * are dropped and counted. Do not call while the blocks are being read.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   capacity    Count of blocks kept, rounded up to a power of two, zero to disable the ring
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_set_uma_ring(um_state *hndl, const int capacity);
+
+/**
+ * @brief Get the oldest unread uMa sample blocks, see #um_set_uma_ring
+ *
+ * The blocks are returned as a contiguous span within the ring, a span ending at the end of
+ * the ring is followed by the next one at the beginning. The blocks stay valid until released
+ * by #um_release_uma_ring. Call only from a single reading thread.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param[out] blocks   Pointer to the first block of the span, NULL if none
+ * @return  Negative value if an error occurred. Count of the blocks in the span otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_read_uma_ring(um_state *hndl, const um_uma_block **blocks);
+
+/**
+ * @brief Release the oldest uMa sample blocks got by #um_read_uma_ring for reuse
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   count       Count of the blocks processed
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_release_uma_ring(um_state *hndl, const int count);
+
+/**
+ * @brief Get the uMa sample ring counters, see #um_set_uma_ring
+ *
+ * @param   hndl        Pointer to session handle
+ * @param[out] received Count of the sample datagrams received since the ring was enabled, may be NULL
+ * @param[out] dropped  Count of the blocks dropped because the ring was full, may be NULL
+ * @param[out] missing  Count of the datagrams lost on the way, detected by the message id gaps, may be NULL
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_uma_ring_stats(um_state *hndl, unsigned long long *received,
+                                              unsigned long long *dropped, unsigned long long *missing);
+
+/**
+ * @brief Record the uMa samples of a device to a file
+ *
+ * Reads the uMa registers to the file header and records every following SMCP1_NOTIFY_UMA_SAMPLES
+ * datagram of the device, see #um_uma_record_header for the format. The file is memory mapped and
+ * grown in large steps, the thread reading the socket writes the samples to it without system calls.
+ * An existing file is overwritten. Only one recording per session at a time.
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   dev     Device ID
+ * @param   path    File name
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_start_uma_recorder(um_state *hndl, const int dev, const char *path);
+
+/**
+ * @brief Stop recording the uMa samples, see #um_start_uma_recorder
+ *
+ * Completes the header and truncates the file to the recorded data.
+ *
+ * @param   hndl    Pointer to session handle
+ * @return  Negative value if an error occurred, e.g. the disk got full during the recording.
+ *          Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_stop_uma_recorder(um_state *hndl);
+
 /**
  * @brief Read the latest speeds and obtain time when the values were updated.
  *
@@ -515,6 +941,26 @@ LIBUM_SHARED_EXPORT int um_get_positions(um_state *hndl, const int dev, const in
 
 LIBUM_SHARED_EXPORT  int um_get_speeds(um_state *hndl, const int dev, float *x, float*y, float *z, float *d, int *elapsed);
 
+/**
+ * @brief Extrapolate the device position to a time, e.g. to compensate a camera latency
+ *
+ * Uses the position and speed estimates filtered over the position updates,
+ * without communicating with the device. The extrapolation is limited to one second.
+ *
+ * @param       hndl        Pointer to session handle
+ * @param       dev         Device ID
+ * @param       t_us        Monotonic timestamp in microseconds, e.g. um_get_timestamp_ns() / 1000
+ * @param[out]  x           Pointer to an allocated buffer for x-actuator position in µm, may be NULL
+ * @param[out]  y           Pointer to an allocated buffer for y-actuator position in µm, may be NULL
+ * @param[out]  z           Pointer to an allocated buffer for z-actuator position in µm, may be NULL
+ * @param[out]  d           Pointer to an allocated buffer for d-actuator position in µm, may be NULL
+ * @return  Negative value if an error occurred. Count of the positions extrapolated otherwise,
+ *          zero if no positions have been got from the device
+ */
+
+LIBUM_SHARED_EXPORT int um_predict_position(um_state *hndl, const int dev, const unsigned long long t_us,
+                                            float *x, float *y, float *z, float *d);
+
 /**
  * @brief Read position of the device into the cache.
  *
@@ -609,6 +1055,98 @@ LIBUM_SHARED_EXPORT int um_cmd_options(um_state *hndl, const int optionbits);
 LIBUM_SHARED_EXPORT int um_cmd(um_state *hndl, const int dev, const int cmd,
                                const int argc, const int *argv);
 
+/**
+ * @brief Send a command without waiting for the ACK or response
+ *
+ * The request stays outstanding until its result is harvested with #um_async_result
+ * or it is cancelled with #um_async_cancel. Replies are matched to the requests by the
+ * message id, thus several requests, also to different devices, may be in flight at once.
+ * Retransmits are sent while waiting with the um_async_ functions.
+ *
+ * @param   hndl     Pointer to session handle
+ * @param   dev      Device ID
+ * @param   cmd      Command id
+ * @param   argc     Count of the command arguments
+ * @param   argv     Pointer to the command arguments
+ * @param   respsize Count of the expected response data items, zero if only ACK is needed
+ * @return  Positive ticket identifying the request, negative value if an error occurred.
+ *          #LIBUM_INVALID_ARG if #LIBUM_MAX_PENDING requests are already outstanding
+ */
+
+LIBUM_SHARED_EXPORT int um_cmd_async(um_state *hndl, const int dev, const int cmd,
+                                     const int argc, const int *argv, const int respsize);
+
+/**
+ * @brief Wait until any of the requests is completed
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   tickets Tickets returned by #um_cmd_async, invalid ones are ignored
+ * @param   count   Count of the tickets
+ * @param   timeout Max time to wait in milliseconds, negative value for no limit
+ * @return  The ticket of a completed request, #LIBUM_TIMEOUT if none completed in time,
+ *          #LIBUM_INVALID_ARG if none of the tickets is valid
+ */
+
+LIBUM_SHARED_EXPORT int um_async_wait_any(um_state *hndl, const int *tickets, const int count, const int timeout);
+
+/**
+ * @brief Wait until all of the requests are completed
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   tickets Tickets returned by #um_cmd_async, invalid ones are ignored
+ * @param   count   Count of the tickets
+ * @param   timeout Max time to wait in milliseconds, negative value for no limit
+ * @return  Count of the completed requests, negative value if an error occurred
+ */
+
+LIBUM_SHARED_EXPORT int um_async_wait_all(um_state *hndl, const int *tickets, const int count, const int timeout);
+
+/**
+ * @brief Get the result of a request and release the ticket
+ *
+ * Waits for the request to complete if still outstanding.
+ * A request not answered after the retransmits completes with #LIBUM_TIMEOUT.
+ *
+ * @param   hndl     Pointer to session handle
+ * @param   ticket   Ticket returned by #um_cmd_async
+ * @param   respsize Size of the response buffer in data items
+ * @param[out] response Pointer to the response buffer, may be NULL if no response is expected
+ * @return  Count of the response data items, or zero or positive value for an ACK only request,
+ *          negative value if an error occurred
+ */
+
+LIBUM_SHARED_EXPORT int um_async_result(um_state *hndl, const int ticket, const int respsize, int *response);
+
+/**
+ * @brief Abandon a request and release the ticket, a late reply is then ignored
+ *
+ * @param   hndl    Pointer to session handle
+ * @param   ticket  Ticket returned by #um_cmd_async
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_async_cancel(um_state *hndl, const int ticket);
+
+/**
+ * @brief Get the measured round trip time of a device
+ *
+ * The round trip time is estimated from the ACKs to the requests not retransmitted.
+ * The retransmit timeout derived from it is doubled on every retransmit of a request.
+ * Until the first measurement the session timeout (see #um_set_timeout) is used.
+ * A request is given up only after the session timeout times the transmission count,
+ * however soon it is retransmitted.
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ * @param[out] srtt_us   Pointer to an allocated variable for the smoothed round trip time in microseconds,
+ *                       zero if not yet measured, may be NULL
+ * @param[out] rttvar_us Pointer to an allocated variable for the round trip time variation in microseconds,
+ *                       may be NULL
+ * @return  Negative value if an error occurred. Current retransmit timeout in microseconds otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_rtt(um_state *hndl, const int dev, int *srtt_us, int *rttvar_us);
+
 /**
  * @brief Get a device's parameter value
  *
@@ -683,6 +1221,9 @@ LIBUM_SHARED_EXPORT int um_get_soft_start_mode(um_state *hndl, const int dev);
 /**
  * @brief Get state of a device's feature
  *
+ * The state is cached per device until the device reboots or its address changes,
+ * um_set_feature() clears it.
+ *
  * Note! This API is mainly for Sensapex internal development and production purpose and
  * should not be used unless you really know what you are doing.
  *
@@ -697,6 +1238,9 @@ LIBUM_SHARED_EXPORT int um_get_feature(um_state *hndl, const int dev, const int
 /**
  * @brief Get state of a device's ext-feature
  *
+ * The state is cached per device until the device reboots or its address changes,
+ * um_set_ext_feature() clears it.
+ *
  * Note! This API is mainly for Sensapex internal development and production purpose and
  * should not be used unless you really know what you are doing.
  *
@@ -708,6 +1252,30 @@ LIBUM_SHARED_EXPORT int um_get_feature(um_state *hndl, const int dev, const int
 
 LIBUM_SHARED_EXPORT int um_get_ext_feature(um_state *hndl, const int dev, const int id);
 
+/**
+ * @brief Get the state of all features of a device at once
+ *
+ * Reads the feature and ext-feature bitmasks with one request each, both in flight at the same time,
+ * and caches them for um_get_feature() and um_get_ext_feature().
+ *
+ * Note! This API is mainly for Sensapex internal development and production purpose and
+ * should not be used unless you really know what you are doing.
+ *
+ * @param       hndl            Pointer to session handle
+ * @param       dev             Device ID
+ * @param       time_limit      Maximum age of the cached snapshot in milliseconds. Pass
+ *                              zero (LIBUM_TIMELIMIT_CACHE_ONLY) to use any cached snapshot.
+ *                              Pass -1 (LIBUM_TIMELIMIT_DISABLED) to force device read.
+ * @param[out]  features        Pointer to an allocated buffer for the feature bits, bit n for feature id n.
+ *                              May be NULL
+ * @param[out]  ext_features    Pointer to an allocated buffer for the ext-feature bits, bit n for ext-feature
+ *                              id 32 + n. May be NULL
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_get_features(um_state *hndl, const int dev, const int time_limit,
+                                        uint64_t *features, uint32_t *ext_features);
+
 /**
  * @brief Enable or disable a device feature
  *
@@ -765,6 +1333,8 @@ LIBUM_SHARED_EXPORT int ump_get_axis_angle(um_state * hndl, const int dev, float
 /**
  * @brief Get uMp device handedness configuration
  *
+ * The configuration is cached per device until the device reboots or its address changes.
+ *
  * @param   hndl    Pointer to session handle
  * @param   dev     Device ID
  * @return  Negative value if an error occurred. 1 if uMp has right-handed configuration,
@@ -830,6 +1400,25 @@ LIBUM_SHARED_EXPORT int umc_set_valve(um_state *hndl, const int dev, const int c
 
 LIBUM_SHARED_EXPORT int umc_get_valve(um_state *hndl, const int dev, const int channel);
 
+/**
+ * @brief Get valve source, possibly from a cache
+ *
+ * The cache is updated by the SMCP1_NOTIFY_PRESSURE_CHANGED notifications and the device reads.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   dev         Device ID
+ * @param   channel     Pressure channel, valid values 1-8
+ * @param   time_limit  Maximum age of acceptable cache value in milliseconds. Pass
+ *                      zero (LIBUM_TIMELIMIT_CACHE_ONLY) to always use the cached value if any.
+ *                      Pass -1 (LIBUM_TIMELIMIT_DISABLED) to force device read.
+ * @param[out] elapsedptr Pointer to an allocated variable for the value age in ms, may be NULL
+ *
+ * @return  Negative value if an error occurred. 0 (user/atmosphere) or 1 (pressure regulator output) otherwise
+ */
+
+LIBUM_SHARED_EXPORT int umc_get_valve_ext(um_state *hndl, const int dev, const int channel, const int time_limit,
+                                          int *elapsedptr);
+
 /**
  * @brief Measure real pressure on output manifold
  *
@@ -843,6 +1432,46 @@ LIBUM_SHARED_EXPORT int umc_get_valve(um_state *hndl, const int dev, const int c
 
 LIBUM_SHARED_EXPORT int umc_measure_pressure(um_state *hndl, const int dev, const int channel, float *value);
 
+/**
+ * @brief Measure real pressure on output manifold, possibly from a cache
+ *
+ * The cache is updated by the SMCP1_NOTIFY_PRESSURE_CHANGED notifications and the device reads.
+ *
+ * @param   hndl        Pointer to session handle
+ * @param   dev         Device ID
+ * @param   channel     Pressure channel, valid values 1-8
+ * @param   time_limit  Maximum age of acceptable cache value in milliseconds. Pass
+ *                      zero (LIBUM_TIMELIMIT_CACHE_ONLY) to always use the cached value if any.
+ *                      Pass -1 (LIBUM_TIMELIMIT_DISABLED) to force device read.
+ * @param[out] value    Pointer to an allocated variable, will get pressure in kPa, may be negative
+ * @param[out] elapsedptr Pointer to an allocated variable for the value age in ms, may be NULL
+ *
+ * @return  Negative value if an error occurred. Zero or positive value otherwise.
+ */
+
+LIBUM_SHARED_EXPORT int umc_measure_pressure_ext(um_state *hndl, const int dev, const int channel,
+                                                 const int time_limit, float *value, int *elapsedptr);
+
+/**
+ * @brief Record the real pressure on output manifold with the device timing the samples
+ *
+ * The device takes the samples at regular intervals and returns them at once. A recording
+ * longer than fits in a response (369 samples) is requested in parts, there is a gap of
+ * a round trip time between the parts.
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ * @param   channel   Pressure channel, valid values 1-8
+ * @param   count     Count of the samples
+ * @param   delay_ms  Delay between the samples in milliseconds, 0 - 10000
+ * @param[out] values Pointer to an allocated array of count entries, will get pressures in kPa
+ *
+ * @return  Negative value if an error occurred. Count of the samples recorded otherwise
+ */
+
+LIBUM_SHARED_EXPORT int umc_record_pressure(um_state *hndl, const int dev, const int channel, const int count,
+                                            const int delay_ms, float *values);
+
 /**
  * @brief Get pressure regulator monitor line ADC value
  *
@@ -910,6 +1539,79 @@ LIBUM_SHARED_EXPORT int umc_reset_sensor_offset(um_state *hndl, const int dev, c
 
 LIBUM_SHARED_EXPORT int umc_pressure_calib(um_state *hndl, const int dev, const int chn, const int delay);
 
+/**
+ * @brief State of all uMc channels, see #umc_read_all_channels
+ */
+typedef struct umc_channels_s
+{
+    float pressure_kpa[8];  /**< Measured pressures in kPa, see #umc_measure_pressure */
+    float setting_kpa[8];   /**< Pressure settings in kPa, see #umc_get_pressure_setting */
+    int valves;             /**< Valve states, a bit per channel, channel 1 in bit 0, see #umc_get_valve */
+    int pressure_valid;     /**< Bit per channel of pressure_kpa read successfully, channel 1 in bit 0 */
+    int setting_valid;      /**< Bit per channel of setting_kpa read successfully, channel 1 in bit 0 */
+    int valve_valid;        /**< Bit per channel of valves read successfully, channel 1 in bit 0 */
+} umc_channels;
+
+/**
+ * @brief Read the measured pressures, pressure settings and valve states of all channels
+ *
+ * The 24 requests are sent back to back and the responses are collected in any order,
+ * the read takes about one round trip time. The values read update the caches of
+ * #umc_measure_pressure_ext and #umc_get_valve_ext.
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ * @param[out] channels Pointer to an allocated structure, the valid bits tell the values read
+ *
+ * @return  Negative value if none of the values could be read. Count of the values read otherwise
+ */
+
+LIBUM_SHARED_EXPORT int umc_read_all_channels(um_state *hndl, const int dev, umc_channels *channels);
+
+/**
+ * @brief Step of a pressure sequence, see #umc_start_sequence
+ */
+typedef struct umc_sequence_step_s
+{
+    int period_ms;          /**< Duration of the step in milliseconds, 1 - 65535 */
+    float pressure_kpa;     /**< Pressure during the step in kPa, -65.536 - 65.532, resolution 4 Pa */
+    int valve;              /**< Valve state during the step, 0 (user/atmosphere) or 1 (pressure regulator output) */
+} umc_sequence_step;
+
+/**
+ * @brief Run a pressure sequence on a channel autonomously in the device
+ *
+ * The steps are validated and packed by the SDK. A sequence too long for a single message
+ * is split, the next part is sent when the channel busy status bit (#LIBUM_STATUS_UMC_CHN1_BUSY etc.)
+ * shows the previous one completed. Keep the status notifications processed meanwhile, i.e. run
+ * the receiver thread (see um_start_receiver()) or call um_receive() periodically.
+ * A new sequence on the channel replaces the parts of the previous one not yet sent.
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ * @param   channel   Pressure channel, valid values 1-8
+ * @param   steps     Pointer to an array of steps
+ * @param   count     Count of the steps
+ *
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int umc_start_sequence(um_state *hndl, const int dev, const int channel,
+                                           const umc_sequence_step *steps, const int count);
+
+/**
+ * @brief Check if a pressure sequence is running, see #umc_start_sequence
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ * @param   channel   Pressure channel, valid values 1-8
+ *
+ * @return  Negative value if an error occurred, e.g. a part of the sequence was not acknowledged.
+ *          One if the sequence is running, zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int umc_is_sequence_running(um_state *hndl, const int dev, const int channel);
+
 /**
  * @brief Get list of compatible devices.
  *        Call to this function attempts to cause fast list update by sending a ping as broadcast
@@ -1017,6 +1719,37 @@ LIBUM_SHARED_EXPORT int um_set_uma_regs(um_state *hndl, const int dev,
 
 LIBUM_SHARED_EXPORT int um_get_uma_regs(um_state *hndl, const int dev, const int count, int *values);
 
+/**
+ * @brief Keep a shadow copy of the uMa registers and coalesce the register writes
+ *
+ * The registers are read once from the device. After that #um_get_uma_reg and #um_get_uma_regs
+ * return the shadow values without a request, and #um_set_uma_reg and #um_set_uma_regs only
+ * update the shadow and mark the registers dirty. The dirty registers are sent with one
+ * SMCP1_SET_UMA_REGS request at most once per flush interval, by the receiver thread or by
+ * #um_receive. A write after a quiet interval is sent right away.
+ *
+ * @param   hndl         Pointer to session handle
+ * @param   dev          Device ID, not a group ID
+ * @param   interval_ms  Minimum time between two flushes, zero to send every write without delay,
+ *                       negative to flush the dirty registers and disable the shadow
+ *
+ * @return  Negative value if an error occurred. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_set_uma_shadow(um_state *hndl, const int dev, const int interval_ms);
+
+/**
+ * @brief Send the dirty uMa registers of a shadow right away and wait for the device to acknowledge
+ *
+ * @param   hndl      Pointer to session handle
+ * @param   dev       Device ID
+ *
+ * @return  Negative value if an error occurred, also a failed background flush is reported once.
+ *          LIBUM_INVALID_ARG if the shadow is not enabled. Zero otherwise
+ */
+
+LIBUM_SHARED_EXPORT int um_flush_uma_regs(um_state *hndl, const int dev);
+
 /**
  * @brief uMs specific commands
  */
@@ -1168,6 +1901,17 @@ LIBUM_SHARED_EXPORT int ums_get_bowl_control(um_state *hndl, const int dev, ums_
 
 LIBUM_SHARED_EXPORT unsigned long long um_get_timestamp_ms();
 
+/**
+ * @brief Get a monotonic nanosecond timestamp, not affected by the system clock adjustments
+ *
+ * The SDK internal timestamps, e.g. #um_positions updated_us, use this time base.
+ * The origin is arbitrary, use the values only for time differences.
+ *
+ * @return  timestamp
+ */
+
+LIBUM_SHARED_EXPORT unsigned long long um_get_timestamp_ns();
+
 // Lower layer function needed by libuma
 #define LIBUM_MAX_MESSAGE_SIZE   1502       /**< Um message max size*/
 typedef unsigned char um_message[LIBUM_MAX_MESSAGE_SIZE]; /**< Internal data storage for active um message*/
@@ -1176,7 +1920,8 @@ typedef unsigned char um_message[LIBUM_MAX_MESSAGE_SIZE]; /**< Internal data sto
  * @brief Receive an extended message with additional data.
  *
  * @param   hndl          Pointer to session handle.
- * @param   msg           Pointer to a buffer for the received message.
+ * @param   msg           Pointer to a buffer for the received message. Only the received bytes are written,
+ *                        the rest of the buffer is left as is.
  * @param   ext_data_type Pointer to an integer to receive the type of the extended data.
  * @param   ext_data_ptr  Pointer to a buffer for the extended data.
  * @param   timeout       Timeout in milliseconds for receiving the message.
@@ -1727,6 +2472,20 @@ public:
     int recv(const int timelimit)
     {   return um_receive(_handle, timelimit); }
 
+    /**
+     * @brief Start the background receiver thread keeping the caches up to date
+     * @return `true` if operation was successful, `false` otherwise
+     */
+    bool startReceiver()
+    {   return um_start_receiver(_handle) >= 0; }
+
+    /**
+     * @brief Stop the background receiver thread
+     * @return `true` if operation was successful, `false` otherwise
+     */
+    bool stopReceiver()
+    {   return um_stop_receiver(_handle) >= 0; }
+
 private:
     /**
      * @brief Resolves device ID, #LIBUM_USE_LAST_DEV handled in a special way
@@ -23,6 +23,10 @@
  *
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE          // recvmmsg
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -31,6 +35,7 @@
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <limits.h>
 
 #include "libum.h"
 #include "smcp1.h"
@@ -76,7 +81,28 @@ static int gettimeofday(struct timeval* t, void *timezone)
 #else
 
 #include <sys/time.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#endif
 
+// SIMD kernels for the payload byte order conversion
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+// Network byte order is the host order, nothing to swap
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define UM_HAVE_SSE2
+#include <emmintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UM_HAVE_AVX2          // Compiled for the function only, used if the CPU supports it
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define UM_HAVE_NEON
+#include <arm_neon.h>
 #endif
 
 // Forward declaration
@@ -98,13 +124,45 @@ unsigned long long um_get_timestamp_ms() {
     return um_get_timestamp_us () / 1000LL;
 }
 
+// Monotonic clock, not affected by the system clock adjustments. The vDSO makes it cheap on Linux.
+unsigned long long um_get_timestamp_ns() {
+#ifdef _WINDOWS
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart) {
+        QueryPerformanceFrequency (&frequency);
+    }
+    QueryPerformanceCounter (&counter);
+    return (unsigned long long) (counter.QuadPart / frequency.QuadPart) * 1000000000ULL +
+           (unsigned long long) (counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+    struct timespec ts;
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) < 0) {
+        return 0;
+    }
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+#endif
+}
+
+// The SDK internal time base
+static unsigned long long um_clock_us(void) {
+    return um_get_timestamp_ns () / 1000ULL;
+}
+
+static unsigned long long um_clock_ms(void) {
+    return um_get_timestamp_ns () / 1000000ULL;
+}
+
 static unsigned long long get_elapsed(const unsigned long long ts_ms) {
-    return um_get_timestamp_ms () - ts_ms;
+    return um_clock_ms () - ts_ms;
 }
 
 static const char *get_errorstr(const int error_code, char *buf, size_t buf_size) {
-#ifndef _WINDOWS
-    if (strerror_r (error_code, buf, buf_size) < 0)
+#if defined(_GNU_SOURCE) && defined(__GLIBC__)
+    // The GNU version, the returned string is often a static one and buf is left untouched
+    return strerror_r (error_code, buf, buf_size);
+#elif !defined(_WINDOWS)
+    if (strerror_r (error_code, buf, buf_size) != 0)
         snprintf(buf, buf_size, "error code %d", error_code);
 #else
     if(error_code == timeoutError)
@@ -269,249 +327,1153 @@ static int is_invalid_dev(const int dev) {
     return LIBUM_INVALID_DEV;
 }
 
-static int udp_select(um_state *hndl, int timeout) {
-    fd_set fdSet;
-    struct timeval timev;
-    if (hndl->socket == INVALID_SOCKET) {
-        return -1;
-    }
-    if (timeout < 0) {
-        timeout = hndl->timeout;
-    }
-    timev.tv_sec = timeout / 1000;
-    timev.tv_usec = (timeout % 1000) * 1000L;
-    FD_ZERO(&fdSet);
-    FD_SET(hndl->socket, &fdSet);
-    return select ((int) (hndl->socket) + 1, &fdSet, NULL, NULL, &timev);
-}
+/*
+ * Thread primitives for the background receiver
+ */
 
-static bool udp_set_address(IPADDR *addr, const char *s) {
-    if (!addr || !s) {
-        return false;
-    }
-    addr->sin_family = AF_INET;
-    return ((int) (addr->sin_addr.s_addr = inet_addr (s)) != -1);
-    // return inet_aton(s, &addr->sin_addr) > 0;
-}
+#ifdef _WINDOWS
+typedef HANDLE um_thread;
+typedef DWORD um_thread_id;
+typedef CRITICAL_SECTION um_mutex;            // Recursive by nature
+typedef CONDITION_VARIABLE um_cond;
+# define um_barrier()  MemoryBarrier()
+# define um_cpu_relax()  YieldProcessor()
+# define um_thread_yield()  SwitchToThread()
+#else
+typedef pthread_t um_thread;
+typedef pthread_t um_thread_id;
+typedef pthread_mutex_t um_mutex;
+typedef pthread_cond_t um_cond;
+# define um_barrier()  __sync_synchronize()
+# if defined(__x86_64__) || defined(__i386__)
+#  define um_cpu_relax()  __builtin_ia32_pause()
+# elif defined(__aarch64__) || defined(__arm__)
+#  define um_cpu_relax()  __asm__ __volatile__ ("yield")
+# else
+#  define um_cpu_relax()  ((void) 0)
+# endif
+# define um_thread_yield()  sched_yield()
+#endif
 
-static int
-udp_recv(um_state *hndl, unsigned char *response, const size_t response_size, IPADDR *from, const int timeout) {
-    int ret;
-    if ((ret = udp_select (hndl, timeout)) < 0) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "select failed - %s", strerror (hndl->last_error));
-        return ret;
-    } else if (!ret) {
-        hndl->last_os_errno = timeoutError;
-        strcpy(hndl->errorstr_buffer, "timeout");
-        return ret;
-    }
+#define UM_SEQ_SPIN_COUNT  100            // Busy waits for a sequence lock writer before yielding the CPU
 
-    socklen_t len = sizeof (IPADDR);
-    if ((ret = recvfrom (hndl->socket, (char *) response, response_size, 0, (struct sockaddr *) from, &len)) ==
-        SOCKET_ERROR) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "recvfrom failed - %s", strerror (hndl->last_error));
+// Wait until a sequence lock is not being written, returns the sequence to compare after the read
+static unsigned int um_seq_read_begin(const volatile unsigned int *seq) {
+    unsigned int value, spins = 0;
+    while ((value = *seq) & 1) {
+        // The writer may have been preempted, let it run
+        if (++spins < UM_SEQ_SPIN_COUNT) {
+            um_cpu_relax ();
+        } else {
+            um_thread_yield ();
+        }
     }
-    return ret;
+    um_barrier ();
+    return value;
 }
 
-static bool udp_set_sock_opt_addr_reuse(um_state *hndl) {
+static void um_mutex_init(um_mutex *mutex) {
 #ifdef _WINDOWS
-    char yes = 1;
+    InitializeCriticalSection(mutex);
 #else
-    int yes = 1;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init (mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
 #endif
-    if (setsockopt (hndl->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) < 0) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "address reuse setopt failed - %s", strerror (hndl->last_error));
-        return false;
-    }
-    return true;
 }
 
-static bool udp_set_sock_opt_mcast_group(um_state *hndl, const IPADDR *addr) {
-    struct ip_mreq mreq;
-    memset(&mreq, 0, sizeof (mreq));
-    mreq.imr_multiaddr = addr->sin_addr;
-    setsockopt (hndl->socket, IPPROTO_IP, IP_DROP_MEMBERSHIP, SOCKOPT_CAST &mreq, sizeof (mreq));
-    if (setsockopt (hndl->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, SOCKOPT_CAST &mreq, sizeof (mreq)) < 0) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "join to multicast group failed - %s", strerror (hndl->last_error));
-        return false;
-    }
-    return true;
+static void um_mutex_destroy(um_mutex *mutex) {
+#ifdef _WINDOWS
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy (mutex);
+#endif
 }
 
-static bool udp_set_sock_opt_bcast(um_state *hndl) {
+static void um_mutex_lock(um_mutex *mutex) {
 #ifdef _WINDOWS
-    char yes = 1;
+    EnterCriticalSection(mutex);
 #else
-    int yes = 1;
+    pthread_mutex_lock (mutex);
 #endif
-    if (setsockopt (hndl->socket, SOL_SOCKET, SO_BROADCAST, &yes, sizeof (yes)) < 0) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "broadcast enable failed - %s", strerror (hndl->last_error));
-        return false;
-    }
-    return true;
 }
 
-bool udp_get_local_address(um_state *hndl, IPADDR *addr) {
-    if (!addr) {
-        return false;
-    }
-    addr->sin_family = AF_INET;
-    // Obtain the local address by connecting an UDP socket
-    // TCP/IP stack will resolve the correct network interface
-    SOCKET testSocket;
-
-    if ((testSocket = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "socket create failed - %s", strerror (hndl->last_error));
-        return false;
-    }
-    socklen_t addrLen = sizeof (IPADDR);
-    if (connect (testSocket, (struct sockaddr *) &hndl->raddr, addrLen) == SOCKET_ERROR) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "connect failed - %s", strerror (hndl->last_error));
-        closesocket (testSocket);
-        return false;
-    }
-    if (getsockname (testSocket, (struct sockaddr *) addr, &addrLen) == SOCKET_ERROR) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "getsockname failed - %s", strerror (hndl->last_error));
-        closesocket (testSocket);
-        return false;
-    }
-    closesocket (testSocket);
-    um_log_print (hndl, 2, __PRETTY_FUNCTION__, "%s:%d", inet_ntoa (addr->sin_addr), ntohs(addr->sin_port));
-    return true;
+static void um_mutex_unlock(um_mutex *mutex) {
+#ifdef _WINDOWS
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock (mutex);
+#endif
 }
 
-static bool udp_is_multicast_address(IPADDR *addr) {
-    return ntohl(addr->sin_addr.s_addr) >> 24 == 224;
+static void um_cond_init(um_cond *cond) {
+#ifdef _WINDOWS
+    InitializeConditionVariable(cond);
+#elif defined(__APPLE__) && defined(__MACH__)
+    pthread_cond_init (cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init (&attr);
+    pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+    pthread_cond_init (cond, &attr);
+    pthread_condattr_destroy (&attr);
+#endif
 }
 
-static bool udp_is_loopback_address(IPADDR *addr) {
-    return ntohl(addr->sin_addr.s_addr) >> 24 == 127;
+static void um_cond_destroy(um_cond *cond) {
+#ifdef _WINDOWS
+    (void) cond;
+#else
+    pthread_cond_destroy (cond);
+#endif
 }
 
-static bool udp_is_broadcast_address(IPADDR *addr) {
-    return (ntohl(addr->sin_addr.s_addr) & 0xff) == 0xff;
+static void um_cond_broadcast(um_cond *cond) {
+#ifdef _WINDOWS
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast (cond);
+#endif
 }
 
-static bool udp_init(um_state *hndl, const char *broadcast_address) {
-    bool ok = true;
+// Wait for a signal, or at most the given time, mutex must be locked exactly once
+static void um_cond_wait_ms(um_cond *cond, um_mutex *mutex, const int ms) {
 #ifdef _WINDOWS
-    WSADATA wsaData;
-    // Initialize winsocket
-    if(WSAStartup(MAKEWORD(2, 2), &wsaData))
-    {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "WSAStartup failed (%d)\n", hndl->last_error);
-        return 0;
-    }
+    SleepConditionVariableCS(cond, mutex, ms);
+#elif defined(__APPLE__) && defined(__MACH__)
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    pthread_cond_timedwait_relative_np (cond, mutex, &ts);
+#else
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait (cond, mutex, &ts);
 #endif
-    if ((hndl->socket = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "socket create failed - %s", strerror (hndl->last_error));
-        ok = false;
-    }
-    if (ok && !udp_set_address (&hndl->raddr, broadcast_address ? broadcast_address : LIBUM_DEF_BCAST_ADDRESS)) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "invalid remote address - %s\n", strerror (hndl->last_error));
-        ok = false;
-    }
-    if (ok && !udp_set_address (&hndl->laddr, LIBUM_ANY_IPV4_ADDR)) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "invalid local address - %s\n", strerror (hndl->last_error));
-        ok = false;
-    }
+}
 
-    // Dynamic port used in windows by default
-    if (!hndl->local_port) {
-        hndl->laddr.sin_port = 0;
-        // change local port to avoid conflict on localhost testing
-    } else if (udp_is_loopback_address (&hndl->raddr)) {
-        hndl->laddr.sin_port = htons(hndl->local_port - 2);
-    } else {
-        hndl->laddr.sin_port = htons(hndl->local_port);
-    }
+static um_thread_id um_thread_self(void) {
+#ifdef _WINDOWS
+    return GetCurrentThreadId();
+#else
+    return pthread_self ();
+#endif
+}
 
-    hndl->raddr.sin_port = htons(hndl->udp_port);
-    if (ok) {
-        ok = udp_set_sock_opt_addr_reuse (hndl);
-    }
-#ifndef NO_UDP_MULTICAST
-    if (ok && udp_is_multicast_address (&hndl->raddr)) {
-        ok = udp_set_sock_opt_mcast_group (hndl, &hndl->raddr);
-    }
+static bool um_thread_equal(const um_thread_id a, const um_thread_id b) {
+#ifdef _WINDOWS
+    return a == b;
+#else
+    return pthread_equal (a, b) != 0;
 #endif
-    if (ok && udp_is_broadcast_address (&hndl->raddr)) {
-        ok = udp_set_sock_opt_bcast (hndl);
-    }
+}
 
-    int i, ret = 0;
-    for (i = 0; ok && i < 2 &&
-                (ret = bind (hndl->socket, (struct sockaddr *) &hndl->laddr, sizeof (IPADDR))) == SOCKET_ERROR; i++) {
-        hndl->last_os_errno = getLastError();
-        if (hndl->last_os_errno == EADDRINUSE) {
-            // Attempt bind dynamic port
-            hndl->laddr.sin_port = 0;
-            continue;
-        }
-        sprintf(hndl->errorstr_buffer, "bind failed - %s\n", strerror (hndl->last_error));
-        ok = false;
-    }
+static void um_sleep_ms(const int ms) {
 #ifdef _WINDOWS
-    if(!ok)
-        WSACleanup();
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    while (nanosleep (&ts, &ts) < 0 && errno == EINTR);
 #endif
-    return ok && ret >= 0;
 }
 
-static int set_last_error(um_state *hndl, int code) {
-    char *txt;
-    if (hndl) {
-        hndl->last_error = code;
-        const char *txt = um_errorstr (code);
-        if (txt) {
-            strcpy(hndl->errorstr_buffer, txt);
-        }
-    }
-    return code;
+/*
+ * Background receiver
+ *
+ * When started, a dedicated thread owns the socket read side. It processes all incoming
+ * messages into the caches and completes the pending requests, the requesting threads wait
+ * for the condition. Cache writers on any thread hold the lock, readers do not need it.
+ *
+ * The lock and the condition live as long as the handle, starting or stopping the receiver
+ * only starts or stops the thread. A thread holding or waiting for the lock is not affected.
+ */
+
+#define LIBUM_RECEIVER_POLL_TIME  10      // Socket poll period of the receiver thread in ms, limits the stop latency
+
+typedef struct um_lock_s
+{
+    um_mutex mutex;                           // Recursive, serializes the cache and table writers
+    um_cond cond;                             // Signaled when a pending request completes
+    um_thread_id receiver_thread_id;          // Set by the receiver thread itself
+    volatile unsigned long msg_count;         // Count of messages processed by the receiver thread
+} um_lock;
+
+typedef struct um_receiver_s
+{
+    um_thread thread;
+    volatile bool running;
+} um_receiver;
+
+static bool um_receiver_is_self(const um_state *hndl) {
+    return hndl->receiver && um_thread_equal (hndl->lock->receiver_thread_id, um_thread_self ());
 }
 
-static bool um_resolve_dev_ip_address(um_state *hndl, const int dev, IPADDR *to) {
-    if (dev < SMCP1_DIRECT_ADDRESS_LIMIT) {
-        return false;
+static void um_state_lock(um_state *hndl) {
+    um_mutex_lock (&hndl->lock->mutex);
+}
+
+static void um_state_unlock(um_state *hndl) {
+    um_mutex_unlock (&hndl->lock->mutex);
+}
+
+static um_lock *um_lock_create(void) {
+    um_lock *lock;
+    if (!(lock = calloc (1, sizeof (um_lock)))) {
+        return NULL;
     }
-    uint32_t addr = LINK_LOCAL_IPV4_NET | (dev & 0xffff);
-    to->sin_family = AF_INET;
-    to->sin_port = htons(hndl->udp_port);
-    to->sin_addr.s_addr = htonl(addr);
-    return true;
+    um_mutex_init (&lock->mutex);
+    um_cond_init (&lock->cond);
+    return lock;
 }
 
-int um_has_unicast_address(um_state *hndl, const int dev) {
-    if (!hndl) {
-        return set_last_error (hndl, LIBUM_NOT_OPEN);
+static void um_lock_free(um_lock *lock) {
+    if (!lock) {
+        return;
     }
-    int dev_id = um_resolve_dev_id (dev);
-    return hndl->addresses[dev_id].sin_addr.s_addr != 0;
+    um_cond_destroy (&lock->cond);
+    um_mutex_destroy (&lock->mutex);
+    free (lock);
 }
 
-static int um_send(um_state *hndl, const int dev, const unsigned char *data, int dataSize) {
-    int ret;
-    IPADDR to;
+/*
+ * Per device state table
+ *
+ * Devices are kept in a small open addressed hash table keyed by SMCPv1 device id.
+ * An entry is allocated when a device is accessed for the first time. Entries are
+ * neither moved nor freed before the handle is closed, pointers to them remain valid.
+ *
+ * Lookups are lock-free, inserts are done while holding the state lock. An entry is
+ * published to its slot only after it has been initialized, and an outgrown slot index
+ * is retired instead of freed, so a concurrent reader always probes a valid index.
+ *
+ * When built with LIBUM_SPARSE_DEVICE_TABLE the status, address and position
+ * caches live in these entries instead of the LIBUM_MAX_DEVS sized arrays of um_state.
+ */
 
-    if (dev > 0 && dev < LIBUM_MAX_DEVS && hndl->addresses[dev].sin_port && hndl->addresses[dev].sin_family)
-        memcpy(&to, &hndl->addresses[dev], sizeof (IPADDR));
-    else if (!um_resolve_dev_ip_address (hndl, dev, &to))
-        memcpy(&to, &hndl->raddr, sizeof (IPADDR));
+#define LIBUM_DEVICE_TABLE_INIT_SIZE 32   // Initial slot count, power of two
 
-    if (hndl->verbose > 1) {
+/*
+ * Static device information, fetched on the first use and kept until the device
+ * reboots (says hello again) or shows up from another address.
+ */
+
+#define UM_INFO_AXIS_COUNT           0x01
+#define UM_INFO_HEAD_CONFIG          0x02
+#define UM_INFO_VERSION              0x04
+#define UM_INFO_FEATURES             0x08      // Snapshot of all feature bits got
+#define UM_INFO_VERSION_SIZE         8
+#define UM_INFO_EXT_FEATURES_ALL     0xffffffff00000000ULL // Ext feature ids 32-63
+
+typedef struct um_device_info_s
+{
+    unsigned int valid;                       // UM_INFO_AXIS_COUNT etc. bits of the fields below
+    int axis_count;
+    int head_config;                          // SMCP1_PARAM_AXIS_HEAD_CONFIGURATION
+    int version[UM_INFO_VERSION_SIZE];
+    int version_size;                         // Count of the version items got
+    uint64_t features_valid;                  // Bit per feature id 0-63
+    uint64_t features;
+    uint64_t ext_features_valid;
+    uint64_t ext_features;
+    unsigned long long features_ts;           // Time of the latest feature snapshot in ms
+} um_device_info;
+
+typedef struct um_device_s
+{
+    int dev_id;                               // SMCPv1 device id, the hash key
+    bool active;                              // Device unicast address is known
+    struct um_device_s *active_prev;          // Active device list links
+    struct um_device_s *volatile active_next;
+    volatile unsigned int positions_seq;      // Position cache sequence lock, odd while being written
+    int srtt_us;                              // Smoothed round trip time, zero until the first sample
+    int rttvar_us;                            // Round trip time variation
+    struct um_position_history_s *volatile history; // Position history ring, NULL if not enabled
+    double filter_pos[4];                     // Alpha-beta filtered positions per axis in nm
+    double filter_vel[4];                     // Filtered velocities per axis in nm/us
+    unsigned long long filter_ts_us[4];       // Time of the latest sample per axis
+    unsigned int filter_valid;                // Bit per axis initialized
+    int refresh_ticket;                       // Background position refresh in flight, zero if none
+    um_device_info info;                      // Static device information cache
+    bool uma_seen;                            // uMa samples received, the below is valid
+    unsigned short uma_next_id;               // Expected message id of the next uMa samples
+    struct um_sequence_s *sequences[8];       // Pressure sequence per uMc channel, NULL if none running
+    int valves;                               // uMc valve states, a bit per channel
+    int pressures[8];                         // uMc pressures per channel in Pa
+    unsigned long long valve_ts[8];           // Monotonic time in ms of the valve states, zero if not known
+    unsigned long long pressure_ts[8];        // Monotonic time in ms of the pressures, zero if not known
+    struct um_uma_shadow_s *uma_shadow;       // uMa register shadow, NULL if not enabled
+#ifdef LIBUM_SPARSE_DEVICE_TABLE
+    int last_status;                          // Status cache
+    int drive_status;                         // Position drive state
+    unsigned short drive_status_id;           // Message id of the latest drive completed notification
+    IPADDR address;                           // Address cache
+    um_positions last_positions;              // Position cache
+    unsigned long long drive_status_ts;       // Last time PWM seen busy
+    unsigned long long last_msg_ts;           // Time stamp of last sent packet
+#endif
+} um_device;
+
+typedef struct um_device_index_s
+{
+    int size;                                 // Slot count, power of two
+    struct um_device_index_s *retired;        // Outgrown smaller index, kept for concurrent readers
+    um_device *volatile slots[];              // Open addressed slots, NULL for a free slot
+} um_device_index;
+
+typedef struct um_device_table_s
+{
+    um_device_index *volatile index;          // The current slot index
+    um_device **entries;                      // Entries in the insertion order, for iterating
+    int count;                                // Count of allocated entries
+    um_device *volatile active;               // Head of the list of devices with a known address
+    um_device fallback;                       // Returned if an entry allocation fails
+    um_device unknown;                        // Returned by the lookups of ids not in the table, never written
+    int history_capacity;                     // Position history ring size per device, zero if disabled
+    int uma_shadows;                          // Count of devices with a uMa register shadow
+} um_device_table;
+
+/*
+ * Position history ring per device. Appended by the position cache writers, read without
+ * locking with a sequence lock of its own. A ring outgrown by a capacity change is kept
+ * for concurrent readers until the handle is closed.
+ */
+typedef struct um_position_history_s
+{
+    volatile unsigned int seq;                // Sequence lock, odd while being written
+    int capacity;                             // Ring size in samples
+    struct um_position_history_s *retired;    // The ring replaced by this one
+    unsigned long long count;                 // Count of samples appended
+    um_position_sample samples[];
+} um_position_history;
+
+static void um_position_history_free(um_position_history *history) {
+    um_position_history *retired;
+    for (; history; history = retired) {
+        retired = history->retired;
+        free (history);
+    }
+}
+
+/*
+ * uMa sample block ring. Written by the thread reading the socket while holding the state lock,
+ * read by a single application thread without locking. The counters only grow, their difference
+ * is the count of the unread blocks.
+ */
+typedef struct um_uma_ring_s
+{
+    volatile unsigned int head;               // Count of blocks written
+    volatile unsigned int tail;               // Count of blocks released by the reader
+    unsigned int mask;                        // Ring size minus one, the size is a power of two
+    int dropped;                              // Blocks dropped after the latest written one
+    unsigned long long received;              // Statistics, see um_get_uma_ring_stats
+    unsigned long long dropped_total;
+    unsigned long long missing;
+    um_uma_block blocks[];
+} um_uma_ring;
+
+/*
+ * uMa recording file, memory mapped and preallocated. The header at the start of the mapping
+ * is updated after every block. The disk space is reserved before mapping, a store into
+ * a sparse mapping would raise SIGBUS when the disk gets full. The file is mapped with the
+ * new size before the old mapping is released, a failed growth keeps the recorded data.
+ */
+#define UM_UMA_RECORD_CHUNK  (16 * 1024 * 1024) // Initial file size, doubled when full
+
+// The header keeps the whole uMa register file, fails to compile if the two drift apart
+typedef char um_uma_record_regs_check[LIBUM_UMA_RECORD_REGS == UMA_REG_COUNT ? 1 : -1];
+
+typedef struct um_uma_recorder_s
+{
+    int dev;                                  // Recorded device id
+    bool failed;                              // The file could not be grown, recording stopped
+#ifdef _WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+    unsigned char *base;                      // Mapped file, starts with um_uma_record_header
+    unsigned long long size;                  // Mapped and allocated file size
+    unsigned long long recorded;              // Size of the header and the blocks written, the final file size
+} um_uma_recorder;
+
+// Pressure samples fitting in a response, recorded in parts of this size by umc_record_pressure
+#define UM_RECORD_CHUNK_SAMPLES ((int) ((LIBUM_MAX_MESSAGE_SIZE - SMCP1_FRAME_SIZE - SMCP1_SUB_BLOCK_HEADER_SIZE) / \
+                                        sizeof (int32_t)) - 1)
+
+/*
+ * Pressure sequence run by a uMc channel. A sequence longer than a message is sent in parts,
+ * the next part when the channel busy status bit shows the previous one completed.
+ */
+#define UM_SEQUENCE_PART_STEPS ((int) ((LIBUM_MAX_MESSAGE_SIZE - SMCP1_FRAME_SIZE - 2 * SMCP1_SUB_BLOCK_HEADER_SIZE) / \
+                                       sizeof (int32_t)) - 1)
+
+typedef struct um_sequence_s
+{
+    int count;                                // Count of the steps
+    int sent;                                 // Count of the steps sent
+    int ticket;                               // Request of the latest part, zero when acknowledged
+    int result;                               // Error code if a part was not acknowledged, zero otherwise
+    bool busy_seen;                           // Channel seen busy after sending the latest part
+    int32_t steps[];                          // Steps in the wire format
+} um_sequence;
+
+/*
+ * uMa register shadow. Register writes update the shadow and are sent coalesced in a single
+ * SMCP1_SET_UMA_REGS message at most once per flush interval, reads are served from it.
+ */
+typedef struct um_uma_shadow_s
+{
+    int regs[UMA_REG_COUNT];                  // Register values as written by the application
+    unsigned int dirty;                       // Bit per register not yet sent
+    unsigned int sending;                     // Bit per register in the flush in flight
+    int ticket;                               // Flush in flight, zero if none
+    int result;                               // Error code of a failed background flush, zero otherwise
+    int interval_ms;                          // Minimum time between the flushes
+    unsigned long long flushed_ms;            // Time of the latest flush
+} um_uma_shadow;
+
+static void um_sequences_free(um_device *device) {
+    int i;
+    for (i = 0; i < 8; i++) {
+        free (device->sequences[i]);
+        device->sequences[i] = NULL;
+    }
+}
+
+static unsigned int um_device_hash(const int dev_id) {
+    unsigned int h = (unsigned int) dev_id;
+    h ^= h >> 16;
+    h *= 0x45d9f3bU;
+    h ^= h >> 16;
+    return h;
+}
+
+static um_device_index *um_device_index_create(const int size) {
+    um_device_index *index;
+    if (!(index = calloc (1, sizeof (um_device_index) + size * sizeof (um_device *)))) {
+        return NULL;
+    }
+    index->size = size;
+    return index;
+}
+
+static um_device_table *um_device_table_create(void) {
+    um_device_table *table;
+    if (!(table = calloc (1, sizeof (um_device_table)))) {
+        return NULL;
+    }
+    table->index = um_device_index_create (LIBUM_DEVICE_TABLE_INIT_SIZE);
+    table->entries = calloc (LIBUM_DEVICE_TABLE_INIT_SIZE / 2, sizeof (um_device *));
+    if (!table->index || !table->entries) {
+        free (table->index);
+        free (table->entries);
+        free (table);
+        return NULL;
+    }
+#ifdef LIBUM_SPARSE_DEVICE_TABLE
+    table->unknown.last_positions.x = SMCP1_ARG_UNDEF;
+    table->unknown.last_positions.y = SMCP1_ARG_UNDEF;
+    table->unknown.last_positions.z = SMCP1_ARG_UNDEF;
+    table->unknown.last_positions.d = SMCP1_ARG_UNDEF;
+#endif
+    return table;
+}
+
+static void um_device_table_free(um_device_table *table) {
+    int i;
+    um_device_index *index, *retired;
+    if (!table) {
+        return;
+    }
+    for (i = 0; i < table->count; i++) {
+        um_position_history_free (table->entries[i]->history);
+        um_sequences_free (table->entries[i]);
+        free (table->entries[i]->uma_shadow);
+        free (table->entries[i]);
+    }
+    um_position_history_free (table->fallback.history);
+    um_sequences_free (&table->fallback);
+    free (table->fallback.uma_shadow);
+    for (index = table->index; index; index = retired) {
+        retired = index->retired;
+        free (index);
+    }
+    free (table->entries);
+    free (table);
+}
+
+static um_device *volatile *um_device_slot(um_device_index *index, const int dev_id) {
+    unsigned int mask = (unsigned int) index->size - 1;
+    unsigned int i = um_device_hash (dev_id) & mask;
+    while (index->slots[i] && index->slots[i]->dev_id != dev_id) {
+        i = (i + 1) & mask;
+    }
+    return &index->slots[i];
+}
+
+static bool um_device_table_grow(um_device_table *table) {
+    int i, size = table->index->size * 2;
+    um_device **entries;
+    um_device_index *index;
+    if (!(entries = realloc (table->entries, size / 2 * sizeof (um_device *)))) {
+        return false;
+    }
+    table->entries = entries;
+    if (!(index = um_device_index_create (size))) {
+        return false;
+    }
+    for (i = 0; i < table->count; i++) {
+        *um_device_slot (index, entries[i]->dev_id) = entries[i];
+    }
+    index->retired = table->index;
+    um_barrier ();
+    table->index = index;
+    return true;
+}
+
+static um_device *um_device_insert(um_device_table *table, const int dev_id) {
+    um_device *volatile *slot = um_device_slot (table->index, dev_id);
+    um_device *device;
+
+    if (*slot) {
+        return *slot;
+    }
+    // Keep the load factor below 50% to keep probe sequences short
+    if ((table->count + 1) * 2 > table->index->size) {
+        if (!um_device_table_grow (table)) {
+            return &table->fallback;
+        }
+        slot = um_device_slot (table->index, dev_id);
+    }
+    if (!(device = calloc (1, sizeof (um_device)))) {
+        return &table->fallback;
+    }
+    device->dev_id = dev_id;
+#ifdef LIBUM_SPARSE_DEVICE_TABLE
+    device->last_positions.x = SMCP1_ARG_UNDEF;
+    device->last_positions.y = SMCP1_ARG_UNDEF;
+    device->last_positions.z = SMCP1_ARG_UNDEF;
+    device->last_positions.d = SMCP1_ARG_UNDEF;
+#endif
+    table->entries[table->count++] = device;
+    um_barrier ();
+    *slot = device;
+    return device;
+}
+
+static um_device *um_device_get(um_state *hndl, const int dev_id) {
+    um_device *device = *um_device_slot (hndl->devices->index, dev_id);
+    if (device) {
+        return device;
+    }
+    um_state_lock (hndl);
+    device = um_device_insert (hndl->devices, dev_id);
+    um_state_unlock (hndl);
+    return device;
+}
+
+// Lookup only for the readers, an unknown id gets the shared zeroed entry instead of a new one
+static const um_device *um_device_find(um_state *hndl, const int dev_id) {
+    const um_device *device = *um_device_slot (hndl->devices->index, dev_id);
+    return device ? device : &hndl->devices->unknown;
+}
+
+// The active list is walked without locking, entries are linked at the head
+static void um_device_activate(um_state *hndl, um_device *device) {
+    um_device_table *table = hndl->devices;
+    if (device->active || device == &table->fallback) {
+        return;
+    }
+    um_state_lock (hndl);
+    device->active = true;
+    device->active_prev = NULL;
+    device->active_next = table->active;
+    if (table->active) {
+        table->active->active_prev = device;
+    }
+    um_barrier ();
+    table->active = device;
+    um_state_unlock (hndl);
+}
+
+static void um_device_deactivate(um_state *hndl, um_device *device) {
+    um_device_table *table = hndl->devices;
+    if (!device->active) {
+        return;
+    }
+    um_state_lock (hndl);
+    if (device->active_prev) {
+        device->active_prev->active_next = device->active_next;
+    } else {
+        table->active = device->active_next;
+    }
+    if (device->active_next) {
+        device->active_next->active_prev = device->active_prev;
+    }
+    device->active = false;
+    device->active_prev = device->active_next = NULL;
+    um_state_unlock (hndl);
+}
+
+static void um_device_info_clear(um_state *hndl, const int dev_id) {
+    um_device *device = um_device_get (hndl, dev_id);
+    um_state_lock (hndl);
+    memset(&device->info, 0, sizeof (um_device_info));
+    um_state_unlock (hndl);
+}
+
+// Accessors for the per device caches, lvalues in both table layouts
+#ifdef LIBUM_SPARSE_DEVICE_TABLE
+# define DEV_STATUS(hndl, dev)          (um_device_get ((hndl), (dev))->last_status)
+# define DEV_DRIVE_STATUS(hndl, dev)    (um_device_get ((hndl), (dev))->drive_status)
+# define DEV_DRIVE_STATUS_ID(hndl, dev) (um_device_get ((hndl), (dev))->drive_status_id)
+# define DEV_DRIVE_STATUS_TS(hndl, dev) (um_device_get ((hndl), (dev))->drive_status_ts)
+# define DEV_ADDRESS(hndl, dev)         (um_device_get ((hndl), (dev))->address)
+# define DEV_POSITIONS(hndl, dev)       (um_device_get ((hndl), (dev))->last_positions)
+# define DEV_LAST_MSG_TS(hndl, dev)     (um_device_get ((hndl), (dev))->last_msg_ts)
+#else
+# define DEV_STATUS(hndl, dev)          ((hndl)->last_status[(dev)])
+# define DEV_DRIVE_STATUS(hndl, dev)    ((hndl)->drive_status[(dev)])
+# define DEV_DRIVE_STATUS_ID(hndl, dev) ((hndl)->drive_status_id[(dev)])
+# define DEV_DRIVE_STATUS_TS(hndl, dev) ((hndl)->drive_status_ts[(dev)])
+# define DEV_ADDRESS(hndl, dev)         ((hndl)->addresses[(dev)])
+# define DEV_POSITIONS(hndl, dev)       ((hndl)->last_positions[(dev)])
+# define DEV_LAST_MSG_TS(hndl, dev)     ((hndl)->last_msg_ts[(dev)])
+#endif
+
+// Read only accessors, an unknown id is not added to the table
+#ifdef LIBUM_SPARSE_DEVICE_TABLE
+# define DEV_PEEK_STATUS(hndl, dev)          (um_device_find ((hndl), (dev))->last_status)
+# define DEV_PEEK_DRIVE_STATUS(hndl, dev)    (um_device_find ((hndl), (dev))->drive_status)
+# define DEV_PEEK_DRIVE_STATUS_TS(hndl, dev) (um_device_find ((hndl), (dev))->drive_status_ts)
+# define DEV_PEEK_ADDRESS(hndl, dev)         (um_device_find ((hndl), (dev))->address)
+# define DEV_PEEK_POSITIONS(hndl, dev)       (um_device_find ((hndl), (dev))->last_positions)
+#else
+# define DEV_PEEK_STATUS(hndl, dev)          DEV_STATUS((hndl), (dev))
+# define DEV_PEEK_DRIVE_STATUS(hndl, dev)    DEV_DRIVE_STATUS((hndl), (dev))
+# define DEV_PEEK_DRIVE_STATUS_TS(hndl, dev) DEV_DRIVE_STATUS_TS((hndl), (dev))
+# define DEV_PEEK_ADDRESS(hndl, dev)         DEV_ADDRESS((hndl), (dev))
+# define DEV_PEEK_POSITIONS(hndl, dev)       DEV_POSITIONS((hndl), (dev))
+#endif
+
+/*
+ * Position cache sequence lock. Writers hold the state lock, readers retry
+ * the copy if it was written meanwhile.
+ */
+static um_positions *um_positions_write_begin(um_state *hndl, const int dev_id) {
+    um_device *device = um_device_get (hndl, dev_id);
+    um_state_lock (hndl);
+    device->positions_seq++;
+    um_barrier ();
+    return &DEV_POSITIONS(hndl, dev_id);
+}
+
+static void um_position_history_append(um_state *hndl, um_device *device, const um_positions *positions) {
+    int capacity = hndl->devices->history_capacity;
+    um_position_history *history = device->history, *resized;
+    um_position_sample *sample;
+
+    if (!capacity) {
+        return;
+    }
+    if (!history || history->capacity != capacity) {
+        if (!(resized = calloc (1, sizeof (um_position_history) + capacity * sizeof (um_position_sample)))) {
+            return;
+        }
+        resized->capacity = capacity;
+        resized->retired = history;
+        um_barrier ();
+        device->history = history = resized;
+    }
+    history->seq++;
+    um_barrier ();
+    sample = &history->samples[history->count % capacity];
+    sample->timestamp_us = positions->updated_us;
+    sample->processed_us = um_clock_us ();
+    sample->x = positions->x;
+    sample->y = positions->y;
+    sample->z = positions->z;
+    sample->d = positions->d;
+    history->count++;
+    um_barrier ();
+    history->seq++;
+}
+
+static void um_positions_write_end(um_state *hndl, const int dev_id) {
+    um_device *device = um_device_get (hndl, dev_id);
+    um_position_history_append (hndl, device, &DEV_POSITIONS(hndl, dev_id));
+    um_barrier ();
+    device->positions_seq++;
+    um_state_unlock (hndl);
+}
+
+static void um_positions_read(um_state *hndl, const int dev_id, um_positions *positions) {
+    const um_device *device = um_device_find (hndl, dev_id);
+    unsigned int seq;
+    do {
+        seq = um_seq_read_begin (&device->positions_seq);
+        memcpy(positions, &DEV_PEEK_POSITIONS(hndl, dev_id), sizeof (um_positions));
+        um_barrier ();
+    } while (seq != device->positions_seq);
+}
+
+// Wait for the socket to become readable, poll is not limited by FD_SETSIZE like select
+static int udp_select(um_state *hndl, int timeout) {
+#ifdef _WINDOWS
+    WSAPOLLFD pfd;
+#else
+    struct pollfd pfd;
+#endif
+    if (hndl->socket == INVALID_SOCKET) {
+        return -1;
+    }
+    if (timeout < 0) {
+        timeout = hndl->timeout;
+    }
+    pfd.fd = hndl->socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+#ifdef _WINDOWS
+    return WSAPoll (&pfd, 1, timeout);
+#else
+    return poll (&pfd, 1, timeout);
+#endif
+}
+
+static bool udp_set_address(IPADDR *addr, const char *s) {
+    if (!addr || !s) {
+        return false;
+    }
+    addr->sin_family = AF_INET;
+    return ((int) (addr->sin_addr.s_addr = inet_addr (s)) != -1);
+    // return inet_aton(s, &addr->sin_addr) > 0;
+}
+
+/*
+ * Kernel receive timestamps. On Linux the socket is asked for SO_TIMESTAMPNS, the arrival time
+ * of each datagram then comes in a control message. It is in CLOCK_REALTIME and converted
+ * to the SDK time base with an offset read next to the monotonic clock. The offset is compared
+ * to the previous one to detect a wall clock step, the timestamps of the datagrams queued
+ * before the step cannot be converted and the processing time is used for them instead.
+ * A datagram queued for long, e.g. while the application stalled, keeps its arrival time.
+ */
+
+#ifdef __linux__
+#define UM_HAVE_RX_TIMESTAMPS
+#define UM_RX_CONTROL_SIZE          CMSG_SPACE(sizeof (struct timespec))
+#define UM_RX_CLOCK_STEP_US         1000      // Offset change telling of a step, on top of the slewing below
+#define UM_RX_CLOCK_SLEW_PPM        1000      // Max wall clock slewing rate of NTP and adjtime
+
+// Offset from the kernel receive timestamps to the SDK time base, now_us read just before.
+// Returns false if the wall clock was stepped since the previous call
+static bool um_rx_clock_offset_us(um_state *hndl, const unsigned long long now_us, long long *offset_us) {
+    struct timespec ts;
+    long long delta_us, allowed_us;
+
+    if (clock_gettime (CLOCK_REALTIME, &ts) < 0) {
+        return false;
+    }
+    *offset_us = (long long) now_us - ((long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+    delta_us = *offset_us - hndl->rx_clock_offset_us;
+    allowed_us = UM_RX_CLOCK_STEP_US + (long long) (now_us - hndl->rx_clock_checked_us) / 1000000LL *
+                                       UM_RX_CLOCK_SLEW_PPM;
+    hndl->rx_clock_offset_us = *offset_us;
+    hndl->rx_clock_checked_us = now_us;
+    return delta_us <= allowed_us && delta_us >= -allowed_us;
+}
+
+// Arrival time of a received datagram in the SDK time base, now_us if the kernel did not timestamp it
+static unsigned long long um_rx_arrival_us(struct msghdr *hdr, const unsigned long long now_us,
+                                           const long long offset_us) {
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+    long long arrival_us;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof (ts));
+            arrival_us = (long long) ts.tv_sec * 1000000LL + ts.tv_nsec / 1000 + offset_us;
+            if (arrival_us > 0 && arrival_us <= (long long) now_us) {
+                return (unsigned long long) arrival_us;
+            }
+            break;
+        }
+    }
+    return now_us;
+}
+#endif
+
+static int
+udp_recv(um_state *hndl, unsigned char *response, const size_t response_size, IPADDR *from,
+         unsigned long long *arrival_us, const int timeout) {
+    int ret;
+#ifdef UM_HAVE_RX_TIMESTAMPS
+    unsigned long long now_us;
+    long long offset_us;
+    char control[UM_RX_CONTROL_SIZE];
+    struct iovec iov;
+    struct msghdr hdr;
+#endif
+    if ((ret = udp_select (hndl, timeout)) < 0) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "select failed - %s", strerror (hndl->last_error));
+        return ret;
+    } else if (!ret) {
+        hndl->last_os_errno = timeoutError;
+        strcpy(hndl->errorstr_buffer, "timeout");
+        return ret;
+    }
+
+#ifdef UM_HAVE_RX_TIMESTAMPS
+    iov.iov_base = response;
+    iov.iov_len = response_size;
+    memset(&hdr, 0, sizeof (hdr));
+    hdr.msg_name = from;
+    hdr.msg_namelen = sizeof (IPADDR);
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    if (hndl->rx_timestamps) {
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof (control);
+    }
+    if ((ret = recvmsg (hndl->socket, &hdr, 0)) == SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "recvmsg failed - %s", strerror (hndl->last_error));
+        return ret;
+    }
+    now_us = um_clock_us ();
+    *arrival_us = hndl->rx_timestamps && um_rx_clock_offset_us (hndl, now_us, &offset_us) ?
+                  um_rx_arrival_us (&hdr, now_us, offset_us) : now_us;
+#else
+    socklen_t len = sizeof (IPADDR);
+    if ((ret = recvfrom (hndl->socket, (char *) response, response_size, 0, (struct sockaddr *) from, &len)) ==
+        SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "recvfrom failed - %s", strerror (hndl->last_error));
+        return ret;
+    }
+    *arrival_us = um_clock_us ();
+#endif
+    return ret;
+}
+
+/*
+ * Receive buffers for draining the socket. On Linux up to UM_RECV_BATCH_SIZE datagrams are read
+ * with a single recvmmsg call, elsewhere (or if the kernel lacks recvmmsg) one per recvfrom.
+ */
+
+#ifdef __linux__
+#define UM_HAVE_RECVMMSG
+#define UM_RECV_BATCH_SIZE   16
+#else
+#define UM_RECV_BATCH_SIZE   1
+#endif
+
+typedef struct um_recv_batch_s
+{
+    um_message msgs[UM_RECV_BATCH_SIZE];
+    IPADDR from[UM_RECV_BATCH_SIZE];
+    int sizes[UM_RECV_BATCH_SIZE];
+    unsigned long long arrival_us[UM_RECV_BATCH_SIZE]; // In the SDK time base
+#ifdef UM_HAVE_RECVMMSG
+    struct mmsghdr hdrs[UM_RECV_BATCH_SIZE];
+    struct iovec iovs[UM_RECV_BATCH_SIZE];
+    char controls[UM_RECV_BATCH_SIZE][UM_RX_CONTROL_SIZE];
+    bool recvmmsg_missing;                    // ENOSYS got, use the recvfrom fallback
+#endif
+    bool draining;                            // In use by um_recv_drain, set under the state lock
+} um_recv_batch;
+
+// Read at most max of the already queued datagrams without blocking, returns the count read
+static int udp_recv_batch(um_state *hndl, um_recv_batch *batch, int max) {
+    int i, ret;
+    socklen_t len;
+#ifdef UM_HAVE_RECVMMSG
+    unsigned long long now_us;
+    long long offset_us;
+    bool converted;
+    if (max > UM_RECV_BATCH_SIZE) {
+        max = UM_RECV_BATCH_SIZE;
+    }
+    if (!batch->recvmmsg_missing) {
+        for (i = 0; i < max; i++) {
+            batch->iovs[i].iov_base = batch->msgs[i];
+            batch->iovs[i].iov_len = sizeof (um_message);
+            batch->hdrs[i].msg_hdr.msg_name = &batch->from[i];
+            batch->hdrs[i].msg_hdr.msg_namelen = sizeof (IPADDR);
+            batch->hdrs[i].msg_hdr.msg_iov = &batch->iovs[i];
+            batch->hdrs[i].msg_hdr.msg_iovlen = 1;
+            batch->hdrs[i].msg_hdr.msg_control = hndl->rx_timestamps ? batch->controls[i] : NULL;
+            batch->hdrs[i].msg_hdr.msg_controllen = hndl->rx_timestamps ? sizeof (batch->controls[i]) : 0;
+        }
+        if ((ret = recvmmsg (hndl->socket, batch->hdrs, max, MSG_DONTWAIT, NULL)) >= 0) {
+            // The clocks are read once per batch
+            now_us = um_clock_us ();
+            converted = hndl->rx_timestamps && um_rx_clock_offset_us (hndl, now_us, &offset_us);
+            for (i = 0; i < ret; i++) {
+                batch->sizes[i] = (int) batch->hdrs[i].msg_len;
+                batch->arrival_us[i] = converted ?
+                                       um_rx_arrival_us (&batch->hdrs[i].msg_hdr, now_us, offset_us) : now_us;
+            }
+            return ret;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != ENOSYS) {
+            hndl->last_os_errno = getLastError();
+            sprintf(hndl->errorstr_buffer, "recvmmsg failed - %s", strerror (hndl->last_os_errno));
+            return ret;
+        }
+        batch->recvmmsg_missing = true;
+    }
+#endif
+    if ((ret = udp_select (hndl, 0)) < 1) {
+        return ret;
+    }
+    len = sizeof (IPADDR);
+    if ((ret = recvfrom (hndl->socket, (char *) batch->msgs[0], sizeof (um_message), 0,
+                         (struct sockaddr *) &batch->from[0], &len)) == SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "recvfrom failed - %s", strerror (hndl->last_os_errno));
+        return ret;
+    }
+    batch->sizes[0] = ret;
+    batch->arrival_us[0] = um_clock_us ();
+    (void) max;
+    return 1;
+}
+
+static bool udp_set_sock_opt_addr_reuse(um_state *hndl) {
+#ifdef _WINDOWS
+    char yes = 1;
+#else
+    int yes = 1;
+#endif
+    if (setsockopt (hndl->socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof (yes)) < 0) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "address reuse setopt failed - %s", strerror (hndl->last_error));
+        return false;
+    }
+    return true;
+}
+
+static bool udp_set_sock_opt_mcast_group(um_state *hndl, const IPADDR *addr) {
+    struct ip_mreq mreq;
+    memset(&mreq, 0, sizeof (mreq));
+    mreq.imr_multiaddr = addr->sin_addr;
+    setsockopt (hndl->socket, IPPROTO_IP, IP_DROP_MEMBERSHIP, SOCKOPT_CAST &mreq, sizeof (mreq));
+    if (setsockopt (hndl->socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, SOCKOPT_CAST &mreq, sizeof (mreq)) < 0) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "join to multicast group failed - %s", strerror (hndl->last_error));
+        return false;
+    }
+    return true;
+}
+
+static bool udp_set_sock_opt_bcast(um_state *hndl) {
+#ifdef _WINDOWS
+    char yes = 1;
+#else
+    int yes = 1;
+#endif
+    if (setsockopt (hndl->socket, SOL_SOCKET, SO_BROADCAST, &yes, sizeof (yes)) < 0) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "broadcast enable failed - %s", strerror (hndl->last_error));
+        return false;
+    }
+    return true;
+}
+
+// Ask for the kernel receive timestamps, the datagrams are timestamped on processing without them
+static void udp_set_sock_opt_rx_timestamps(um_state *hndl) {
+#ifdef UM_HAVE_RX_TIMESTAMPS
+    int yes = 1;
+    if (setsockopt (hndl->socket, SOL_SOCKET, SO_TIMESTAMPNS, &yes, sizeof (yes)) < 0) {
+        um_log_print (hndl, 1, __PRETTY_FUNCTION__, "kernel receive timestamps not available - %s",
+                      strerror (getLastError()));
+        return;
+    }
+    // The reference for detecting the wall clock steps
+    hndl->rx_clock_checked_us = um_clock_us ();
+    um_rx_clock_offset_us (hndl, hndl->rx_clock_checked_us, &hndl->rx_clock_offset_us);
+    hndl->rx_timestamps = 1;
+#else
+    (void) hndl;
+#endif
+}
+
+bool udp_get_local_address(um_state *hndl, IPADDR *addr) {
+    if (!addr) {
+        return false;
+    }
+    addr->sin_family = AF_INET;
+    // Obtain the local address by connecting an UDP socket
+    // TCP/IP stack will resolve the correct network interface
+    SOCKET testSocket;
+
+    if ((testSocket = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "socket create failed - %s", strerror (hndl->last_error));
+        return false;
+    }
+    socklen_t addrLen = sizeof (IPADDR);
+    if (connect (testSocket, (struct sockaddr *) &hndl->raddr, addrLen) == SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "connect failed - %s", strerror (hndl->last_error));
+        closesocket (testSocket);
+        return false;
+    }
+    if (getsockname (testSocket, (struct sockaddr *) addr, &addrLen) == SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "getsockname failed - %s", strerror (hndl->last_error));
+        closesocket (testSocket);
+        return false;
+    }
+    closesocket (testSocket);
+    um_log_print (hndl, 2, __PRETTY_FUNCTION__, "%s:%d", inet_ntoa (addr->sin_addr), ntohs(addr->sin_port));
+    return true;
+}
+
+static bool udp_is_multicast_address(IPADDR *addr) {
+    return ntohl(addr->sin_addr.s_addr) >> 24 == 224;
+}
+
+static bool udp_is_loopback_address(IPADDR *addr) {
+    return ntohl(addr->sin_addr.s_addr) >> 24 == 127;
+}
+
+static bool udp_is_broadcast_address(IPADDR *addr) {
+    return (ntohl(addr->sin_addr.s_addr) & 0xff) == 0xff;
+}
+
+static bool udp_init(um_state *hndl, const char *broadcast_address) {
+    bool ok = true;
+#ifdef _WINDOWS
+    WSADATA wsaData;
+    // Initialize winsocket
+    if(WSAStartup(MAKEWORD(2, 2), &wsaData))
+    {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "WSAStartup failed (%d)\n", hndl->last_error);
+        return 0;
+    }
+#endif
+    if ((hndl->socket = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "socket create failed - %s", strerror (hndl->last_error));
+        ok = false;
+    }
+    if (ok && !udp_set_address (&hndl->raddr, broadcast_address ? broadcast_address : LIBUM_DEF_BCAST_ADDRESS)) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "invalid remote address - %s\n", strerror (hndl->last_error));
+        ok = false;
+    }
+    if (ok && !udp_set_address (&hndl->laddr, LIBUM_ANY_IPV4_ADDR)) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "invalid local address - %s\n", strerror (hndl->last_error));
+        ok = false;
+    }
+
+    // Dynamic port used in windows by default
+    if (!hndl->local_port) {
+        hndl->laddr.sin_port = 0;
+        // change local port to avoid conflict on localhost testing
+    } else if (udp_is_loopback_address (&hndl->raddr)) {
+        hndl->laddr.sin_port = htons(hndl->local_port - 2);
+    } else {
+        hndl->laddr.sin_port = htons(hndl->local_port);
+    }
+
+    hndl->raddr.sin_port = htons(hndl->udp_port);
+    if (ok) {
+        ok = udp_set_sock_opt_addr_reuse (hndl);
+    }
+#ifndef NO_UDP_MULTICAST
+    if (ok && udp_is_multicast_address (&hndl->raddr)) {
+        ok = udp_set_sock_opt_mcast_group (hndl, &hndl->raddr);
+    }
+#endif
+    if (ok && udp_is_broadcast_address (&hndl->raddr)) {
+        ok = udp_set_sock_opt_bcast (hndl);
+    }
+    if (ok) {
+        udp_set_sock_opt_rx_timestamps (hndl);
+    }
+
+    int i, ret = 0;
+    for (i = 0; ok && i < 2 &&
+                (ret = bind (hndl->socket, (struct sockaddr *) &hndl->laddr, sizeof (IPADDR))) == SOCKET_ERROR; i++) {
+        hndl->last_os_errno = getLastError();
+        if (hndl->last_os_errno == EADDRINUSE) {
+            // Attempt bind dynamic port
+            hndl->laddr.sin_port = 0;
+            continue;
+        }
+        sprintf(hndl->errorstr_buffer, "bind failed - %s\n", strerror (hndl->last_error));
+        ok = false;
+    }
+#ifdef _WINDOWS
+    if(!ok)
+        WSACleanup();
+#endif
+    return ok && ret >= 0;
+}
+
+static int set_last_error(um_state *hndl, int code) {
+    char *txt;
+    // Errors of the receiver thread are not interesting to the application
+    if (hndl && !um_receiver_is_self (hndl)) {
+        hndl->last_error = code;
+        const char *txt = um_errorstr (code);
+        if (txt) {
+            strcpy(hndl->errorstr_buffer, txt);
+        }
+    }
+    return code;
+}
+
+static bool um_resolve_dev_ip_address(um_state *hndl, const int dev, IPADDR *to) {
+    if (dev < SMCP1_DIRECT_ADDRESS_LIMIT) {
+        return false;
+    }
+    uint32_t addr = LINK_LOCAL_IPV4_NET | (dev & 0xffff);
+    to->sin_family = AF_INET;
+    to->sin_port = htons(hndl->udp_port);
+    to->sin_addr.s_addr = htonl(addr);
+    return true;
+}
+
+int um_has_unicast_address(um_state *hndl, const int dev) {
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    int dev_id = um_resolve_dev_id (dev);
+    return DEV_PEEK_ADDRESS(hndl, dev_id).sin_addr.s_addr != 0;
+}
+
+static int um_send(um_state *hndl, const int dev, const unsigned char *data, int dataSize) {
+    int ret;
+    IPADDR to;
+
+    if (dev > 0 && dev < LIBUM_MAX_DEVS && DEV_PEEK_ADDRESS(hndl, dev).sin_port &&
+        DEV_PEEK_ADDRESS(hndl, dev).sin_family)
+        memcpy(&to, &DEV_PEEK_ADDRESS(hndl, dev), sizeof (IPADDR));
+    else if (!um_resolve_dev_ip_address (hndl, dev, &to))
+        memcpy(&to, &hndl->raddr, sizeof (IPADDR));
+
+    if (hndl->verbose > 1) {
         int i;
         smcp1_frame *header = (smcp1_frame *) data;
         smcp1_subblock_header *sub_block = (smcp1_subblock_header *) (((unsigned char *) data) + SMCP1_FRAME_SIZE);
@@ -531,19 +1493,277 @@ static int um_send(um_state *hndl, const int dev, const unsigned char *data, int
                               (int) ntohl(*data_ptr), i < data_size - 1 ? ',' : ' ');
         }
     }
-
-    if ((ret = sendto (hndl->socket, (char *) data, dataSize, 0, (struct sockaddr *) &to, sizeof (IPADDR))) ==
-        SOCKET_ERROR) {
-        hndl->last_os_errno = getLastError();
-        sprintf(hndl->errorstr_buffer, "sendto failed - %s\n", strerror (hndl->last_os_errno));
-        return set_last_error (hndl, LIBUM_OS_ERROR);
-    }
-    hndl->last_msg_ts[dev] = um_get_timestamp_ms ();
-    return ret;
+
+    if ((ret = sendto (hndl->socket, (char *) data, dataSize, 0, (struct sockaddr *) &to, sizeof (IPADDR))) ==
+        SOCKET_ERROR) {
+        hndl->last_os_errno = getLastError();
+        sprintf(hndl->errorstr_buffer, "sendto failed - %s\n", strerror (hndl->last_os_errno));
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    DEV_LAST_MSG_TS(hndl, dev) = um_clock_ms ();
+    // Sent to a known address, keep the device in the active list
+    if (dev > 0 && dev < LIBUM_MAX_DEVS && DEV_PEEK_ADDRESS(hndl, dev).sin_family) {
+        um_device_activate (hndl, um_device_get (hndl, dev));
+    }
+    return ret;
+}
+
+/*
+ * Pending request table
+ *
+ * Every request expecting an ACK or a response occupies a slot until its result is
+ * harvested. Replies are matched to the slots by the receiver and message id, any sender
+ * matches a request sent to a group address. Request frames are kept for retransmits.
+ * The slots are modified while holding the state lock.
+ */
+
+#define UM_REQUEST_FREE            0
+#define UM_REQUEST_PENDING         1
+#define UM_REQUEST_DONE            2
+
+#define UM_REQUEST_ACK_REQUESTED   0x01
+#define UM_REQUEST_RESP_REQUESTED  0x02
+#define UM_REQUEST_ACK_GOT         0x04
+#define UM_REQUEST_RESP_GOT        0x08
+#define UM_REQUEST_DETACHED        0x10      // Nobody waits for the result, applied by um_request_detached_done
+
+#define UM_TICKET_INDEX_BITS       6      // LIBUM_MAX_PENDING slots
+
+typedef struct um_request_s
+{
+    int state;                                // UM_REQUEST_FREE, _PENDING or _DONE
+    int flags;                                // UM_REQUEST_ACK_REQUESTED etc.
+    unsigned short generation;                // Incremented on every use, detects stale tickets
+    unsigned short message_id;
+    int dev_id;                               // Device id the request is sent to
+    int receiver_id;                          // SMCPv1 receiver id of the request
+    int type;                                 // Command
+    int attempts;                             // Transmission count
+    int size;                                 // Request frame size
+    int result;                               // Error code or send result when done
+    unsigned long long sent_us;               // Latest transmission time
+    int rto_us;                               // Retransmit timeout, doubled on every retransmit
+    unsigned long long expire_us;             // Not given up before this even if retransmitted sooner
+    unsigned long long process_us;            // Device processing time expected after the ACK, e.g. a recording
+    um_message *req;                          // Request frame, allocated on the first use of the slot
+    um_message *resp;                         // Response frame
+    int resp_size;                            // Received bytes in the above
+    unsigned long long resp_us;               // Arrival time of the response
+} um_request;
+
+typedef struct um_request_table_s
+{
+    um_request slots[LIBUM_MAX_PENDING];
+    int pending;                              // Count of pending slots
+} um_request_table;
+
+static bool um_is_group_id(const int dev_id) {
+    return dev_id == SMCP1_ALL || dev_id == SMCP1_ALL_DEVICES || dev_id == SMCP1_ALL_CUS ||
+           dev_id == SMCP1_ALL_OTHERS || dev_id == SMCP1_ALL_PCS;
+}
+
+static void um_request_table_free(um_request_table *table) {
+    int i;
+    if (!table) {
+        return;
+    }
+    for (i = 0; i < LIBUM_MAX_PENDING; i++) {
+        free (table->slots[i].req);
+    }
+    free (table);
+}
+
+static int um_request_ticket(um_state *hndl, const um_request *request) {
+    int index = (int) (request - hndl->requests->slots);
+    return (request->generation << UM_TICKET_INDEX_BITS) | index;
+}
+
+// Resolve a ticket to its slot, NULL for a stale or an invalid ticket
+static um_request *um_request_get(um_state *hndl, const int ticket) {
+    um_request *request;
+    if (ticket < 0) {
+        return NULL;
+    }
+    request = &hndl->requests->slots[ticket & (LIBUM_MAX_PENDING - 1)];
+    if (request->state == UM_REQUEST_FREE || request->generation != (ticket >> UM_TICKET_INDEX_BITS)) {
+        return NULL;
+    }
+    return request;
+}
+
+static um_request *um_request_alloc(um_state *hndl) {
+    int i;
+    um_request *request;
+    for (i = 0; i < LIBUM_MAX_PENDING; i++) {
+        request = &hndl->requests->slots[i];
+        if (request->state != UM_REQUEST_FREE) {
+            continue;
+        }
+        // Request and response frames in one allocation, kept until the handle is closed
+        if (!request->req) {
+            if (!(request->req = malloc (2 * sizeof (um_message)))) {
+                return NULL;
+            }
+            request->resp = request->req + 1;
+        }
+        request->generation = request->generation % 0xffff + 1;
+        request->state = UM_REQUEST_PENDING;
+        request->flags = 0;
+        request->attempts = 0;
+        request->result = 0;
+        request->process_us = 0;
+        return request;
+    }
+    return NULL;
+}
+
+static void um_request_release(um_state *hndl, um_request *request) {
+    um_state_lock (hndl);
+    if (request->state == UM_REQUEST_PENDING) {
+        hndl->requests->pending--;
+    }
+    request->state = UM_REQUEST_FREE;
+    um_state_unlock (hndl);
+}
+
+static void um_request_detached_done(um_state *hndl, um_request *request);
+static void um_sequence_status(um_state *hndl, const int dev_id, const int status);
+static void um_uma_shadow_service(um_state *hndl);
+
+static void um_request_done(um_state *hndl, um_request *request, const int result) {
+    request->state = UM_REQUEST_DONE;
+    request->result = result;
+    hndl->requests->pending--;
+    if (request->flags & UM_REQUEST_DETACHED) {
+        um_request_detached_done (hndl, request);
+    }
+    // um_flush_uma_regs waits for a detached flush too
+    um_cond_broadcast (&hndl->lock->cond);
+}
+
+/*
+ * Round trip time estimation per device, RFC 6298 style. Only replies to requests sent once
+ * are sampled (Karn's algorithm), a reply to a retransmitted request is ambiguous.
+ * Until the first sample the session timeout is used as the retransmit timeout.
+ * The estimate only decides when to retransmit, a request is not given up before
+ * the session timeout (um_set_timeout) per allowed transmission.
+ */
+
+#define UM_RTO_MIN_US              2000
+#define UM_RTO_MAX_US              1000000
+
+static int um_device_rto_us(um_state *hndl, const um_device *device) {
+    int rto_us;
+    if (!device->srtt_us) {
+        return hndl->timeout * 1000;
+    }
+    rto_us = device->srtt_us + 4 * device->rttvar_us;
+    if (rto_us < UM_RTO_MIN_US) {
+        return UM_RTO_MIN_US;
+    }
+    return rto_us > UM_RTO_MAX_US ? UM_RTO_MAX_US : rto_us;
+}
+
+static void um_request_sample_rtt(um_state *hndl, um_request *request, const unsigned long long now_us) {
+    um_device *device;
+    int rtt_us, delta_us;
+    if (request->attempts || !(request->flags & UM_REQUEST_ACK_REQUESTED) || request->flags & UM_REQUEST_ACK_GOT) {
+        return;
+    }
+    device = um_device_get (hndl, request->receiver_id);
+    rtt_us = (int) (now_us - request->sent_us);
+    if (rtt_us < 1) {
+        rtt_us = 1;
+    }
+    if (!device->srtt_us) {
+        device->srtt_us = rtt_us;
+        device->rttvar_us = rtt_us / 2;
+    } else {
+        delta_us = device->srtt_us - rtt_us;
+        device->rttvar_us += ((delta_us < 0 ? -delta_us : delta_us) - device->rttvar_us) / 4;
+        device->srtt_us += (rtt_us - device->srtt_us) / 8;
+        if (device->srtt_us < 1) {
+            device->srtt_us = 1;
+        }
+    }
+}
+
+// Find the pending request a reply belongs to
+static um_request *um_request_match(um_state *hndl, const int sender_id, const int type, const int message_id) {
+    int i;
+    um_request *request;
+    if (!hndl->requests->pending) {
+        return NULL;
+    }
+    for (i = 0; i < LIBUM_MAX_PENDING; i++) {
+        request = &hndl->requests->slots[i];
+        if (request->state == UM_REQUEST_PENDING && request->message_id == message_id && request->type == type &&
+            (request->receiver_id == sender_id || um_is_group_id (request->receiver_id))) {
+            return request;
+        }
+    }
+    return NULL;
+}
+
+static int um_request_max_attempts(um_state *hndl, const um_request *request) {
+    return request->flags & UM_REQUEST_ACK_REQUESTED ? hndl->retransmit_count : 1;
+}
+
+// Retransmit deadline of a pending request
+static unsigned long long um_request_deadline(um_state *hndl, const um_request *request) {
+    unsigned long long timeout_us = request->rto_us;
+    // Once ACKed, the response may take the device processing time on top of the round trip
+    if (request->flags & UM_REQUEST_ACK_GOT) {
+        if (timeout_us < hndl->timeout * 1000ULL) {
+            timeout_us = hndl->timeout * 1000ULL;
+        }
+        timeout_us += request->process_us;
+    } else if (request->attempts + 1 >= um_request_max_attempts (hndl, request) &&
+               request->sent_us + timeout_us < request->expire_us) {
+        // No retransmits left, wait for a reply until given up
+        return request->expire_us;
+    }
+    return request->sent_us + timeout_us;
+}
+
+// Retransmit or expire the pending requests without a reply in time, returns the next deadline
+static unsigned long long um_request_service(um_state *hndl, const unsigned long long now_us) {
+    int i, max_attempts;
+    unsigned long long deadline_us = now_us + hndl->timeout * 1000ULL;
+    um_request *request;
+    for (i = 0; i < LIBUM_MAX_PENDING && hndl->requests->pending; i++) {
+        request = &hndl->requests->slots[i];
+        if (request->state != UM_REQUEST_PENDING) {
+            continue;
+        }
+        if (now_us >= um_request_deadline (hndl, request)) {
+            max_attempts = um_request_max_attempts (hndl, request);
+            if (++request->attempts >= max_attempts) {
+                um_log_print (hndl, 2, __PRETTY_FUNCTION__, "request %d id %d to %d timed out", request->type,
+                              request->message_id, request->receiver_id);
+                um_request_done (hndl, request, LIBUM_TIMEOUT);
+                continue;
+            }
+            // Do not resend if ACK was already got, just wait for the response
+            if (!(request->flags & UM_REQUEST_ACK_GOT)) {
+                if (um_send (hndl, request->dev_id, *request->req, request->size) < 0) {
+                    um_request_done (hndl, request, LIBUM_OS_ERROR);
+                    continue;
+                }
+                if (request->rto_us < UM_RTO_MAX_US) {
+                    request->rto_us = request->rto_us > UM_RTO_MAX_US / 2 ? UM_RTO_MAX_US : request->rto_us * 2;
+                }
+            }
+            request->sent_us = now_us;
+        }
+        if (um_request_deadline (hndl, request) < deadline_us) {
+            deadline_us = um_request_deadline (hndl, request);
+        }
+    }
+    return deadline_us;
 }
 
 um_state *um_open(const char *udp_target_address, const unsigned int timeout, const int group) {
-    int i;
     um_state *hndl;
     if (group < SMCP1_DEF_UDP_PORT && (group < 0 || group > 10)) {
         // LIBUM_INVALID_ARG
@@ -579,17 +1799,38 @@ um_state *um_open(const char *udp_target_address, const unsigned int timeout, co
     hndl->retransmit_count = 3;
     hndl->refresh_time_limit = LIBUM_DEF_REFRESH_TIME;
     hndl->timeout = timeout;
+#ifndef LIBUM_SPARSE_DEVICE_TABLE
+    int i;
     for (i = 0; i < LIBUM_MAX_DEVS; i++) {
-        hndl->last_positions[i].x = SMCP1_ARG_UNDEF;
-        hndl->last_positions[i].y = SMCP1_ARG_UNDEF;
-        hndl->last_positions[i].z = SMCP1_ARG_UNDEF;
-        hndl->last_positions[i].d = SMCP1_ARG_UNDEF;
+        DEV_POSITIONS(hndl, i).x = SMCP1_ARG_UNDEF;
+        DEV_POSITIONS(hndl, i).y = SMCP1_ARG_UNDEF;
+        DEV_POSITIONS(hndl, i).z = SMCP1_ARG_UNDEF;
+        DEV_POSITIONS(hndl, i).d = SMCP1_ARG_UNDEF;
+    }
+#endif
+    if (!(hndl->lock = um_lock_create ())) {
+        free (hndl);
+        return NULL;
+    }
+    if (!(hndl->devices = um_device_table_create ())) {
+        um_lock_free (hndl->lock);
+        free (hndl);
+        return NULL;
+    }
+    if (!(hndl->requests = calloc (1, sizeof (um_request_table)))) {
+        um_device_table_free (hndl->devices);
+        um_lock_free (hndl->lock);
+        free (hndl);
+        return NULL;
     }
 
     hndl->own_id = SMCP1_ALL_PCS - 100 - (um_get_timestamp_us () & 100);
     hndl->timeout = timeout;
 
     if (!udp_init (hndl, udp_target_address)) {
+        um_request_table_free (hndl->requests);
+        um_device_table_free (hndl->devices);
+        um_lock_free (hndl->lock);
         free (hndl);
         return NULL;
     }
@@ -600,12 +1841,21 @@ void um_close(um_state *hndl) {
     if (!hndl) {
         return;
     }
+    um_stop_receiver (hndl);
+    if (hndl->uma_recorder) {
+        um_stop_uma_recorder (hndl);
+    }
     if (hndl->socket != INVALID_SOCKET) {
         closesocket (hndl->socket);
 #ifdef _WINDOWS
         WSACleanup();
 #endif
     }
+    um_request_table_free (hndl->requests);
+    um_device_table_free (hndl->devices);
+    um_lock_free (hndl->lock);
+    free (hndl->recv_batch);
+    free (hndl->uma_ring);
     free (hndl);
 }
 
@@ -633,6 +1883,57 @@ int um_set_log_func(um_state *hndl, const int verbose, um_log_print_func func, c
     return 0;
 }
 
+// Handler slot of a notification type, negative for a type without a handler
+static int um_notify_index(const int type) {
+    switch (type) {
+        case SMCP1_NOTIFY_POSITION_CHANGED:
+            return 0;
+        case SMCP1_NOTIFY_STATUS_CHANGED:
+            return 1;
+        case SMCP1_NOTIFY_GOTO_POS_COMPLETED:
+            return 2;
+        case SMCP1_NOTIFY_PRESSURE_CHANGED:
+            return 3;
+        case SMCP1_NOTIFY_UMA_SAMPLES:
+            return 4;
+        default:
+            return -1;
+    }
+}
+
+static bool um_notify_registered(const um_state *hndl, const int type) {
+    int index = um_notify_index (type);
+    return index >= 0 && hndl->notify_handlers[index].func != NULL;
+}
+
+static void um_notify(um_state *hndl, const int dev, const int type, const void *payload) {
+    int index = um_notify_index (type);
+    um_notify_handler *handler;
+    if (index < 0) {
+        return;
+    }
+    handler = &hndl->notify_handlers[index];
+    if (handler->func) {
+        handler->func (hndl, dev, type, payload, handler->arg);
+    }
+}
+
+int um_set_notify_handler(um_state *hndl, const int type, um_notify_func func, void *arg) {
+    int index;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if ((index = um_notify_index (type)) < 0) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // Not changed while a handler is being called
+    um_state_lock (hndl);
+    hndl->notify_handlers[index].func = func;
+    hndl->notify_handlers[index].arg = arg;
+    um_state_unlock (hndl);
+    return 0;
+}
+
 int um_set_refresh_time_limit(um_state *hndl, const int value) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
@@ -662,7 +1963,7 @@ int um_get_status(um_state *hndl, const int dev) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
     int dev_id = um_resolve_dev_id (dev);
-    return hndl->last_status[dev_id];
+    return DEV_PEEK_STATUS(hndl, dev_id);
 }
 
 int um_is_busy(um_state *hndl, const int dev) {
@@ -681,24 +1982,24 @@ int um_get_drive_status(um_state *hndl, const int dev) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
     int dev_id = um_resolve_dev_id (dev);
-    drive_status = hndl->drive_status[dev_id];
-    pwm_status = hndl->last_status[dev_id];
-    ts = hndl->drive_status_ts[dev_id];
-    now = um_get_timestamp_ms ();
+    drive_status = DEV_PEEK_DRIVE_STATUS(hndl, dev_id);
+    pwm_status = DEV_PEEK_STATUS(hndl, dev_id);
+    ts = DEV_PEEK_DRIVE_STATUS_TS(hndl, dev_id);
+    now = um_clock_ms ();
 
     // Special handling for stuck drive status.
     // If drive status is busy, but pwm status not and 1s elapsed since it was last time,
     // assume drive status notification to be lost and set drive status to completed.
     if (ts && drive_status == LIBUM_POS_DRIVE_BUSY && !um_is_busy_status (pwm_status) && now - ts > 1000) {
-        hndl->drive_status[dev_id] = LIBUM_POS_DRIVE_COMPLETED;
+        DEV_DRIVE_STATUS(hndl, dev_id) = LIBUM_POS_DRIVE_COMPLETED;
         um_log_print (hndl, 1, __PRETTY_FUNCTION__, "Stuck dev %d drive status, PWM was on %1.1fs ago", dev,
                       (float) (now - ts) / 1000.0);
     }
     // update last pwm busy time
     if (um_is_busy_status (pwm_status)) {
-        hndl->drive_status_ts[dev_id] = now;
+        DEV_DRIVE_STATUS_TS(hndl, dev_id) = now;
     }
-    return hndl->drive_status[dev_id];
+    return DEV_PEEK_DRIVE_STATUS(hndl, dev_id);
 }
 
 static int um_set_drive_status(um_state *hndl, const int dev, const int value) {
@@ -709,8 +2010,8 @@ static int um_set_drive_status(um_state *hndl, const int dev, const int value) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
     int dev_id = um_resolve_dev_id (dev);
-    hndl->drive_status[dev_id] = value;
-    hndl->drive_status_ts[dev_id] = um_get_timestamp_ms ();
+    DEV_DRIVE_STATUS(hndl, dev_id) = value;
+    DEV_DRIVE_STATUS_TS(hndl, dev_id) = um_clock_ms ();
     return 0;
 }
 
@@ -803,8 +2104,11 @@ int um_goto_position(um_state *hndl, const int dev, const float x, const float y
     if (max_acc) {
         args[argc++] = max_acc;
     }
-    ret = um_cmd (hndl, dev, SMCP1_CMD_GOTO_POS, argc, args);
-    um_set_drive_status (hndl, dev, ret >= 0 ? LIBUM_POS_DRIVE_BUSY : LIBUM_POS_DRIVE_FAILED);
+    // Set busy before the request, the background receiver may process the completion during it
+    um_set_drive_status (hndl, dev, LIBUM_POS_DRIVE_BUSY);
+    if ((ret = um_cmd (hndl, dev, SMCP1_CMD_GOTO_POS, argc, args)) < 0) {
+        um_set_drive_status (hndl, dev, LIBUM_POS_DRIVE_FAILED);
+    }
     return ret;
 }
 
@@ -873,8 +2177,11 @@ int um_goto_position_ext(um_state *hndl, const int dev, const float x, const flo
     if (!um_arg_undef (d)) {
         args2[argc2++] = calc_speed (speedD);
     }
-    ret = um_send_msg (hndl, dev, SMCP1_CMD_GOTO_POS, argc, args, argc2, args2, 0, NULL);
-    um_set_drive_status (hndl, dev, ret >= 0 ? LIBUM_POS_DRIVE_BUSY : LIBUM_POS_DRIVE_FAILED);
+    // Set busy before the request, the background receiver may process the completion during it
+    um_set_drive_status (hndl, dev, LIBUM_POS_DRIVE_BUSY);
+    if ((ret = um_send_msg (hndl, dev, SMCP1_CMD_GOTO_POS, argc, args, argc2, args2, 0, NULL)) < 0) {
+        um_set_drive_status (hndl, dev, LIBUM_POS_DRIVE_FAILED);
+    }
     return ret;
 }
 
@@ -883,7 +2190,8 @@ float um_get_speed(um_state *hndl, const int dev, const char axis) {
         return 0.0;
     }
     int dev_id = um_resolve_dev_id (dev);
-    um_positions *positions = &hndl->last_positions[dev_id];
+    um_positions snapshot, *positions = &snapshot;
+    um_positions_read (hndl, dev_id, positions);
     if (!positions->updated_us) {
         return 0.0;
     }
@@ -911,7 +2219,8 @@ float um_get_position(um_state *hndl, const int dev, const char axis) {
     }
     int dev_id = um_resolve_dev_id (dev);
 
-    um_positions *positions = &hndl->last_positions[dev_id];
+    um_positions snapshot, *positions = &snapshot;
+    um_positions_read (hndl, dev_id, positions);
     if (!positions->updated_us) {
         return 0.0;
     }
@@ -955,23 +2264,51 @@ int um_stop_all(um_state *hndl) {
     return um_stop (hndl, SMCP1_ALL_DEVICES);
 }
 
-static int um_update_position_cache_time(um_state *hndl, const int sender_id) {
-    int ret = 0;
-    um_positions *positions = &hndl->last_positions[sender_id];
-    unsigned long long ts_us = um_get_timestamp_us ();
-    if (positions->updated_us) {
-        ret = (int) (ts_us - positions->updated_us);
-    }
-    positions->updated_us = ts_us;
-    return ret;
+static void um_update_position_cache_time(um_state *hndl, const int sender_id, const unsigned long long ts_us) {
+    DEV_POSITIONS(hndl, sender_id).updated_us = ts_us;
+}
+
+/*
+ * Alpha-beta filter per axis for the velocity estimate. The time step is taken from the previous
+ * sample of the same axis, a notification may leave out axes. Samples closer than UM_FILTER_MIN_STEP_US,
+ * e.g. bunched notifications, correct the position only. After a gap longer than
+ * UM_FILTER_MAX_STEP_US the filter is restarted from the measured position.
+ */
+
+#define UM_FILTER_ALPHA            0.5
+#define UM_FILTER_BETA             0.2
+#define UM_FILTER_MIN_STEP_US      500
+#define UM_FILTER_MAX_STEP_US      1000000
+#define UM_PREDICT_MAX_US          1000000
+
+// Returns the filtered velocity in um/s
+static float um_filter_update(um_device *device, const int axis_index, const int pos_nm,
+                              const unsigned long long ts_us) {
+    double predicted, residual;
+    double *pos = &device->filter_pos[axis_index], *vel = &device->filter_vel[axis_index];
+    long long time_step_us = (long long) (ts_us - device->filter_ts_us[axis_index]);
+
+    device->filter_ts_us[axis_index] = ts_us;
+    if (!(device->filter_valid & (1u << axis_index)) || time_step_us <= 0 || time_step_us > UM_FILTER_MAX_STEP_US) {
+        device->filter_valid |= 1u << axis_index;
+        *pos = pos_nm;
+        *vel = 0.0;
+        return 0.0f;
+    }
+    predicted = *pos + *vel * (double) time_step_us;
+    residual = pos_nm - predicted;
+    *pos = predicted + UM_FILTER_ALPHA * residual;
+    if (time_step_us >= UM_FILTER_MIN_STEP_US) {
+        *vel += UM_FILTER_BETA * residual / (double) time_step_us;
+    }
+    return (float) (*vel * 1000.0);
 }
 
 static int um_update_positions_cache(um_state *hndl, const int sender_id, const int axis_index, const int pos_nm,
-                                     const int time_step_us) {
-    um_positions *positions = &hndl->last_positions[sender_id];
+                                     const unsigned long long ts_us) {
+    um_positions *positions = &DEV_POSITIONS(hndl, sender_id);
     int *pos_ptr = NULL;
     float *speed_ptr = NULL;
-    int step_nm;
 
     switch (axis_index) {
         case 0:
@@ -994,13 +2331,8 @@ static int um_update_positions_cache(um_state *hndl, const int sender_id, const
     if (!pos_ptr) {
         return -1;
     }
-    step_nm = pos_nm - *pos_ptr;
     *pos_ptr = pos_nm;
-    if (time_step_us > 0) {
-        *speed_ptr = (float) step_nm * 1000.0f / (float) time_step_us;
-    } else {
-        *speed_ptr = 0.0;
-    }
+    *speed_ptr = um_filter_update (um_device_get (hndl, sender_id), axis_index, pos_nm, ts_us);
     return axis_index;
 }
 
@@ -1044,15 +2376,332 @@ int um_get_soft_start_mode(um_state *hndl, const int dev) {
     return um_get_ext_feature (hndl, dev, SMCP10_EXT_FEAT_SOFT_START);
 }
 
+/*
+ * Byte order conversion of the payload arrays. Swapping the bytes of a 32-bit word is its own
+ * inverse, thus the same kernels serve both directions. The widest kernel the CPU supports
+ * is selected on the first use, and the scalar loop converts the words left over.
+ */
+
+typedef int (*um_hton32_kernel)(uint32_t *dst, const uint32_t *src, const int count);
+
+#ifdef UM_HAVE_SSE2
+static int um_hton32_sse2(uint32_t *dst, const uint32_t *src, const int count) {
+    int i;
+    __m128i v;
+    for (i = 0; i + 4 <= count; i += 4) {
+        v = _mm_loadu_si128 ((const __m128i *) (src + i));
+        // Swap the bytes of the 16-bit halves, then the halves
+        v = _mm_or_si128 (_mm_slli_epi16 (v, 8), _mm_srli_epi16 (v, 8));
+        v = _mm_shufflelo_epi16 (v, _MM_SHUFFLE(2, 3, 0, 1));
+        v = _mm_shufflehi_epi16 (v, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128 ((__m128i *) (dst + i), v);
+    }
+    return i;
+}
+#endif
+
+#ifdef UM_HAVE_AVX2
+__attribute__((target("avx2")))
+static int um_hton32_avx2(uint32_t *dst, const uint32_t *src, const int count) {
+    int i;
+    __m256i v;
+    const __m256i mask = _mm256_set_epi8 (12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+                                          12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    for (i = 0; i + 8 <= count; i += 8) {
+        v = _mm256_loadu_si256 ((const __m256i *) (src + i));
+        _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_shuffle_epi8 (v, mask));
+    }
+    return i;
+}
+#endif
+
+#ifdef UM_HAVE_NEON
+static int um_hton32_neon(uint32_t *dst, const uint32_t *src, const int count) {
+    int i;
+    for (i = 0; i + 4 <= count; i += 4) {
+        vst1q_u8 ((uint8_t *) (dst + i), vrev32q_u8 (vld1q_u8 ((const uint8_t *) (src + i))));
+    }
+    return i;
+}
+#endif
+
+static um_hton32_kernel um_hton32_select(void) {
+#ifdef UM_HAVE_AVX2
+    if (__builtin_cpu_supports ("avx2")) {
+        return um_hton32_avx2;
+    }
+#endif
+#if defined(UM_HAVE_SSE2)
+    return um_hton32_sse2;
+#elif defined(UM_HAVE_NEON)
+    return um_hton32_neon;
+#else
+    return NULL;
+#endif
+}
+
+// Copy 32-bit words converting between the host and the network byte order, dst may be src
+static void um_hton32_array(void *dst, const void *src, const int count) {
+    // Every thread selects the same kernel, a race is harmless
+    static um_hton32_kernel kernel;
+    static volatile bool selected;
+    uint32_t *to = (uint32_t *) dst;
+    const uint32_t *from = (const uint32_t *) src;
+    int i = 0;
+
+    if (!selected) {
+        kernel = um_hton32_select ();
+        selected = true;
+    }
+    if (kernel) {
+        i = kernel (to, from, count);
+    }
+    for (; i < count; i++) {
+        to[i] = htonl(from[i]);
+    }
+}
+
+// Count of uMa sample datagrams lost before the given one from the sender
+static int um_uma_gap(um_state *hndl, const int sender_id, const int message_id) {
+    um_device *device = um_device_get (hndl, sender_id);
+    unsigned short skipped = (unsigned short) (message_id - device->uma_next_id);
+    int gap = 0;
+
+    // A step backwards is a restarted sender rather than a loss
+    if (device->uma_seen && skipped < 0x8000) {
+        gap = skipped;
+    }
+    device->uma_seen = true;
+    device->uma_next_id = (unsigned short) (message_id + 1);
+    return gap;
+}
+
+// Convert a uMa samples datagram to the next block of the ring, if enabled
+static void um_uma_ring_append(um_state *hndl, const int dev, const int message_id, const int gap,
+                               const unsigned long long arrival_us, const int32_t *data, const int word_count) {
+    um_uma_ring *ring = hndl->uma_ring;
+    um_uma_block *block;
+
+    if (!ring) {
+        return;
+    }
+    ring->received++;
+    ring->missing += gap;
+
+    if (ring->head - ring->tail > ring->mask) {
+        ring->dropped++;
+        ring->dropped_total++;
+        return;
+    }
+    block = &ring->blocks[ring->head & ring->mask];
+    block->timestamp_us = arrival_us;
+    block->dev = dev;
+    block->message_id = message_id;
+    block->gap = gap;
+    block->dropped = ring->dropped;
+    block->word_count = word_count < LIBUM_UMA_BLOCK_WORDS ? word_count : LIBUM_UMA_BLOCK_WORDS;
+    um_hton32_array (block->words, data, block->word_count);
+    ring->dropped = 0;
+    // The block is complete before the reader sees it
+    um_barrier ();
+    ring->head++;
+}
+
+static void um_uma_recorder_unmap(um_uma_recorder *recorder) {
+    if (!recorder->base) {
+        return;
+    }
+#ifdef _WINDOWS
+    UnmapViewOfFile (recorder->base);
+    CloseHandle (recorder->mapping);
+#else
+    munmap (recorder->base, recorder->size);
+#endif
+    recorder->base = NULL;
+}
+
+// Grow the file to the given size with the disk space allocated and map it.
+// The current mapping is kept if this fails
+static int um_uma_recorder_map(um_uma_recorder *recorder, const unsigned long long size) {
+#ifdef _WINDOWS
+    HANDLE mapping;
+    unsigned char *base;
+    LARGE_INTEGER end;
+    // Allocated by setting the end of the file, not only by extending the mapping
+    end.QuadPart = (LONGLONG) size;
+    if (!SetFilePointerEx (recorder->file, end, NULL, FILE_BEGIN) || !SetEndOfFile (recorder->file)) {
+        return -1;
+    }
+    if (!(mapping = CreateFileMapping (recorder->file, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size,
+                                       NULL))) {
+        return -1;
+    }
+    if (!(base = MapViewOfFile (mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T) size))) {
+        CloseHandle (mapping);
+        return -1;
+    }
+    um_uma_recorder_unmap (recorder);
+    recorder->mapping = mapping;
+#else
+    void *base;
+    if (posix_fallocate (recorder->fd, 0, (off_t) size) != 0) {
+        return -1;
+    }
+    if ((base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, recorder->fd, 0)) == MAP_FAILED) {
+        return -1;
+    }
+    um_uma_recorder_unmap (recorder);
+#endif
+    recorder->base = base;
+    recorder->size = size;
+    return 0;
+}
+
+// Truncate the file to the recorded data and close it. Returns -1 if the recording failed
+static int um_uma_recorder_close(um_uma_recorder *recorder) {
+    int ret;
+    unsigned long long size = recorder->recorded;
+    um_uma_recorder_unmap (recorder);
+#ifdef _WINDOWS
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG) size;
+    if (SetFilePointerEx (recorder->file, end, NULL, FILE_BEGIN)) {
+        SetEndOfFile (recorder->file);
+    }
+    CloseHandle (recorder->file);
+#else
+    if (ftruncate (recorder->fd, (off_t) size) < 0) {
+        recorder->failed = true;
+    }
+    close (recorder->fd);
+#endif
+    ret = recorder->failed ? -1 : 0;
+    free (recorder);
+    return ret;
+}
+
+// Append a uMa samples datagram to the recording, if the device is being recorded
+static void um_uma_recorder_append(um_state *hndl, const int dev, const int message_id, const int gap,
+                                   const unsigned long long arrival_us, const int32_t *data, const int word_count) {
+    um_uma_recorder *recorder = hndl->uma_recorder;
+    um_uma_record_header *header;
+    um_uma_record_block *block;
+    unsigned long long offset, size;
+    int i, words;
+
+    if (!recorder || recorder->failed || dev != recorder->dev) {
+        return;
+    }
+    header = (um_uma_record_header *) recorder->base;
+    words = word_count < LIBUM_UMA_BLOCK_WORDS ? word_count : LIBUM_UMA_BLOCK_WORDS;
+    // Padded to keep the blocks aligned
+    size = sizeof (um_uma_record_block) + ((words + 1) & ~1) * sizeof (uint32_t);
+    offset = recorder->recorded;
+    if (offset + size > recorder->size) {
+        if (um_uma_recorder_map (recorder, recorder->size * 2) < 0) {
+            um_log_print (hndl, 1, __PRETTY_FUNCTION__, "uMa recording of %d stopped, file could not be grown",
+                          dev);
+            recorder->failed = true;
+            return;
+        }
+        header = (um_uma_record_header *) recorder->base;
+    }
+    // A full index keeps every second entry with a doubled stride
+    if (!(header->block_count % header->index_stride)) {
+        if (header->index_count == LIBUM_UMA_RECORD_INDEX) {
+            for (i = 0; i < LIBUM_UMA_RECORD_INDEX / 2; i++) {
+                header->index[i] = header->index[2 * i];
+            }
+            header->index_count = LIBUM_UMA_RECORD_INDEX / 2;
+            header->index_stride *= 2;
+        }
+        if (!(header->block_count % header->index_stride)) {
+            header->index[header->index_count].timestamp_us = arrival_us;
+            header->index[header->index_count].offset = offset;
+            header->index_count++;
+        }
+    }
+    block = (um_uma_record_block *) (recorder->base + offset);
+    block->timestamp_us = arrival_us;
+    block->message_id = message_id;
+    block->gap = gap;
+    block->word_count = words;
+    block->reserved = 0;
+    um_hton32_array (block + 1, data, words);
+    if (words & 1) {
+        ((uint32_t *) (block + 1))[words] = 0;
+    }
+    header->data_size += size;
+    header->block_count++;
+    header->missing += gap;
+    recorder->recorded += size;
+}
+
+// Update the pressure cache of a uMc from a notification
+static void um_store_pressures(um_state *hndl, const int dev_id, const um_notify_pressure *pressure,
+                               const unsigned long long ts_ms) {
+    int i;
+    um_device *device = um_device_get (hndl, dev_id);
+
+    um_state_lock (hndl);
+    device->valves = pressure->valves;
+    for (i = 0; i < 8; i++) {
+        device->valve_ts[i] = ts_ms;
+    }
+    for (i = 0; i < pressure->channel_count && i < 8; i++) {
+        device->pressures[i] = pressure->pressures[i];
+        device->pressure_ts[i] = ts_ms;
+    }
+    um_state_unlock (hndl);
+}
+
 #define UMP_RECEIVE_ACK_GOT  1
 #define UMP_RECEIVE_RESP_GOT 2
 
-int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_data_ptr, const int timeout) {
-    IPADDR from;
+// Size of a data item on wire, zero for an unknown type
+static int smcp1_data_item_size(const int data_type) {
+    switch (data_type) {
+        case SMCP1_DATA_UINT8:
+        case SMCP1_DATA_INT8:
+        case SMCP1_DATA_CHAR_STRING:
+            return 1;
+        case SMCP1_DATA_UINT16:
+        case SMCP1_DATA_INT16:
+            return 2;
+        case SMCP1_DATA_UINT32:
+        case SMCP1_DATA_INT32:
+            return 4;
+        case SMCP1_DATA_UINT64:
+        case SMCP1_DATA_INT64:
+            return 8;
+    }
+    return 0;
+}
+
+// Item count of a sub block limited to the bytes received, zero if even its header was not received
+static int um_sub_block_items(const smcp1_subblock_header *sub_block, const unsigned char *end) {
+    const unsigned char *data = (const unsigned char *) sub_block + SMCP1_SUB_BLOCK_HEADER_SIZE;
+    int items, item_size;
+    if (data > end) {
+        return 0;
+    }
+    items = ntohs(sub_block->data_size);
+    item_size = smcp1_data_item_size (ntohs(sub_block->data_type));
+    if (item_size && items > (end - data) / item_size) {
+        items = (int) ((end - data) / item_size);
+    }
+    return items;
+}
+
+// Process a received message, update caches and detect ACKs and responses to our own requests.
+// The arrival time drives the position cache timestamps and the RTT samples
+static int um_recv_process(um_state *hndl, um_message *msg, const int size, const IPADDR *from,
+                           const unsigned long long arrival_us, int *ext_data_type, void *ext_data_ptr) {
     int receiver_id, sender_id, message_id, type, sub_blocks, data_size = 0, data_type = SMCP1_DATA_VOID, options, status;
-    int i, data_type2, data_size2, pos_nm, time_step_us = 0, ext_data_size = 0, ret = 0;
+    int i, data_type2, data_size2, pos_nm, gap, ext_data_size = 0;
     uint32_t value;
     uint32_t *ext_data = (uint32_t *) ext_data_ptr;
+    const unsigned char *end = (const unsigned char *) msg + size;
     smcp1_frame *header = (smcp1_frame *) msg;
     smcp1_subblock_header *sub_block2, *sub_block = (smcp1_subblock_header *) ((unsigned char *) msg +
                                                                                SMCP1_FRAME_SIZE);
@@ -1061,29 +2710,20 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
             (int32_t *) (msg) + (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
 
     um_positions *positions;
+    um_request *request;
     smcp1_frame ack;
+    um_notify_positions notify_positions;
+    um_notify_status notify_status;
+    um_notify_drive_completed notify_drive;
+    um_notify_pressure notify_pressure;
+    um_notify_uma_samples notify_samples;
+    uint32_t samples[LIBUM_MAX_MESSAGE_SIZE / sizeof (uint32_t)];
 
     if (ext_data_type != NULL) {
         *ext_data_type = -1;
     }
 
-    if (!hndl || hndl->socket == INVALID_SOCKET) {
-        return set_last_error (hndl, LIBUM_NOT_OPEN);
-    }
-    if (!msg) {
-        return set_last_error (hndl, LIBUM_INVALID_ARG);
-    }
-
-    memset(msg, 0, sizeof (um_message));
-
-    if ((ret = udp_recv (hndl, (unsigned char *) msg, sizeof (um_message), &from, timeout)) < 1) {
-        if (!ret) {
-            return set_last_error (hndl, LIBUM_TIMEOUT);
-        }
-        return set_last_error (hndl, LIBUM_OS_ERROR);
-    }
-
-    if (ret < (int) SMCP1_FRAME_SIZE) {
+    if (size < (int) SMCP1_FRAME_SIZE) {
         return set_last_error (hndl, LIBUM_INVALID_RESP);
     }
     if (header->version != SMCP1_VERSION) {
@@ -1100,11 +2740,22 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
     int sender_dev_id = sender_id;
     um_resolve_sno (sender_id, &sender_dev_id);
 
-    um_log_print (hndl, 3, __PRETTY_FUNCTION__, "type %d id %d sender %d/%d receiver %d options 0x%02X from %s:%d",
-                  type, message_id, sender_id, sender_dev_id, receiver_id, options, inet_ntoa (from.sin_addr),
-                  ntohs(from.sin_port));
+    // The arguments are not evaluated for nothing on the hot path
+    if (hndl->verbose >= 3) {
+        um_log_print (hndl, 3, __PRETTY_FUNCTION__, "type %d id %d sender %d/%d receiver %d options 0x%02X from %s:%d",
+                      type, message_id, sender_id, sender_dev_id, receiver_id, options, inet_ntoa (from->sin_addr),
+                      ntohs(from->sin_port));
+    }
+    // A reboot or a move to another address may change the static information
+    if ((options & SMCP1_OPT_NOTIFY && type == SMCP1_NOTIFY_MANIPULATOR_HELLO) ||
+        (DEV_ADDRESS(hndl, sender_id).sin_family &&
+         (DEV_ADDRESS(hndl, sender_id).sin_addr.s_addr != from->sin_addr.s_addr ||
+          DEV_ADDRESS(hndl, sender_id).sin_port != from->sin_port))) {
+        um_device_info_clear (hndl, sender_id);
+    }
     // Cache is now 64K long and thus any sender id is in the cache
-    memcpy(&hndl->addresses[sender_id], &from, sizeof (IPADDR));
+    memcpy(&DEV_ADDRESS(hndl, sender_id), from, sizeof (IPADDR));
+    um_device_activate (hndl, um_device_get (hndl, sender_id));
 
     // Filter messages by receiver id, level 1, include broadcasts
     if (receiver_id != SMCP1_ALL_CUS && receiver_id != SMCP1_ALL_PCS && receiver_id != SMCP1_ALL_CUS_OR_PCS &&
@@ -1114,34 +2765,42 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
 
     // Notifications, handles also broadcasted ones
     if (sub_blocks > 0 && options & SMCP1_OPT_NOTIFY && is_valid_dev (sender_dev_id)) {
-        data_size = ntohs(sub_block->data_size);
+        data_size = um_sub_block_items (sub_block, end);
         data_type = ntohs(sub_block->data_type);
 
         switch (type) {
             case SMCP1_NOTIFY_POSITION_CHANGED:
                 if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32)) {
-                    positions = &hndl->last_positions[sender_id];
-                    time_step_us = um_update_position_cache_time (hndl, sender_id);
+                    positions = um_positions_write_begin (hndl, sender_id);
+                    um_update_position_cache_time (hndl, sender_id, arrival_us);
                     // X axis
                     pos_nm = ntohl(*data_ptr++);
-                    um_update_positions_cache (hndl, sender_id, 0, pos_nm, time_step_us);
+                    um_update_positions_cache (hndl, sender_id, 0, pos_nm, arrival_us);
                     if (data_size > 1) {
                         pos_nm = ntohl(*data_ptr++);
-                        um_update_positions_cache (hndl, sender_id, 1, pos_nm, time_step_us);
+                        um_update_positions_cache (hndl, sender_id, 1, pos_nm, arrival_us);
                     }
                     if (data_size > 2) {
                         pos_nm = ntohl(*data_ptr++);
-                        um_update_positions_cache (hndl, sender_id, 2, pos_nm, time_step_us);
+                        um_update_positions_cache (hndl, sender_id, 2, pos_nm, arrival_us);
                     }
                     if (data_size > 3) {
                         pos_nm = ntohl(*data_ptr++);
-                        um_update_positions_cache (hndl, sender_id, 3, pos_nm, time_step_us);
+                        um_update_positions_cache (hndl, sender_id, 3, pos_nm, arrival_us);
+                    }
+                    notify_positions.axis_count = data_size < 4 ? data_size : 4;
+                    memcpy(&notify_positions.positions, positions, sizeof (um_positions));
+                    um_positions_write_end (hndl, sender_id);
+                    // Logged from the copy, a log function may read the positions
+                    positions = &notify_positions.positions;
+                    if (hndl->verbose >= 2) {
+                        um_log_print (hndl, 2, __PRETTY_FUNCTION__,
+                                      "dev %d updated %d position%s %1.3f %1.3f %1.3f %1.3f speeds %1.1f %1.1f %1.1f %1.1fum/s",
+                                      sender_id, data_size, data_size > 1 ? "s" : "", nm2um (positions->x),
+                                      nm2um (positions->y), nm2um (positions->z), nm2um (positions->d),
+                                      positions->speed_x, positions->speed_y, positions->speed_z, positions->speed_d);
                     }
-                    um_log_print (hndl, 2, __PRETTY_FUNCTION__,
-                                  "dev %d updated %d position%s %1.3f %1.3f %1.3f %1.3f speeds %1.1f %1.1f %1.1f %1.1fum/s",
-                                  sender_id, data_size, data_size > 1 ? "s" : "", nm2um (positions->x),
-                                  nm2um (positions->y), nm2um (positions->z), nm2um (positions->d), positions->speed_x,
-                                  positions->speed_y, positions->speed_z, positions->speed_d);
+                    um_notify (hndl, sender_dev_id, type, &notify_positions);
                 } else {
                     um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unexpected data type %d or size %d for positions",
                                   data_size, ntohs(sub_block->data_type));
@@ -1149,24 +2808,30 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
                 break;
             case SMCP1_NOTIFY_STATUS_CHANGED:
                 if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32)) {
-                    hndl->last_status[sender_id] = status = ntohl(*data_ptr);
+                    DEV_STATUS(hndl, sender_id) = status = ntohl(*data_ptr);
                     um_log_print (hndl, 2, __PRETTY_FUNCTION__, "dev %d updated status %d (0x%08X)", sender_id, status,
                                   status);
+                    um_sequence_status (hndl, sender_id, status);
+                    notify_status.status = status;
+                    um_notify (hndl, sender_dev_id, type, &notify_status);
                 }
                 break;
             case SMCP1_NOTIFY_GOTO_POS_COMPLETED:
                 if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32)) {
                     status = ntohl(*data_ptr);
-                    if (message_id != hndl->drive_status_id[sender_id]) {
+                    if (message_id != DEV_DRIVE_STATUS_ID(hndl, sender_id)) {
                         if (status == 0 ||
                             status == 2) { // Non-zero "not found" erro code at the end of memory position drive
-                            hndl->drive_status[sender_id] = LIBUM_POS_DRIVE_COMPLETED;
+                            DEV_DRIVE_STATUS(hndl, sender_id) = LIBUM_POS_DRIVE_COMPLETED;
                         } else {
-                            hndl->drive_status[sender_id] = LIBUM_POS_DRIVE_FAILED;
+                            DEV_DRIVE_STATUS(hndl, sender_id) = LIBUM_POS_DRIVE_FAILED;
                         }
                         um_log_print (hndl, 2, __PRETTY_FUNCTION__, "dev %d updated drive status %d msg id %d",
                                       sender_id, status, message_id);
-                        hndl->drive_status_id[sender_id] = message_id;
+                        DEV_DRIVE_STATUS_ID(hndl, sender_id) = message_id;
+                        notify_drive.error_code = status;
+                        notify_drive.drive_status = DEV_DRIVE_STATUS(hndl, sender_id);
+                        um_notify (hndl, sender_dev_id, type, &notify_drive);
                     } else {
                         um_log_print (hndl, 2, __PRETTY_FUNCTION__, "dev %d duplicated drive status %d msg id %d",
                                       sender_id, status, message_id);
@@ -1174,6 +2839,27 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
                 }
                 break;
             case SMCP1_NOTIFY_UMA_SAMPLES:
+                // Limited to the received data
+                notify_samples.word_count = (size - (int) (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE)) / 4;
+                if (notify_samples.word_count > data_size) {
+                    notify_samples.word_count = data_size;
+                }
+                if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32) &&
+                    (hndl->uma_ring || hndl->uma_recorder)) {
+                    um_state_lock (hndl);
+                    gap = um_uma_gap (hndl, sender_id, message_id);
+                    um_uma_ring_append (hndl, sender_dev_id, message_id, gap, arrival_us, data_ptr,
+                                        notify_samples.word_count);
+                    um_uma_recorder_append (hndl, sender_dev_id, message_id, gap, arrival_us, data_ptr,
+                                            notify_samples.word_count);
+                    um_state_unlock (hndl);
+                }
+                if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32) &&
+                    um_notify_registered (hndl, type)) {
+                    um_hton32_array (samples, data_ptr, notify_samples.word_count);
+                    notify_samples.words = samples;
+                    um_notify (hndl, sender_dev_id, type, &notify_samples);
+                }
                 if (data_size > 0 && (data_type == SMCP1_DATA_INT32 || data_type == SMCP1_DATA_UINT32) &&
                     ext_data_type != NULL) {
                     *ext_data_type = SMCP1_NOTIFY_UMA_SAMPLES;
@@ -1196,6 +2882,18 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
                 um_log_print (hndl, 2, __PRETTY_FUNCTION__,
                               "Pressure changed notification from %d/%d, %d channel%s, valves 0x%02x", sender_id,
                               sender_dev_id, data_size - 1, data_size - 1 > 1 ? "s" : "", status);
+                if (status >= 0) {
+                    notify_pressure.valves = status;
+                    notify_pressure.channel_count = data_size - 1;
+                    if (notify_pressure.channel_count > LIBUM_NOTIFY_MAX_CHANNELS) {
+                        notify_pressure.channel_count = LIBUM_NOTIFY_MAX_CHANNELS;
+                    }
+                    for (i = 0; i < notify_pressure.channel_count; i++) {
+                        notify_pressure.pressures[i] = ntohl(data_ptr[i + 1]);
+                    }
+                    um_store_pressures (hndl, sender_id, &notify_pressure, arrival_us / 1000LL);
+                    um_notify (hndl, sender_dev_id, type, &notify_pressure);
+                }
                 break;
             default:
                 um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unsupported notification type %d ignored", type);
@@ -1228,7 +2926,7 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
         sub_block2 = (smcp1_subblock_header *) ((unsigned char *) msg + SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE +
                                                 data_size * sizeof (uint32_t));
 
-        data_size2 = ntohs(sub_block2->data_size);
+        data_size2 = um_sub_block_items (sub_block2, end);
         data_type2 = ntohs(sub_block2->data_type);
 
         um_log_print (hndl, 2, __PRETTY_FUNCTION__, "ext data type %d, %d item%s", *ext_data_type, data_size2,
@@ -1238,78 +2936,275 @@ int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_d
             (data_type2 == SMCP1_DATA_INT32 || data_type2 == SMCP1_DATA_UINT32)) {
             ext_data_size = data_size2;
             data2_ptr = data_ptr + data_size + (SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
-            for (i = 0; i < data_size2; i++) {
-                value = ntohl(*data2_ptr++);
+            if (ext_data != NULL) {
+                um_hton32_array (ext_data, data2_ptr, data_size2);
+            }
+            for (i = 0; i < data_size2 && hndl->verbose >= 3; i++) {
                 if (i == 0 || i == 1 || i == data_size2 - 2 || i == data_size2 - 1) {
+                    value = ntohl(data2_ptr[i]);
                     um_log_print (hndl, 3, __PRETTY_FUNCTION__, "ext_data[%d]\t0x%08x", i, value);
                 }
-                if (ext_data != NULL) {
-                    ext_data[i] = value;
-                }
             }
-        } else {
-            um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unsupported ext data format %d", data_type2);
+        } else {
+            um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unsupported ext data format %d", data_type2);
+        }
+        return ext_data_size;
+    }
+
+    // For responses or ACKs to our own request, accept only messages sent to our own id
+    if (receiver_id != hndl->own_id) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    hndl->last_device_received = sender_id;
+
+    // ACK sent to our own message
+    if (options & SMCP1_OPT_ACK) {
+        um_state_lock (hndl);
+        // ACK to a pending request
+        if ((request = um_request_match (hndl, sender_id, type, message_id))) {
+            um_log_print (hndl, 3, __PRETTY_FUNCTION__, "ACK to %d request %d", type, message_id);
+            um_request_sample_rtt (hndl, request, arrival_us);
+            request->flags |= UM_REQUEST_ACK_GOT;
+            // If not expecting a response, getting ACK is enough.
+            if (!(request->flags & UM_REQUEST_RESP_REQUESTED)) {
+                um_request_done (hndl, request, 0);
+            }
+            um_state_unlock (hndl);
+            return UMP_RECEIVE_ACK_GOT;
+        }
+        um_state_unlock (hndl);
+        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "ACK to %d id %d without a pending request", type, message_id);
+        return 0;
+    }
+
+    if (!(options & SMCP1_OPT_REQ)) {
+        um_state_lock (hndl);
+        // Response to a pending request
+        if ((request = um_request_match (hndl, sender_id, type, message_id))) {
+            um_log_print (hndl, 3, __PRETTY_FUNCTION__, "response to %d request %d", type, message_id);
+            memcpy(request->resp, msg, size);
+            request->resp_size = size;
+            request->resp_us = arrival_us;
+            um_request_sample_rtt (hndl, request, arrival_us);
+            request->flags |= UM_REQUEST_ACK_GOT | UM_REQUEST_RESP_GOT;
+            um_request_done (hndl, request, 0);
+            um_state_unlock (hndl);
+            return UMP_RECEIVE_RESP_GOT;
+        }
+        um_state_unlock (hndl);
+        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "response to %d id %d without a pending request", type,
+                      message_id);
+        return 0;
+    }
+
+    if (options & SMCP1_OPT_REQ) // request to us
+    {
+        // TODO request to us - at least ping or version query?
+        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unsupported request type %d", type);
+    }
+
+    if (options & SMCP1_OPT_ERROR) {
+        return set_last_error (hndl, LIBUM_PEER_ERROR);
+    }
+    return 0;
+}
+
+// Receive and process a message, for the thread owning the socket read side
+static int um_recv_socket(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_data_ptr,
+                          const int timeout) {
+    IPADDR from;
+    unsigned long long arrival_us;
+    int ret;
+
+    // Not cleared beforehand, the processing stays within the received bytes
+    if ((ret = udp_recv (hndl, (unsigned char *) msg, sizeof (um_message), &from, &arrival_us, timeout)) < 1) {
+        if (!ret) {
+            return set_last_error (hndl, LIBUM_TIMEOUT);
+        }
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    return um_recv_process (hndl, msg, ret, &from, arrival_us, ext_data_type, ext_data_ptr);
+}
+
+int um_recv_ext(um_state *hndl, um_message *msg, int *ext_data_type, void *ext_data_ptr, const int timeout) {
+    if (ext_data_type != NULL) {
+        *ext_data_type = -1;
+    }
+    if (!hndl || hndl->socket == INVALID_SOCKET) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!msg) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // The socket is read by the receiver thread
+    if (hndl->receiver) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    return um_recv_socket (hndl, msg, ext_data_type, ext_data_ptr, timeout);
+}
+
+int um_recv(um_state *hndl, um_message *msg) { return um_recv_ext (hndl, msg, NULL, NULL, hndl->timeout); }
+
+// Process the datagrams already queued in the socket, at most max of them unless max is zero or negative.
+// Returns the count of the messages processed
+static int um_recv_drain(um_state *hndl, const int max) {
+    int i, n, ret, read = 0, count = 0;
+    um_recv_batch *batch;
+
+    um_state_lock (hndl);
+    if (!(batch = hndl->recv_batch) && !(batch = hndl->recv_batch = calloc (1, sizeof (um_recv_batch)))) {
+        um_state_unlock (hndl);
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    // Called from a notification handler of the batch being processed, or by another thread meanwhile.
+    // The batch buffers are in use, the messages are left to that drain.
+    if (batch->draining) {
+        um_state_unlock (hndl);
+        return 0;
+    }
+    batch->draining = true;
+    um_state_unlock (hndl);
+    do {
+        if ((n = udp_recv_batch (hndl, batch, max > 0 ? max - read : UM_RECV_BATCH_SIZE)) < 1) {
+            break;
+        }
+        read += n;
+        um_state_lock (hndl);
+        for (i = 0; i < n; i++) {
+            ret = um_recv_process (hndl, &batch->msgs[i], batch->sizes[i], &batch->from[i], batch->arrival_us[i],
+                                  NULL, NULL);
+            if (ret >= 0 || ret == LIBUM_INVALID_DEV) {
+                count++;
+            }
         }
-        return ext_data_size;
-    }
+        um_state_unlock (hndl);
+    } while (n == UM_RECV_BATCH_SIZE && (max <= 0 || read < max));
+    um_state_lock (hndl);
+    batch->draining = false;
+    um_state_unlock (hndl);
+    return count;
+}
 
-    // For responses or ACKs to our own request, accept only messages sent to our own id
-    if (receiver_id != hndl->own_id) {
-        return set_last_error (hndl, LIBUM_INVALID_DEV);
-    }
-    hndl->last_device_received = sender_id;
+static void um_receiver_run(um_state *hndl) {
+    um_receiver *receiver;
+    int ret, wait_ms;
 
-    // ACK sent to our own message
-    if (options & SMCP1_OPT_ACK) {
-        // ACK to our latest request
-        if (message_id == hndl->message_id) {
-            um_log_print (hndl, 3, __PRETTY_FUNCTION__, "ACK to %d request %d", type, message_id);
-            return UMP_RECEIVE_ACK_GOT;
+    um_state_lock (hndl);
+    // Already stopped, before this thread got to run
+    if (!(receiver = hndl->receiver)) {
+        um_state_unlock (hndl);
+        return;
+    }
+    hndl->lock->receiver_thread_id = um_thread_self ();
+    um_state_unlock (hndl);
+    while (receiver->running) {
+        // Also when the socket is idle. Nobody else may be waiting for a request, e.g. a detached
+        // position refresh, or flushing the coalesced uMa register writes.
+        um_uma_shadow_service (hndl);
+        um_state_lock (hndl);
+        um_request_service (hndl, um_clock_us ());
+        um_state_unlock (hndl);
+        if ((wait_ms = um_next_deadline_ms (hndl)) < 0 || wait_ms > LIBUM_RECEIVER_POLL_TIME) {
+            wait_ms = LIBUM_RECEIVER_POLL_TIME;
+        }
+        if ((ret = udp_select (hndl, wait_ms)) < 0) {
+            um_sleep_ms (LIBUM_RECEIVER_POLL_TIME);
+        } else if (ret > 0 && (ret = um_recv_drain (hndl, 0)) > 0) {
+            hndl->lock->msg_count += ret;
         }
-        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "ACK to %d id %d while %d expected", type, message_id,
-                      hndl->message_id);
-        return 0;
     }
+}
 
-    if (!(options & SMCP1_OPT_REQ)) {
-        // Response to our own request
-        if (message_id == hndl->message_id) {
-            um_log_print (hndl, 3, __PRETTY_FUNCTION__, "response to %d request %d", type, message_id);
-            return UMP_RECEIVE_RESP_GOT;
-        }
-        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "response to %d id %d while %d expected", type, message_id,
-                      hndl->message_id);
+#ifdef _WINDOWS
+static DWORD WINAPI um_receiver_thread(LPVOID arg) {
+    um_receiver_run ((um_state *) arg);
+    return 0;
+}
+#else
+static void *um_receiver_thread(void *arg) {
+    um_receiver_run ((um_state *) arg);
+    return NULL;
+}
+#endif
+
+int um_start_receiver(um_state *hndl) {
+    um_receiver *receiver;
+    int ret = 0;
+    if (!hndl || hndl->socket == INVALID_SOCKET) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    um_state_lock (hndl);
+    if (hndl->receiver) {
+        um_state_unlock (hndl);
         return 0;
     }
-
-    if (options & SMCP1_OPT_REQ) // request to us
-    {
-        // TODO request to us - at least ping or version query?
-        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unsupported request type %d", type);
+    if (!(receiver = calloc (1, sizeof (um_receiver)))) {
+        um_state_unlock (hndl);
+        hndl->last_os_errno = ENOMEM;
+        return set_last_error (hndl, LIBUM_OS_ERROR);
     }
-
-    if (options & SMCP1_OPT_ERROR) {
-        return set_last_error (hndl, LIBUM_PEER_ERROR);
+    receiver->running = true;
+    hndl->receiver = receiver;
+#ifdef _WINDOWS
+    if(!(receiver->thread = CreateThread(NULL, 0, um_receiver_thread, hndl, 0, NULL)))
+        ret = GetLastError();
+#else
+    ret = pthread_create (&receiver->thread, NULL, um_receiver_thread, hndl);
+#endif
+    if (ret) {
+        hndl->receiver = NULL;
+        um_state_unlock (hndl);
+        free (receiver);
+        hndl->last_os_errno = ret;
+        return set_last_error (hndl, LIBUM_OS_ERROR);
     }
+    um_state_unlock (hndl);
     return 0;
 }
 
-int um_recv(um_state *hndl, um_message *msg) { return um_recv_ext (hndl, msg, NULL, NULL, hndl->timeout); }
+int um_stop_receiver(um_state *hndl) {
+    um_receiver *receiver;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    um_state_lock (hndl);
+    if (!(receiver = hndl->receiver)) {
+        um_state_unlock (hndl);
+        return 0;
+    }
+    // The threads waiting for a request read the socket themselves from now on
+    hndl->receiver = NULL;
+    receiver->running = false;
+    um_cond_broadcast (&hndl->lock->cond);
+    um_state_unlock (hndl);
+#ifdef _WINDOWS
+    WaitForSingleObject(receiver->thread, INFINITE);
+    CloseHandle(receiver->thread);
+#else
+    pthread_join (receiver->thread, NULL);
+#endif
+    free (receiver);
+    return 0;
+}
 
 int um_receive(um_state *hndl, const int timelimit) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
     int dev, ret, count = 0;
+    um_device *device, *next;
     um_message resp;
-    unsigned long long now = um_get_timestamp_ms ();
+    unsigned long long now = um_clock_ms ();
 
-    if (!timelimit) {
-        do {
-            if ((ret = um_recv_ext (hndl, &resp, NULL, NULL, 0)) >= 0 || ret == LIBUM_INVALID_DEV) {
-                count++;
-            }
-        } while (ret >= 0 || ret == LIBUM_INVALID_DEV);
+    if (hndl->receiver) {
+        // Messages are processed by the receiver thread, just count them
+        unsigned long msg_count = hndl->lock->msg_count;
+        if (timelimit > 0) {
+            um_sleep_ms (timelimit);
+        }
+        count = (int) (hndl->lock->msg_count - msg_count);
+    } else if (!timelimit) {
+        count = um_recv_drain (hndl, 0);
     } else {
         do {
             if ((ret = um_recv (hndl, &resp)) >= 0) {
@@ -1320,19 +3215,93 @@ int um_receive(um_state *hndl, const int timelimit) {
         } while ((int) get_elapsed (now) < timelimit);
     }
 
-    for (dev = 1; dev < LIBUM_MAX_DEVS; dev++) {
-        unsigned long long ts = hndl->last_msg_ts[dev];
-        if (ts && hndl->addresses[dev].sin_family && now - ts > 30000) {
+    // Only devices with a known address are on the active list. Devices answering
+    // to the pings below are added to the list head and thus not visited in this round.
+    for (device = hndl->devices->active; device; device = next) {
+        next = device->active_next;
+        dev = device->dev_id;
+        if (dev < 1) {
+            continue;
+        }
+        unsigned long long ts = DEV_LAST_MSG_TS(hndl, dev);
+        if (ts && DEV_ADDRESS(hndl, dev).sin_family && now - ts > 30000) {
             if (um_cmd (hndl, dev, SMCP1_CMD_PING, 0, NULL) < 0) {
-                memset(&hndl->addresses[dev], 0, sizeof (IPADDR));
-                hndl->last_msg_ts[dev] = 0;
+                um_state_lock (hndl);
+                memset(&DEV_ADDRESS(hndl, dev), 0, sizeof (IPADDR));
+                DEV_LAST_MSG_TS(hndl, dev) = 0;
+                um_device_info_clear (hndl, dev);
+                um_device_deactivate (hndl, device);
+                um_state_unlock (hndl);
             }
         }
     }
+    // The receiver thread services them otherwise
+    if (!hndl->receiver) {
+        um_uma_shadow_service (hndl);
+    }
+    return count;
+}
+
+int um_get_socket_fd(um_state *hndl) {
+    if (!hndl || hndl->socket == INVALID_SOCKET) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    return (int) hndl->socket;
+}
 
+int um_process_readable(um_state *hndl, const int max_msgs) {
+    int count;
+    if (!hndl || hndl->socket == INVALID_SOCKET) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    // The socket is read by the receiver thread
+    if (hndl->receiver) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    count = um_recv_drain (hndl, max_msgs);
+    um_state_lock (hndl);
+    um_request_service (hndl, um_clock_us ());
+    um_state_unlock (hndl);
+    um_uma_shadow_service (hndl);
     return count;
 }
 
+int um_next_deadline_ms(um_state *hndl) {
+    int i, ret = -1;
+    unsigned long long deadline_us, now_us = um_clock_us ();
+    um_request *request;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    um_state_lock (hndl);
+    for (i = 0; i < LIBUM_MAX_PENDING && hndl->requests->pending; i++) {
+        request = &hndl->requests->slots[i];
+        if (request->state != UM_REQUEST_PENDING) {
+            continue;
+        }
+        deadline_us = um_request_deadline (hndl, request);
+        // Round up, the deadline is not due before
+        int left_ms = deadline_us > now_us ? (int) ((deadline_us - now_us + 999) / 1000) : 0;
+        if (ret < 0 || left_ms < ret) {
+            ret = left_ms;
+        }
+    }
+    // Coalesced uMa register writes waiting for the flush interval
+    for (i = 0; i < hndl->devices->count && hndl->devices->uma_shadows; i++) {
+        um_uma_shadow *shadow = hndl->devices->entries[i]->uma_shadow;
+        if (!shadow || !shadow->dirty || shadow->ticket) {
+            continue;
+        }
+        unsigned long long elapsed_ms = get_elapsed (shadow->flushed_ms);
+        int left_ms = elapsed_ms < (unsigned long long) shadow->interval_ms ? shadow->interval_ms - (int) elapsed_ms : 0;
+        if (ret < 0 || left_ms < ret) {
+            ret = left_ms;
+        }
+    }
+    um_state_unlock (hndl);
+    return ret;
+}
+
 int um_ping(um_state *hndl, const int dev) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
@@ -1367,50 +3336,34 @@ int um_cmd_options(um_state *hndl, const int optionbits) {
     return hndl->next_cmd_options;
 }
 
-static int um_send_msg(um_state *hndl, const int dev, const int cmd, const int argc, const int *argv, const int argc2,
-                       const int *argv2, // optional second subblock
-                       const int respc, int *respv) {
-    int i, j, resp_data_size, resp_data_type, ret = 0;
+// Encode a request frame into a slot, called while holding the state lock
+static void um_request_encode(um_state *hndl, um_request *request, const int dev_id, const int cmd, const int argc,
+                              const int *argv, const int argc2, const int *argv2, const int respc) {
     int options = SMCP1_OPT_REQ, req_size = SMCP1_FRAME_SIZE;
-    um_message req, resp;
-    smcp1_frame *req_header = (smcp1_frame *) &req;
-    smcp1_frame *resp_header = (smcp1_frame *) &resp;
-    smcp1_subblock_header *req_sub_header = (smcp1_subblock_header *) (((unsigned char *) &req) + SMCP1_FRAME_SIZE);
-    smcp1_subblock_header *req_sub_header2 = (smcp1_subblock_header *) (((unsigned char *) &req) + SMCP1_FRAME_SIZE +
+    unsigned char *req = *request->req;
+    smcp1_frame *req_header = (smcp1_frame *) req;
+    smcp1_subblock_header *req_sub_header = (smcp1_subblock_header *) (req + SMCP1_FRAME_SIZE);
+    smcp1_subblock_header *req_sub_header2 = (smcp1_subblock_header *) (req + SMCP1_FRAME_SIZE +
                                                                         SMCP1_SUB_BLOCK_HEADER_SIZE +
                                                                         argc * sizeof (int32_t));
-    int32_t *req_data_ptr = (int32_t *) (&req) + (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
+    int32_t *req_data_ptr = (int32_t *) req + (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
     int32_t *req_data_ptr2 =
-            (int32_t *) (&req) + (SMCP1_FRAME_SIZE + 2 * SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t) + argc;
-
-    smcp1_subblock_header *resp_sub_header = (smcp1_subblock_header *) (((unsigned char *) &resp) + SMCP1_FRAME_SIZE);
-    int32_t *resp_data_ptr = (int32_t *) (&resp) + (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
-
-    unsigned long long start;
-    bool ack_received = false, ack_requested = false;
-    bool resp_option_requested = false;
-
-    if (!hndl) {
-        return set_last_error (hndl, LIBUM_NOT_OPEN);
-    }
-    if (is_invalid_dev (dev)) {
-        return set_last_error (hndl, LIBUM_INVALID_DEV);
-    }
+            (int32_t *) req + (SMCP1_FRAME_SIZE + 2 * SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t) + argc;
 
-    int dev_id = um_resolve_dev_id (dev);
-
-    memset(&req, 0, sizeof (req));
-    memset(&resp, 0, sizeof (resp));
+    // Only the bytes sent are written, the rest of the frame buffer is left as is
+    request->message_id = ++hndl->message_id;
+    request->type = cmd;
+    request->dev_id = dev_id;
+    request->receiver_id = dev_id & 0xffff;
     req_header->version = SMCP1_VERSION;
+    req_header->extra = 0;
     req_header->sender_id = htons(hndl->own_id);
     req_header->receiver_id = htons(dev_id);
     req_header->type = htons(cmd);
-    req_header->message_id = htons(++hndl->message_id);
+    req_header->message_id = htons(request->message_id);
 
-    if (dev != SMCP1_ALL && dev != SMCP1_ALL_DEVICES && dev != SMCP1_ALL_CUS && dev != SMCP1_ALL_OTHERS &&
-        dev != SMCP1_ALL_PCS) {
+    if (!um_is_group_id (dev_id)) {
         options |= SMCP1_OPT_REQ_ACK;
-        ack_requested = true;
     }
     if (cmd == SMCP1_CMD_GOTO_MEM || cmd == SMCP1_CMD_GOTO_POS) {
         options |= SMCP1_OPT_REQ_NOTIFY;
@@ -1423,115 +3376,305 @@ static int um_send_msg(um_state *hndl, const int dev, const int cmd, const int a
         options |= SMCP1_OPT_REQ_RESP;
     }
 
-    // If there are additional options set, use them
+    // If there are additional options set, use them and reset for the next command
     if (hndl->next_cmd_options) {
         options |= hndl->next_cmd_options;
-        if (options & SMCP1_OPT_REQ_RESP && !respc) {
-            resp_option_requested = true;
-        }
-        if (options & SMCP1_OPT_REQ_ACK) {
-            ack_requested = true;
-        }
+        hndl->next_cmd_options = 0;
+    }
+    if (options & SMCP1_OPT_REQ_ACK) {
+        request->flags |= UM_REQUEST_ACK_REQUESTED;
+    }
+    if (options & SMCP1_OPT_REQ_RESP) {
+        request->flags |= UM_REQUEST_RESP_REQUESTED;
     }
 
     req_header->options = htonl(options);
-
-    // Reset option flags.
-    if (hndl->next_cmd_options) {
-        hndl->next_cmd_options = 0;
-    }
+    req_header->sub_blocks = 0;
 
     if (argc > 0 && argv != NULL) {
         req_header->sub_blocks = htons(1);
         req_size += sizeof (smcp1_subblock_header) + argc * sizeof (int32_t);
         req_sub_header->data_type = htons(SMCP1_DATA_INT32);
         req_sub_header->data_size = htons(argc);
-        for (j = 0; j < argc; j++)
-            *req_data_ptr++ = htonl(*argv++);
+        um_hton32_array (req_data_ptr, argv, argc);
 
         if (argc2 > 0 && argv2 != NULL) {
             req_header->sub_blocks = htons(2);
             req_size += sizeof (smcp1_subblock_header) + argc2 * sizeof (int32_t);
             req_sub_header2->data_type = htons(SMCP1_DATA_INT32);
             req_sub_header2->data_size = htons(argc2);
-
-            for (j = 0; j < argc2; j++)
-                *req_data_ptr2++ = htonl(*argv2++);
+            um_hton32_array (req_data_ptr2, argv2, argc2);
         }
     }
+    request->size = req_size;
+}
+
+// Send a request, returns a ticket to harvest the result with.
+// The device processing time expected after the ACK extends the response deadline.
+static int um_request_submit_process(um_state *hndl, const int dev, const int cmd, const int argc,
+                                     const int *argv, const int argc2, const int *argv2, const int respc,
+                                     const unsigned long long process_us) {
+    int ret, ticket;
+    um_request *request;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (argc < 0 || argc2 < 0 || respc < 0 || (argc + argc2) * (int) sizeof (int32_t) >
+                                              (int) (LIBUM_MAX_MESSAGE_SIZE - SMCP1_FRAME_SIZE -
+                                                     2 * SMCP1_SUB_BLOCK_HEADER_SIZE)) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+
+    int dev_id = um_resolve_dev_id (dev);
 
-    // No ACK or RESP requested, just send the message
-    if (!ack_requested && (!respc && !resp_option_requested)) {
-        return um_send (hndl, dev_id, (unsigned char *) &req, req_size);
+    um_state_lock (hndl);
+    if (!(request = um_request_alloc (hndl))) {
+        um_state_unlock (hndl);
+        um_log_print (hndl, 1, __PRETTY_FUNCTION__, "too many pending requests");
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    hndl->requests->pending++;
+    um_request_encode (hndl, request, dev_id, cmd, argc, argv, argc2, argv2, respc);
+    request->rto_us = um_is_group_id (dev_id) ? hndl->timeout * 1000 :
+                      um_device_rto_us (hndl, um_device_get (hndl, request->receiver_id));
+    request->sent_us = um_clock_us ();
+    request->expire_us = request->sent_us + um_request_max_attempts (hndl, request) * hndl->timeout * 1000ULL;
+    request->process_us = process_us;
+    if ((ret = um_send (hndl, dev_id, *request->req, request->size)) < 0) {
+        um_request_release (hndl, request);
+        um_state_unlock (hndl);
+        return ret;
     }
+    // No ACK or RESP requested, just sending the message is enough
+    if (!(request->flags & (UM_REQUEST_ACK_REQUESTED | UM_REQUEST_RESP_REQUESTED))) {
+        um_request_done (hndl, request, ret);
+    }
+    ticket = um_request_ticket (hndl, request);
+    um_state_unlock (hndl);
+    return ticket;
+}
 
-    start = um_get_timestamp_ms ();
-    for (i = 0; i < (ack_requested ? hndl->retransmit_count : 1); i++) {
-        // Do not resend message if ACK was already got
-        if (!ack_received && (ret = um_send (hndl, dev_id, (unsigned char *) &req, req_size)) < 0) {
-            return ret;
+static int um_request_submit(um_state *hndl, const int dev, const int cmd, const int argc, const int *argv,
+                             const int argc2, const int *argv2, const int respc) {
+    return um_request_submit_process (hndl, dev, cmd, argc, argv, argc2, argv2, respc, 0);
+}
+
+/*
+ * Wait until any or all of the requests are done, or the timeout (negative for no limit) expires.
+ * Reads the socket unless the receiver thread does it, and services the retransmits meanwhile.
+ * Returns the tickets array index of a done request when waiting for any of them,
+ * or the count of done requests when waiting for all of them.
+ */
+static int um_request_wait(um_state *hndl, const int *tickets, const int count, const int timeout, const bool all) {
+    um_message msg;
+    um_request *request;
+    unsigned long long now, deadline, start = um_clock_us ();
+    int i, valid, done, first, ret, wait_ms;
+
+    um_state_lock (hndl);
+    for (;;) {
+        now = um_clock_us ();
+        deadline = um_request_service (hndl, now);
+        valid = done = 0;
+        first = -1;
+        for (i = 0; i < count; i++) {
+            if (!(request = um_request_get (hndl, tickets[i]))) {
+                continue;
+            }
+            valid++;
+            if (request->state == UM_REQUEST_DONE) {
+                if (first < 0) {
+                    first = i;
+                }
+                done++;
+            }
+        }
+        if (!valid) {
+            ret = set_last_error (hndl, LIBUM_INVALID_ARG);
+            break;
         }
-        while ((ret = um_recv (hndl, &resp)) >= 0 ||
-               ((ret == LIBUM_TIMEOUT || ret == LIBUM_INVALID_DEV) && (int) get_elapsed (start) < hndl->timeout)) {
-            um_log_print (hndl, 4, __PRETTY_FUNCTION__, "ret %d %dms left", ret,
-                          (int) (hndl->timeout - get_elapsed (start)));
-            if (ret == 1) {
-                ack_received = true;
+        if (all ? done == valid : done > 0) {
+            ret = all ? done : first;
+            break;
+        }
+        if (timeout >= 0) {
+            if (now - start >= timeout * 1000ULL) {
+                ret = all ? done : set_last_error (hndl, LIBUM_TIMEOUT);
+                break;
             }
-            // If not expecting a response, getting ACK is enough.
-            if ((!respc && !resp_option_requested) && ret == 1) {
-                return 0;
+            if (start + timeout * 1000ULL < deadline) {
+                deadline = start + timeout * 1000ULL;
             }
-            // Expecting response
-            if ((respc || resp_option_requested) && ret == 2) {
-                // A notification may be received between the request and response,
-                // a more pedantic response validation is needed.
-                if (req_header->type != resp_header->type) {
-                    continue;
-                }
-                if (req_header->message_id != resp_header->message_id) {
-                    continue;
-                }
-                if (ntohs(resp_header->sub_blocks) < 1) {
-                    if (ntohl(resp_header->options) & SMCP1_OPT_ERROR) {
-                        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "peer error");
-                        return set_last_error (hndl, LIBUM_PEER_ERROR);
-                    } else {
-                        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "empty response");
-                        return set_last_error (hndl, LIBUM_INVALID_RESP);
-                    }
-                }
-                resp_data_size = ntohs(resp_sub_header->data_size);
-                resp_data_type = ntohs(resp_sub_header->data_type);
-                um_log_print (hndl, 3, __PRETTY_FUNCTION__, "%d data item%s of type %d", resp_data_size,
-                              resp_data_size > 1 ? "s" : "", resp_data_type);
-                switch (resp_data_type) {
-                    case SMCP1_DATA_UINT32:
-                        for (j = 0; j < resp_data_size && j < respc; j++)
-                            *respv++ = (int32_t) ntohl(*resp_data_ptr++);
-                        break;
-                    case SMCP1_DATA_INT32:
-                        for (j = 0; j < resp_data_size && j < respc; j++)
-                            *respv++ = ntohl(*resp_data_ptr++);
-                        break;
-                    case SMCP1_DATA_CHAR_STRING:
-                        memcpy(respv, resp_data_ptr, resp_data_size);
-                        //resp_data_size=1;
-                        break;
-                        //memcpy(respv, &resp, resp_data_size);
-                        //resp_data_size=1;
-                        //break;
-                    default:
-                        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unexpected data type %d", resp_data_type);
-                        return set_last_error (hndl, LIBUM_INVALID_RESP);
-                }
-                return resp_data_size;
+        }
+        // Round up to full milliseconds, the next deadline is not yet due
+        wait_ms = (int) ((deadline - now + 999) / 1000);
+        um_log_print (hndl, 4, __PRETTY_FUNCTION__, "%d/%d done %dms left", done, valid, wait_ms);
+        // A notification handler called by the receiver thread reads the socket itself
+        if (hndl->receiver && !um_receiver_is_self (hndl)) {
+            um_cond_wait_ms (&hndl->lock->cond, &hndl->lock->mutex, wait_ms);
+        } else {
+            um_recv_socket (hndl, &msg, NULL, NULL, wait_ms);
+        }
+    }
+    um_state_unlock (hndl);
+    return ret;
+}
+
+// Copy the response data of a done request, returns the count of data items or an error code
+static int um_request_decode(um_state *hndl, um_request *request, const int respc, int *respv) {
+    int resp_data_size, resp_data_type;
+    unsigned char *resp = *request->resp;
+    smcp1_frame *resp_header = (smcp1_frame *) resp;
+    smcp1_subblock_header *resp_sub_header = (smcp1_subblock_header *) (resp + SMCP1_FRAME_SIZE);
+    int32_t *resp_data_ptr = (int32_t *) resp + (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE) / sizeof (int32_t);
+
+    if (request->result < 0) {
+        return set_last_error (hndl, request->result);
+    }
+    // ACK or sending the message was enough
+    if (!(request->flags & UM_REQUEST_RESP_GOT)) {
+        return request->result;
+    }
+    if (ntohs(resp_header->sub_blocks) < 1 ||
+        request->resp_size < (int) (SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE)) {
+        if (ntohl(resp_header->options) & SMCP1_OPT_ERROR) {
+            um_log_print (hndl, 2, __PRETTY_FUNCTION__, "peer error");
+            return set_last_error (hndl, LIBUM_PEER_ERROR);
+        } else {
+            um_log_print (hndl, 2, __PRETTY_FUNCTION__, "empty response");
+            return set_last_error (hndl, LIBUM_INVALID_RESP);
+        }
+    }
+    resp_data_size = um_sub_block_items (resp_sub_header, resp + request->resp_size);
+    resp_data_type = ntohs(resp_sub_header->data_type);
+    um_log_print (hndl, 3, __PRETTY_FUNCTION__, "%d data item%s of type %d", resp_data_size,
+                  resp_data_size > 1 ? "s" : "", resp_data_type);
+    switch (resp_data_type) {
+        case SMCP1_DATA_UINT32:
+        case SMCP1_DATA_INT32:
+            if (respc > 0) {
+                um_hton32_array (respv, resp_data_ptr, resp_data_size < respc ? resp_data_size : respc);
+            }
+            break;
+        case SMCP1_DATA_CHAR_STRING:
+            if (respv) {
+                memcpy(respv, resp_data_ptr, resp_data_size);
             }
+            break;
+        case SMCP1_DATA_UINT64:
+        case SMCP1_DATA_INT64:
+            // Two words per item, the most significant first
+            if (respc > 0) {
+                um_hton32_array (respv, resp_data_ptr, 2 * resp_data_size < respc ? 2 * resp_data_size : respc);
+            }
+            return 2 * resp_data_size;
+        default:
+            um_log_print (hndl, 2, __PRETTY_FUNCTION__, "unexpected data type %d", resp_data_type);
+            return set_last_error (hndl, LIBUM_INVALID_RESP);
+    }
+    return resp_data_size;
+}
+
+int um_cmd_async(um_state *hndl, const int dev, const int cmd, const int argc, const int *argv, const int respsize) {
+    return um_request_submit (hndl, dev, cmd, argc, argv, 0, NULL, respsize);
+}
+
+int um_async_wait_any(um_state *hndl, const int *tickets, const int count, const int timeout) {
+    int ret;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!tickets || count < 1) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if ((ret = um_request_wait (hndl, tickets, count, timeout, false)) < 0) {
+        return ret;
+    }
+    return tickets[ret];
+}
+
+int um_async_wait_all(um_state *hndl, const int *tickets, const int count, const int timeout) {
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!tickets || count < 1) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    return um_request_wait (hndl, tickets, count, timeout, true);
+}
+
+// um_async_result also giving the arrival time of the response, resp_us may be NULL
+static int um_request_result(um_state *hndl, const int ticket, const int respsize, int *response,
+                             unsigned long long *resp_us) {
+    int ret;
+    um_request *request;
+    if (!(request = um_request_get (hndl, ticket))) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if ((ret = um_request_wait (hndl, &ticket, 1, -1, false)) >= 0) {
+        ret = um_request_decode (hndl, request, respsize, response);
+        if (resp_us) {
+            *resp_us = request->resp_us;
         }
     }
+    um_request_release (hndl, request);
     return ret;
 }
 
+int um_async_result(um_state *hndl, const int ticket, const int respsize, int *response) {
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    return um_request_result (hndl, ticket, respsize, response, NULL);
+}
+
+int um_async_cancel(um_state *hndl, const int ticket) {
+    um_request *request;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    um_state_lock (hndl);
+    if (!(request = um_request_get (hndl, ticket))) {
+        um_state_unlock (hndl);
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    um_request_release (hndl, request);
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_get_rtt(um_state *hndl, const int dev, int *srtt_us, int *rttvar_us) {
+    const um_device *device;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    device = um_device_find (hndl, um_resolve_dev_id (dev) & 0xffff);
+    if (srtt_us) {
+        *srtt_us = device->srtt_us;
+    }
+    if (rttvar_us) {
+        *rttvar_us = device->rttvar_us;
+    }
+    return um_device_rto_us (hndl, device);
+}
+
+static int um_send_msg(um_state *hndl, const int dev, const int cmd, const int argc, const int *argv, const int argc2,
+                       const int *argv2, // optional second subblock
+                       const int respc, int *respv) {
+    int ticket;
+    if ((ticket = um_request_submit (hndl, dev, cmd, argc, argv, argc2, argv2, respc)) < 0) {
+        return ticket;
+    }
+    return um_async_result (hndl, ticket, respc, respv);
+}
+
 int um_cmd_may_cause_movement(const int cmd) {
     switch (cmd) {
         case SMCP1_CMD_INIT_ZERO:
@@ -1547,6 +3690,102 @@ int um_cmd_may_cause_movement(const int cmd) {
 }
 
 
+// Static information cache of a single device, NULL for the group ids. Accessed with the state lock held
+static um_device_info *um_device_info_get(um_state *hndl, const int dev) {
+    int dev_id = um_resolve_dev_id (dev);
+    if (um_is_group_id (dev_id)) {
+        return NULL;
+    }
+    return &um_device_get (hndl, dev_id)->info;
+}
+
+// Lookup only version of um_device_info_get, nothing is cached for an unknown device
+static const um_device_info *um_device_info_find(um_state *hndl, const int dev) {
+    int dev_id = um_resolve_dev_id (dev);
+    if (um_is_group_id (dev_id)) {
+        return NULL;
+    }
+    return &um_device_find (hndl, dev_id)->info;
+}
+
+// Cached parameter value, returns false if not cached
+static bool um_device_info_param(um_state *hndl, const int dev, const int param_id, int *value) {
+    bool found = false;
+    const um_device_info *info;
+    um_state_lock (hndl);
+    if ((info = um_device_info_find (hndl, dev))) {
+        if (param_id == SMCP1_PARAM_AXIS_COUNT && info->valid & UM_INFO_AXIS_COUNT) {
+            *value = info->axis_count;
+            found = true;
+        } else if (param_id == SMCP1_PARAM_AXIS_HEAD_CONFIGURATION && info->valid & UM_INFO_HEAD_CONFIG) {
+            *value = info->head_config;
+            found = true;
+        }
+    }
+    um_state_unlock (hndl);
+    return found;
+}
+
+// Cache a parameter value got from the device, or forget it when set (value SMCP1_ARG_UNDEF)
+static void um_device_info_set_param(um_state *hndl, const int dev, const int param_id, const int value) {
+    um_device_info *info;
+    unsigned int bit;
+    um_state_lock (hndl);
+    if ((info = um_device_info_get (hndl, dev))) {
+        if (param_id == SMCP1_PARAM_AXIS_COUNT) {
+            info->axis_count = value;
+            bit = UM_INFO_AXIS_COUNT;
+        } else if (param_id == SMCP1_PARAM_AXIS_HEAD_CONFIGURATION) {
+            info->head_config = value;
+            bit = UM_INFO_HEAD_CONFIG;
+        } else {
+            bit = 0;
+        }
+        info->valid = value != SMCP1_ARG_UNDEF ? info->valid | bit : info->valid & ~bit;
+    }
+    um_state_unlock (hndl);
+}
+
+// Cached feature state, negative if not cached
+static int um_device_info_feature(um_state *hndl, const int dev, const bool ext, const int feature_id) {
+    int ret = -1;
+    const um_device_info *info;
+    if (feature_id < 0 || feature_id > 63) {
+        return ret;
+    }
+    um_state_lock (hndl);
+    if ((info = um_device_info_find (hndl, dev)) &&
+        (ext ? info->ext_features_valid : info->features_valid) & (1ULL << feature_id)) {
+        ret = (ext ? info->ext_features : info->features) & (1ULL << feature_id) ? 1 : 0;
+    }
+    um_state_unlock (hndl);
+    return ret;
+}
+
+// Cache a feature state got from the device, or forget it when set (value negative).
+// Only the documented 0 or 1 values fit the bitmask, others are not cached
+static void um_device_info_set_feature(um_state *hndl, const int dev, const bool ext, const int feature_id,
+                                       const int value) {
+    um_device_info *info;
+    uint64_t bit;
+    if (feature_id < 0 || feature_id > 63) {
+        return;
+    }
+    bit = 1ULL << feature_id;
+    um_state_lock (hndl);
+    if ((info = um_device_info_get (hndl, dev))) {
+        uint64_t *valid = ext ? &info->ext_features_valid : &info->features_valid;
+        uint64_t *features = ext ? &info->ext_features : &info->features;
+        if (value == 0 || value == 1) {
+            *valid |= bit;
+            *features = value ? *features | bit : *features & ~bit;
+        } else {
+            *valid &= ~bit;
+        }
+    }
+    um_state_unlock (hndl);
+}
+
 int um_set_param(um_state *hndl, const int dev, const int param_id, const int value) {
     int args[2];
     if (!hndl) {
@@ -1554,6 +3793,8 @@ int um_set_param(um_state *hndl, const int dev, const int param_id, const int va
     }
     args[0] = param_id;
     args[1] = value;
+    // The device may reject or adjust the value, read it again when needed
+    um_device_info_set_param (hndl, dev, param_id, SMCP1_ARG_UNDEF);
     return um_cmd (hndl, dev, SMCP1_SET_PARAMETER, 2, args);
 }
 
@@ -1580,6 +3821,7 @@ int um_set_feature(um_state *hndl, const int dev, const int feature_id, const in
     }
     args[0] = feature_id;
     args[1] = value;
+    um_device_info_set_feature (hndl, dev, false, feature_id, -1);
     return um_cmd (hndl, dev, SMCP1_SET_FEATURE, 2, args);
 }
 
@@ -1590,6 +3832,7 @@ int um_set_ext_feature(um_state *hndl, const int dev, const int feature_id, cons
     }
     args[0] = feature_id;
     args[1] = value;
+    um_device_info_set_feature (hndl, dev, true, feature_id, -1);
     return um_cmd (hndl, dev, SMCP1_SET_EXT_FEATURE, 2, args);
 }
 
@@ -1611,8 +3854,17 @@ int ump_get_axis_angle(um_state *hndl, const int dev, float *value) {
 }
 
 int ump_get_handedness_configuration(um_state *hndl, const int dev) {
-    int config;
-    int resp = um_get_param (hndl, dev, SMCP1_PARAM_AXIS_HEAD_CONFIGURATION, &config);
+    int config = 0, resp = 1;
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (!um_device_info_param (hndl, dev, SMCP1_PARAM_AXIS_HEAD_CONFIGURATION, &config) &&
+        (resp = um_get_param (hndl, dev, SMCP1_PARAM_AXIS_HEAD_CONFIGURATION, &config)) >= 0) {
+        um_device_info_set_param (hndl, dev, SMCP1_PARAM_AXIS_HEAD_CONFIGURATION, config);
+    }
     if (resp >= 0) {
         resp = config & (1 << 1) ? 1 : 0;
     }
@@ -1706,12 +3958,19 @@ int um_get_feature(um_state *hndl, const int dev, const int feature_id) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if ((ret = um_device_info_feature (hndl, dev, false, feature_id)) >= 0) {
+        return ret;
+    }
     if ((ret = um_send_msg (hndl, dev, SMCP1_GET_FEATURE, 1, &feature_id, 0, NULL, 2, resp)) < 0) {
         return ret;
     }
     if (resp[0] != feature_id || ret != 2) {
         return set_last_error (hndl, LIBUM_INVALID_RESP);
     }
+    um_device_info_set_feature (hndl, dev, false, feature_id, resp[1]);
     return resp[1];
 }
 
@@ -1720,12 +3979,19 @@ int um_get_ext_feature(um_state *hndl, const int dev, const int feature_id) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if ((ret = um_device_info_feature (hndl, dev, true, feature_id)) >= 0) {
+        return ret;
+    }
     if ((ret = um_send_msg (hndl, dev, SMCP1_GET_EXT_FEATURE, 1, &feature_id, 0, NULL, 2, resp)) < 0) {
         return ret;
     }
     if (resp[0] != feature_id || ret != 2) {
         return set_last_error (hndl, LIBUM_INVALID_RESP);
     }
+    um_device_info_set_feature (hndl, dev, true, feature_id, resp[1]);
     return resp[1];
 }
 
@@ -1760,14 +4026,110 @@ int um_get_feature_functionality(um_state *hndl, const int dev, const int featur
     return resp[1];
 }
 
+// A feature bitmask response, one word or two with the most significant first
+static uint64_t um_features_mask(const int *resp, const int count) {
+    if (count < 2) {
+        return (uint32_t) resp[0];
+    }
+    return (uint64_t) (uint32_t) resp[0] << 32 | (uint32_t) resp[1];
+}
+
+int um_get_features(um_state *hndl, const int dev, const int time_limit, uint64_t *features,
+                    uint32_t *ext_features) {
+    int i, tickets[2], counts[2], resp[2][2];
+    um_device_info *info;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev) || um_is_group_id (um_resolve_dev_id (dev))) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    um_state_lock (hndl);
+    info = um_device_info_get (hndl, dev);
+    if (info->valid & UM_INFO_FEATURES && info->features_valid == ~0ULL &&
+        (info->ext_features_valid & UM_INFO_EXT_FEATURES_ALL) == UM_INFO_EXT_FEATURES_ALL &&
+        time_limit != LIBUM_TIMELIMIT_DISABLED &&
+        (time_limit == LIBUM_TIMELIMIT_CACHE_ONLY || get_elapsed (info->features_ts) < (unsigned long) time_limit)) {
+        if (features) {
+            *features = info->features;
+        }
+        if (ext_features) {
+            *ext_features = (uint32_t) (info->ext_features >> 32);
+        }
+        um_state_unlock (hndl);
+        return 0;
+    }
+    um_state_unlock (hndl);
+
+    // Both requests in flight at once
+    memset(resp, 0, sizeof (resp));
+    if ((tickets[0] = um_request_submit (hndl, dev, SMCP1_GET_FEATURES, 0, NULL, 0, NULL, 2)) < 0) {
+        return tickets[0];
+    }
+    if ((tickets[1] = um_request_submit (hndl, dev, SMCP1_GET_EXT_FEATURES, 0, NULL, 0, NULL, 2)) < 0) {
+        um_async_cancel (hndl, tickets[0]);
+        return tickets[1];
+    }
+    for (i = 0; i < 2; i++) {
+        if ((counts[i] = um_async_result (hndl, tickets[i], 2, resp[i])) < 1) {
+            if (!i) {
+                um_async_cancel (hndl, tickets[1]);
+            }
+            return counts[i] < 0 ? counts[i] : set_last_error (hndl, LIBUM_INVALID_RESP);
+        }
+    }
+
+    um_state_lock (hndl);
+    info = um_device_info_get (hndl, dev);
+    info->features = um_features_mask (resp[0], counts[0]);
+    info->features_valid = ~0ULL;
+    info->ext_features = (info->ext_features & ~UM_INFO_EXT_FEATURES_ALL) | um_features_mask (resp[1], counts[1]) << 32;
+    info->ext_features_valid |= UM_INFO_EXT_FEATURES_ALL;
+    info->features_ts = um_clock_ms ();
+    info->valid |= UM_INFO_FEATURES;
+    if (features) {
+        *features = info->features;
+    }
+    if (ext_features) {
+        *ext_features = (uint32_t) (info->ext_features >> 32);
+    }
+    um_state_unlock (hndl);
+    return 0;
+}
+
 int um_read_version(um_state *hndl, const int dev, int *version, const int size) {
+    int ret = -1;
+    const um_device_info *cached;
+    um_device_info *info;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
     if (is_invalid_dev (dev)) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
-    return um_send_msg (hndl, dev, SMCP1_GET_VERSION, 0, NULL, 0, NULL, size, version);
+    // The count of the version items is returned also when the buffer holds less of them
+    um_state_lock (hndl);
+    if (version && size > 0 && (cached = um_device_info_find (hndl, dev)) && cached->valid & UM_INFO_VERSION) {
+        ret = cached->version_size;
+        memcpy(version, cached->version, (size < ret ? size : ret) * sizeof (int));
+    }
+    um_state_unlock (hndl);
+    if (ret >= 0) {
+        return ret;
+    }
+    // Cached only when got completely
+    if ((ret = um_send_msg (hndl, dev, SMCP1_GET_VERSION, 0, NULL, 0, NULL, size, version)) > 0 && version &&
+        ret <= size && ret <= UM_INFO_VERSION_SIZE) {
+        um_state_lock (hndl);
+        if ((info = um_device_info_get (hndl, dev))) {
+            memcpy(info->version, version, ret * sizeof (int));
+            info->version_size = ret;
+            info->valid |= UM_INFO_VERSION;
+        }
+        um_state_unlock (hndl);
+    }
+    return ret;
 }
 
 int um_get_axis_count(um_state *hndl, const int dev) {
@@ -1778,17 +4140,152 @@ int um_get_axis_count(um_state *hndl, const int dev) {
     if (is_invalid_dev (dev)) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
+    if (um_device_info_param (hndl, dev, SMCP1_PARAM_AXIS_COUNT, &value)) {
+        return value;
+    }
     if ((ret = um_get_param (hndl, dev, SMCP1_PARAM_AXIS_COUNT, &value)) < 0) {
         return ret;
     }
+    um_device_info_set_param (hndl, dev, SMCP1_PARAM_AXIS_COUNT, value);
     return value;
 }
 
+// Store positions got from a device into the cache, optionally copying the updated cache entry
+static void um_store_positions(um_state *hndl, const int dev_id, const int *resp, const int count,
+                               const unsigned long long resp_us, um_positions *copy) {
+    int i;
+    um_positions *positions = um_positions_write_begin (hndl, dev_id);
+    um_update_position_cache_time (hndl, dev_id, resp_us);
+    for (i = 0; i < count && i < 4; i++) {
+        um_update_positions_cache (hndl, dev_id, i, resp[i], resp_us);
+    }
+    if (copy) {
+        memcpy(copy, positions, sizeof (um_positions));
+    }
+    um_positions_write_end (hndl, dev_id);
+}
+
+// Cache entry new enough for the time limit, see um_get_positions()
+static bool um_positions_fresh(const um_positions *positions, const int time_limit) {
+    unsigned long long elapsed = get_elapsed (positions->updated_us / 1000LL);
+    if (time_limit == LIBUM_TIMELIMIT_DISABLED || !positions->updated_us) {
+        return false;
+    }
+    return elapsed < (unsigned long) time_limit || time_limit == LIBUM_TIMELIMIT_CACHE_ONLY;
+}
+
+// Apply the result of a request nobody waits for and free its slot, called with the state lock held
+static void um_request_detached_done(um_state *hndl, um_request *request) {
+    int i, resp[4], ret, ticket;
+    um_sequence *sequence;
+    um_uma_shadow *shadow;
+    if (request->type == SMCP1_GET_POSITIONS) {
+        um_device_get (hndl, request->dev_id)->refresh_ticket = 0;
+        if (request->result >= 0 && (ret = um_request_decode (hndl, request, 4, resp)) > 0) {
+            um_store_positions (hndl, request->dev_id, resp, ret, request->resp_us, NULL);
+        }
+    } else if (request->type == SMCP1_SET_UMA_REGS) {
+        // A background flush of a uMa register shadow, the failed registers are sent again
+        ticket = um_request_ticket (hndl, request);
+        shadow = um_device_get (hndl, request->dev_id)->uma_shadow;
+        if (shadow && shadow->ticket == ticket) {
+            if (request->result < 0) {
+                shadow->dirty |= shadow->sending;
+                shadow->result = request->result;
+            }
+            shadow->sending = 0;
+            shadow->ticket = 0;
+        }
+    } else if (request->type == SMCP1_UMV_START_SEQUENCE) {
+        // A part of a sequence sent by um_sequence_status
+        ticket = um_request_ticket (hndl, request);
+        for (i = 0; i < 8; i++) {
+            if ((sequence = um_device_get (hndl, request->dev_id)->sequences[i]) && sequence->ticket == ticket) {
+                sequence->ticket = 0;
+                sequence->result = request->result < 0 ? request->result : 0;
+            }
+        }
+    }
+    um_request_release (hndl, request);
+}
+
+// Request the positions in the background unless already requested, the callers are coalesced
+static int um_positions_refresh(um_state *hndl, const int dev, const int dev_id) {
+    int ticket;
+    um_request *request;
+    um_device *device = um_device_get (hndl, dev_id);
+
+    um_state_lock (hndl);
+    if (device->refresh_ticket && um_request_get (hndl, device->refresh_ticket)) {
+        um_state_unlock (hndl);
+        return 0;
+    }
+    if ((ticket = um_request_submit (hndl, dev, SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4)) < 0) {
+        um_state_unlock (hndl);
+        return ticket;
+    }
+    // The lock is held, the response cannot have been processed yet
+    request = um_request_get (hndl, ticket);
+    request->flags |= UM_REQUEST_DETACHED;
+    device->refresh_ticket = ticket;
+    um_state_unlock (hndl);
+    return 1;
+}
+
+int um_get_positions_nowait(um_state *hndl, const int dev, const int time_limit, float *x, float *y, float *z,
+                            float *d, int *elapsedptr) {
+    int ret = 0, refresh;
+    um_positions positions;
+
+    if (!hndl || hndl->socket == INVALID_SOCKET) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+
+    int dev_id = um_resolve_dev_id (dev);
+    if (um_is_group_id (dev_id)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    // Without the receiver thread apply what has already arrived, without blocking
+    if (!hndl->receiver) {
+        um_recv_drain (hndl, 0);
+        um_state_lock (hndl);
+        um_request_service (hndl, um_clock_us ());
+        um_state_unlock (hndl);
+    }
+    um_positions_read (hndl, dev_id, &positions);
+    if (!um_positions_fresh (&positions, time_limit) && (refresh = um_positions_refresh (hndl, dev, dev_id)) < 0) {
+        return refresh;
+    }
+    if (positions.x != SMCP1_ARG_UNDEF && x) {
+        *x = nm2um (positions.x);
+        ret++;
+    }
+    if (positions.y != SMCP1_ARG_UNDEF && y) {
+        *y = nm2um (positions.y);
+        ret++;
+    }
+    if (positions.z != SMCP1_ARG_UNDEF && z) {
+        *z = nm2um (positions.z);
+        ret++;
+    }
+    if (positions.d != SMCP1_ARG_UNDEF && d) {
+        *d = nm2um (positions.d);
+        ret++;
+    }
+    if (elapsedptr) {
+        *elapsedptr = positions.updated_us ? (int) get_elapsed (positions.updated_us / 1000LL) : -1;
+    }
+    return ret;
+}
+
 int um_get_positions(um_state *hndl, const int dev, const int time_limit, float *x, float *y, float *z, float *d,
                      int *elapsedptr) {
     int resp[4], ret = 0;
-    um_positions *positions;
-    unsigned long long start, elapsed;
+    um_positions snapshot, *positions = &snapshot;
+    unsigned long long start, elapsed, resp_us;
 
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
@@ -1798,7 +4295,7 @@ int um_get_positions(um_state *hndl, const int dev, const int time_limit, float
     }
 
     int dev_id = um_resolve_dev_id (dev);
-    positions = &hndl->last_positions[dev_id];
+    um_positions_read (hndl, dev_id, positions);
 
     elapsed = get_elapsed (positions->updated_us / 1000LL);
 
@@ -1829,42 +4326,354 @@ int um_get_positions(um_state *hndl, const int dev, const int time_limit, float
     }
     // Too old or missing positions, request them from the manipulator
     memset(resp, 0, sizeof (resp));
-    start = um_get_timestamp_ms ();
-    if ((ret = um_send_msg (hndl, dev, SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4, resp)) > 0) {
-        int time_step = um_update_position_cache_time (hndl, dev_id);
-        um_update_positions_cache (hndl, dev_id, 0, resp[0], time_step);
+    start = um_clock_ms ();
+    if ((ret = um_request_submit (hndl, dev, SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4)) >= 0 &&
+        (ret = um_request_result (hndl, ret, 4, resp, &resp_us)) > 0) {
+        um_store_positions (hndl, dev_id, resp, ret, resp_us, positions);
         if (x) {
             *x = positions->x != SMCP1_ARG_UNDEF ? nm2um (positions->x) : 0.0f;
         }
-        if (ret > 1) {
-            um_update_positions_cache (hndl, dev_id, 1, resp[1], time_step);
-            if (y) {
-                *y = positions->x != SMCP1_ARG_UNDEF ? nm2um (positions->y) : 0.0f;
+        if (ret > 1 && y) {
+            *y = positions->x != SMCP1_ARG_UNDEF ? nm2um (positions->y) : 0.0f;
+        }
+        if (ret > 2 && z) {
+            *z = positions->z != SMCP1_ARG_UNDEF ? nm2um (positions->z) : 0.0f;
+        }
+        if (ret > 3 && d) {
+            *d = positions->d != SMCP1_ARG_UNDEF ? nm2um (positions->d) : 0.0f;
+        }
+    }
+    if (elapsedptr && positions->updated_us) {
+        *elapsedptr = (int) get_elapsed (start);
+    }
+    return ret;
+}
+
+int um_get_positions_multi(um_state *hndl, const int *devs, const int count, const int time_limit,
+                           um_positions *positions) {
+    int i, k, first, ret, ticket, pending, done = 0, resp[4];
+    int tickets[LIBUM_MAX_PENDING], index[LIBUM_MAX_PENDING];
+    unsigned long long resp_us;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!devs || !positions || count < 1) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    for (i = 0; i < count; i++) {
+        if (is_invalid_dev (devs[i])) {
+            return set_last_error (hndl, LIBUM_INVALID_DEV);
+        }
+    }
+    for (first = 0; first < count; first = i) {
+        // Serve the fresh entries from the cache and fire the requests for the stale ones back to back
+        for (i = first, pending = 0; i < count && pending < LIBUM_MAX_PENDING; i++) {
+            um_positions_read (hndl, um_resolve_dev_id (devs[i]), &positions[i]);
+            if (um_positions_fresh (&positions[i], time_limit)) {
+                done++;
+                continue;
+            }
+            if (time_limit == LIBUM_TIMELIMIT_CACHE_ONLY) {
+                continue;
+            }
+            if ((ticket = um_request_submit (hndl, devs[i], SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4)) < 0) {
+                // Request table full, gather the pending ones and continue from this device
+                if (pending) {
+                    break;
+                }
+                continue;
             }
+            tickets[pending] = ticket;
+            index[pending++] = i;
         }
-        if (ret > 2) {
-            um_update_positions_cache (hndl, dev_id, 2, resp[2], time_step);
-            if (z) {
-                *z = positions->z != SMCP1_ARG_UNDEF ? nm2um (positions->z) : 0.0f;
+        // Gather the responses in the arrival order
+        while (pending > 0) {
+            if ((ticket = um_async_wait_any (hndl, tickets, pending, -1)) < 0) {
+                for (k = 0; k < pending; k++) {
+                    um_async_cancel (hndl, tickets[k]);
+                }
+                break;
+            }
+            for (k = 0; tickets[k] != ticket; k++);
+            if ((ret = um_request_result (hndl, ticket, 4, resp, &resp_us)) > 0) {
+                um_store_positions (hndl, um_resolve_dev_id (devs[index[k]]), resp, ret, resp_us,
+                                    &positions[index[k]]);
+                done++;
             }
+            tickets[k] = tickets[--pending];
+            index[k] = index[pending];
         }
-        if (ret > 3) {
-            um_update_positions_cache (hndl, dev_id, 3, resp[3], time_step);
-            if (d) {
-                *d = positions->d != SMCP1_ARG_UNDEF ? nm2um (positions->d) : 0.0f;
+    }
+    return done;
+}
+
+int um_set_position_history(um_state *hndl, const int capacity) {
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (capacity < 0 || capacity > LIBUM_MAX_POSITION_HISTORY) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    um_state_lock (hndl);
+    hndl->devices->history_capacity = capacity;
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_get_position_history(um_state *hndl, const int dev, const unsigned long long since_us,
+                            um_position_sample *samples, const int size) {
+    int ret;
+    unsigned int seq;
+    unsigned long long i, first, count;
+    um_position_history *history;
+    const um_position_sample *sample;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (!samples || size < 0) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // The shared entry of the unknown devices has no history
+    if (!(history = um_device_find (hndl, um_resolve_dev_id (dev))->history)) {
+        return 0;
+    }
+    do {
+        seq = um_seq_read_begin (&history->seq);
+        count = history->count;
+        first = count > (unsigned long long) history->capacity ? count - history->capacity : 0;
+        for (ret = 0, i = first; i < count && ret < size; i++) {
+            sample = &history->samples[i % history->capacity];
+            if (sample->timestamp_us > since_us) {
+                samples[ret++] = *sample;
             }
         }
-        positions->updated_us = um_get_timestamp_us ();
+        um_barrier ();
+    } while (seq != history->seq);
+    return ret;
+}
+
+int um_set_uma_ring(um_state *hndl, const int capacity) {
+    unsigned int size = 1;
+    um_uma_ring *ring = NULL;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (capacity < 0 || capacity > LIBUM_MAX_UMA_RING) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if (capacity) {
+        while (size < (unsigned int) capacity) {
+            size <<= 1;
+        }
+        // Blocks are written before read, no need to clear them
+        if (!(ring = malloc (sizeof (um_uma_ring) + size * sizeof (um_uma_block)))) {
+            return set_last_error (hndl, LIBUM_OS_ERROR);
+        }
+        memset(ring, 0, sizeof (um_uma_ring));
+        ring->mask = size - 1;
     }
-    if (elapsedptr && positions->updated_us) {
-        *elapsedptr = (int) get_elapsed (start);
+    um_state_lock (hndl);
+    free (hndl->uma_ring);
+    hndl->uma_ring = ring;
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_read_uma_ring(um_state *hndl, const um_uma_block **blocks) {
+    um_uma_ring *ring;
+    unsigned int head, first;
+
+    if (blocks) {
+        *blocks = NULL;
+    }
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!blocks || !(ring = hndl->uma_ring)) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    head = ring->head;
+    // The blocks are read after seeing the head
+    um_barrier ();
+    if (head == ring->tail) {
+        return 0;
+    }
+    first = ring->tail & ring->mask;
+    *blocks = &ring->blocks[first];
+    // Up to the end of the ring
+    if (head - ring->tail < ring->mask + 1 - first) {
+        return (int) (head - ring->tail);
+    }
+    return (int) (ring->mask + 1 - first);
+}
+
+int um_release_uma_ring(um_state *hndl, const int count) {
+    um_uma_ring *ring;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!(ring = hndl->uma_ring) || count < 0 || (unsigned int) count > ring->head - ring->tail) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // The blocks are read before the writer may reuse them
+    um_barrier ();
+    ring->tail += count;
+    return 0;
+}
+
+int um_start_uma_recorder(um_state *hndl, const int dev, const char *path) {
+    um_uma_recorder *recorder;
+    um_uma_record_header *header;
+    int ret, regs[LIBUM_UMA_RECORD_REGS];
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (!path || hndl->uma_recorder) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // The recording is useful without the settings too
+    if ((ret = um_get_uma_regs (hndl, dev, LIBUM_UMA_RECORD_REGS, regs)) < 0) {
+        um_log_print (hndl, 1, __PRETTY_FUNCTION__, "uMa %d registers not read, error %d", dev, ret);
+    }
+    if (!(recorder = calloc (1, sizeof (um_uma_recorder)))) {
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    recorder->dev = dev;
+#ifdef _WINDOWS
+    if ((recorder->file = CreateFileA (path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+                                       FILE_ATTRIBUTE_NORMAL, NULL)) == INVALID_HANDLE_VALUE) {
+        free (recorder);
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+#else
+    if ((recorder->fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+        free (recorder);
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+#endif
+    if (um_uma_recorder_map (recorder, UM_UMA_RECORD_CHUNK) < 0) {
+        um_uma_recorder_close (recorder);
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    header = (um_uma_record_header *) recorder->base;
+    memcpy(header->magic, LIBUM_UMA_RECORD_MAGIC, sizeof (header->magic));
+    header->header_size = sizeof (um_uma_record_header);
+    recorder->recorded = header->header_size;
+    header->dev = dev;
+    if (ret >= 0) {
+        header->reg_count = LIBUM_UMA_RECORD_REGS;
+        memcpy(header->regs, regs, sizeof (regs));
+    }
+    header->start_us = um_clock_us ();
+    header->start_time_ms = um_get_timestamp_ms ();
+    header->index_stride = 1;
+
+    um_state_lock (hndl);
+    hndl->uma_recorder = recorder;
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_stop_uma_recorder(um_state *hndl) {
+    um_uma_recorder *recorder;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    um_state_lock (hndl);
+    recorder = hndl->uma_recorder;
+    hndl->uma_recorder = NULL;
+    um_state_unlock (hndl);
+    if (!recorder) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if (um_uma_recorder_close (recorder) < 0) {
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    return 0;
+}
+
+int um_get_uma_ring_stats(um_state *hndl, unsigned long long *received, unsigned long long *dropped,
+                          unsigned long long *missing) {
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (!hndl->uma_ring) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    um_state_lock (hndl);
+    if (received) {
+        *received = hndl->uma_ring->received;
+    }
+    if (dropped) {
+        *dropped = hndl->uma_ring->dropped_total;
+    }
+    if (missing) {
+        *missing = hndl->uma_ring->missing;
+    }
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_predict_position(um_state *hndl, const int dev, const unsigned long long t_us, float *x, float *y, float *z,
+                        float *d) {
+    int i, ret = 0;
+    unsigned int seq, valid;
+    long long dt_us;
+    double pos[4], vel[4];
+    float *outputs[4] = {x, y, z, d};
+    unsigned long long ts_us[4];
+    const um_device *device;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    int dev_id = um_resolve_dev_id (dev);
+    device = um_device_find (hndl, dev_id);
+    // Filter state is written under the position cache sequence lock
+    do {
+        seq = um_seq_read_begin (&device->positions_seq);
+        memcpy(pos, device->filter_pos, sizeof (pos));
+        memcpy(vel, device->filter_vel, sizeof (vel));
+        memcpy(ts_us, device->filter_ts_us, sizeof (ts_us));
+        valid = device->filter_valid;
+        um_barrier ();
+    } while (seq != device->positions_seq);
+
+    // Extrapolated from the latest sample of each axis
+    for (i = 0; i < 4; i++) {
+        if (!(valid & (1u << i)) || !outputs[i]) {
+            continue;
+        }
+        dt_us = (long long) (t_us - ts_us[i]);
+        if (dt_us > UM_PREDICT_MAX_US) {
+            dt_us = UM_PREDICT_MAX_US;
+        } else if (dt_us < -UM_PREDICT_MAX_US) {
+            dt_us = -UM_PREDICT_MAX_US;
+        }
+        *outputs[i] = (float) ((pos[i] + vel[i] * (double) dt_us) / 1000.0);
+        ret++;
     }
     return ret;
 }
 
 int um_get_speeds(um_state *hndl, const int dev, float *x, float *y, float *z, float *d, int *elapsedptr) {
     int ret = 0;
-    um_positions *positions;
+    um_positions snapshot, *positions = &snapshot;
     unsigned long long elapsed;
 
     if (!hndl) {
@@ -1875,7 +4684,7 @@ int um_get_speeds(um_state *hndl, const int dev, float *x, float *y, float *z, f
     }
 
     int dev_id = um_resolve_dev_id (dev);
-    positions = &hndl->last_positions[dev_id];
+    um_positions_read (hndl, dev_id, positions);
     elapsed = get_elapsed (positions->updated_us / 1000LL);
 
     if (x) {
@@ -1903,6 +4712,7 @@ int um_get_speeds(um_state *hndl, const int dev, float *x, float *y, float *z, f
 
 int um_read_positions(um_state *hndl, const int dev, const int time_limit) {
     int resp[4], ret = 0;
+    unsigned long long resp_us;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
@@ -1910,21 +4720,22 @@ int um_read_positions(um_state *hndl, const int dev, const int time_limit) {
         return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
     int dev_id = um_resolve_dev_id (dev);
-    um_positions *positions = &hndl->last_positions[dev_id];
+    um_positions snapshot, *positions = &snapshot;
+    um_positions_read (hndl, dev_id, positions);
     unsigned long long elapsed = get_elapsed (positions->updated_us / 1000LL);
     // Use values from the cache if new enough
     if ((elapsed < (unsigned long) time_limit || time_limit == LIBUM_TIMELIMIT_CACHE_ONLY) &&
         time_limit != LIBUM_TIMELIMIT_DISABLED) {
-        if (hndl->last_positions[dev_id].x != SMCP1_ARG_UNDEF) {
+        if (positions->x != SMCP1_ARG_UNDEF) {
             ret++;
         }
-        if (hndl->last_positions[dev_id].y != SMCP1_ARG_UNDEF) {
+        if (positions->y != SMCP1_ARG_UNDEF) {
             ret++;
         }
-        if (hndl->last_positions[dev_id].z != SMCP1_ARG_UNDEF) {
+        if (positions->z != SMCP1_ARG_UNDEF) {
             ret++;
         }
-        if (hndl->last_positions[dev_id].d != SMCP1_ARG_UNDEF) {
+        if (positions->d != SMCP1_ARG_UNDEF) {
             ret++;
         }
         if (ret > 0) {
@@ -1933,29 +4744,27 @@ int um_read_positions(um_state *hndl, const int dev, const int time_limit) {
     }
 
     // Request positions from the manipulator
-    memset(resp, 0, sizeof (resp));
-    if ((ret = um_send_msg (hndl, dev, SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4, resp)) > 0) {
-        positions->x = resp[0];
-        if (ret > 1) {
-            positions->y = resp[1];
-        }
-        if (ret > 2) {
-            positions->z = resp[2];
-        }
-        if (ret > 3) {
-            positions->d = resp[3];
-        }
+    memset(resp, 0, sizeof (resp));
+    if ((ret = um_request_submit (hndl, dev, SMCP1_GET_POSITIONS, 0, NULL, 0, NULL, 4)) < 0 ||
+        (ret = um_request_result (hndl, ret, 4, resp, &resp_us)) <= 0) {
+        // A failed read must not add a stale sample to the position history
+        return ret;
     }
-    positions->updated_us = um_get_timestamp_us ();
+    um_store_positions (hndl, dev_id, resp, ret, resp_us, NULL);
     return ret;
 }
 
 
+static int um_compare_ids(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
 int um_get_device_list(um_state *hndl, int *devs, const int size) {
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
-    int i, ret, found = 0;
+    int i, ret, highest, found = 0;
+    um_device *device;
 
     um_cmd_options (hndl, SMCP1_OPT_REQ_ACK);
     if ((ret = um_ping (hndl, SMCP1_ALL_DEVICES)) < 0 && ret != LIBUM_INVALID_DEV && ret != LIBUM_TIMEOUT) {
@@ -1966,23 +4775,39 @@ int um_get_device_list(um_state *hndl, int *devs, const int size) {
         return ret;
     }
 
-    for (i = 0; i < LIBUM_MAX_DEVS; i++) {
+    for (device = hndl->devices->active; device; device = device->active_next) {
+        int dev = device->dev_id;
         // Do not include TSC and PC/SDK into device list.
-        if (i >= SMCP1_ALL_DEVICES && i <= SMCP1_UMP_DEV_ID_OFFSET) {
+        if (dev >= SMCP1_ALL_DEVICES && dev <= SMCP1_UMP_DEV_ID_OFFSET) {
             continue;
         }
-        if (hndl->addresses[i].sin_family != 0) {
-            if (devs) {
-                int sno = 0;
-                if (um_resolve_sno (i, &sno)) {
-                    devs[found] = sno;
-                } else {
-                    devs[found] = i;
+        if (DEV_ADDRESS(hndl, dev).sin_family == 0) {
+            continue;
+        }
+        if (!devs) {
+            if (++found >= size) {
+                break;
+            }
+        } else if (found < size) {
+            devs[found++] = dev;
+        } else {
+            // The active list is in the discovery order, keep the lowest ids when there are more devices
+            for (highest = 0, i = 1; i < found; i++) {
+                if (devs[i] > devs[highest]) {
+                    highest = i;
                 }
             }
-            found++;
-            if (found >= size) {
-                break;
+            if (dev < devs[highest]) {
+                devs[highest] = dev;
+            }
+        }
+    }
+    if (devs) {
+        qsort (devs, found, sizeof (int), um_compare_ids);
+        for (i = 0; i < found; i++) {
+            int sno = 0;
+            if (um_resolve_sno (devs[i], &sno)) {
+                devs[i] = sno;
             }
         }
     }
@@ -1990,24 +4815,218 @@ int um_get_device_list(um_state *hndl, int *devs, const int size) {
 }
 
 int um_clear_device_list(um_state *hndl) {
-    int i, found = 0;
+    int found = 0;
+    um_device *device, *next;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
-    for (i = 0; i < LIBUM_MAX_DEVS; i++) {
-        if (hndl->addresses[i].sin_family != 0) {
-            hndl->addresses[i].sin_family = 0;
+    um_state_lock (hndl);
+    for (device = hndl->devices->active; device; device = next) {
+        next = device->active_next;
+        if (DEV_ADDRESS(hndl, device->dev_id).sin_family != 0) {
+            DEV_ADDRESS(hndl, device->dev_id).sin_family = 0;
             found++;
         }
+        um_device_info_clear (hndl, device->dev_id);
+        um_device_deactivate (hndl, device);
     }
+    um_state_unlock (hndl);
     return found;
 }
 
+// uMa register shadow of a device, NULL if not enabled. Accessed with the state lock held
+static um_uma_shadow *um_uma_shadow_get(um_state *hndl, const int dev) {
+    int dev_id;
+    if (is_invalid_dev (dev) || um_is_group_id (dev_id = um_resolve_dev_id (dev))) {
+        return NULL;
+    }
+    return um_device_get (hndl, dev_id)->uma_shadow;
+}
+
+// Send the registers written since the latest flush in the background, if any
+static void um_uma_shadow_flush(um_state *hndl, const int dev_id, um_uma_shadow *shadow) {
+    int count, ticket;
+
+    if (!shadow->dirty || shadow->ticket) {
+        return;
+    }
+    // The registers are written from the first one, up to the last one written
+    for (count = UMA_REG_COUNT; !(shadow->dirty & (1U << (count - 1))); count--);
+    if ((ticket = um_request_submit (hndl, dev_id, SMCP1_SET_UMA_REGS, count, shadow->regs, 0, NULL, 0)) < 0) {
+        shadow->result = ticket;
+        return;
+    }
+    // The lock is held, the ACK cannot have been processed yet
+    um_request_get (hndl, ticket)->flags |= UM_REQUEST_DETACHED;
+    shadow->sending = shadow->dirty;
+    shadow->dirty = 0;
+    shadow->ticket = ticket;
+    shadow->flushed_ms = um_clock_ms ();
+}
+
+// Flush the uMa register shadows whose flush interval has passed, retransmit the flushes in flight
+static void um_uma_shadow_service(um_state *hndl) {
+    int i;
+    bool in_flight = false;
+    um_uma_shadow *shadow;
+
+    if (!hndl->devices->uma_shadows) {
+        return;
+    }
+    um_state_lock (hndl);
+    for (i = 0; i < hndl->devices->count; i++) {
+        if (!(shadow = hndl->devices->entries[i]->uma_shadow)) {
+            continue;
+        }
+        if (shadow->dirty && get_elapsed (shadow->flushed_ms) >= (unsigned long long) shadow->interval_ms) {
+            um_uma_shadow_flush (hndl, hndl->devices->entries[i]->dev_id, shadow);
+        }
+        in_flight |= shadow->ticket != 0;
+    }
+    if (in_flight) {
+        um_request_service (hndl, um_clock_us ());
+    }
+    um_state_unlock (hndl);
+}
+
+// Write registers to the shadow, returns false if there is no shadow
+static bool um_uma_shadow_write(um_state *hndl, const int dev, const int first, const int count, const int *values) {
+    int i;
+    um_uma_shadow *shadow;
+
+    um_state_lock (hndl);
+    if (!(shadow = um_uma_shadow_get (hndl, dev))) {
+        um_state_unlock (hndl);
+        return false;
+    }
+    for (i = 0; i < count; i++) {
+        shadow->regs[first + i] = values[i];
+        shadow->dirty |= 1U << (first + i);
+    }
+    // Sent right away unless flushed recently, otherwise by the next service round
+    if (get_elapsed (shadow->flushed_ms) >= (unsigned long long) shadow->interval_ms) {
+        um_uma_shadow_flush (hndl, um_resolve_dev_id (dev), shadow);
+    }
+    um_state_unlock (hndl);
+    return true;
+}
+
+// Read registers from the shadow, returns false if there is no shadow
+static bool um_uma_shadow_read(um_state *hndl, const int dev, const int first, const int count, int *values) {
+    um_uma_shadow *shadow;
+
+    um_state_lock (hndl);
+    if (!(shadow = um_uma_shadow_get (hndl, dev))) {
+        um_state_unlock (hndl);
+        return false;
+    }
+    memcpy(values, shadow->regs + first, count * sizeof (int));
+    um_state_unlock (hndl);
+    return true;
+}
+
+int um_set_uma_shadow(um_state *hndl, const int dev, const int interval_ms) {
+    int ret, regs[UMA_REG_COUNT];
+    um_device *device;
+    um_uma_shadow *shadow;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev) || um_is_group_id (um_resolve_dev_id (dev))) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (interval_ms > LIBUM_MAX_TIMEOUT) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if (interval_ms < 0) {
+        // The pending writes are sent before forgetting the shadow
+        if ((ret = um_flush_uma_regs (hndl, dev)) < 0 && ret != LIBUM_INVALID_ARG) {
+            return ret;
+        }
+        um_state_lock (hndl);
+        device = um_device_get (hndl, um_resolve_dev_id (dev));
+        if ((shadow = device->uma_shadow)) {
+            device->uma_shadow = NULL;
+            hndl->devices->uma_shadows--;
+            free (shadow);
+        }
+        um_state_unlock (hndl);
+        return 0;
+    }
+    um_state_lock (hndl);
+    if ((shadow = um_uma_shadow_get (hndl, dev))) {
+        shadow->interval_ms = interval_ms;
+        um_state_unlock (hndl);
+        return 0;
+    }
+    um_state_unlock (hndl);
+
+    // Populated from the device
+    if ((ret = um_send_msg (hndl, dev, SMCP1_GET_UMA_REGS, 0, NULL, 0, NULL, UMA_REG_COUNT, regs)) < 0) {
+        return ret;
+    }
+    if (ret != UMA_REG_COUNT) {
+        return set_last_error (hndl, LIBUM_INVALID_RESP);
+    }
+    if (!(shadow = calloc (1, sizeof (um_uma_shadow)))) {
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    memcpy(shadow->regs, regs, sizeof (regs));
+    shadow->interval_ms = interval_ms;
+    um_state_lock (hndl);
+    device = um_device_get (hndl, um_resolve_dev_id (dev));
+    if (device->uma_shadow) {
+        free (shadow);
+    } else {
+        device->uma_shadow = shadow;
+        hndl->devices->uma_shadows++;
+    }
+    um_state_unlock (hndl);
+    return 0;
+}
+
+int um_flush_uma_regs(um_state *hndl, const int dev) {
+    int ticket, ret;
+    um_uma_shadow *shadow;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    for (;;) {
+        um_state_lock (hndl);
+        if (!(shadow = um_uma_shadow_get (hndl, dev))) {
+            um_state_unlock (hndl);
+            return set_last_error (hndl, LIBUM_INVALID_ARG);
+        }
+        // Reported once
+        if ((ret = shadow->result) < 0) {
+            shadow->result = 0;
+            um_state_unlock (hndl);
+            return set_last_error (hndl, ret);
+        }
+        if (!shadow->dirty && !shadow->ticket) {
+            um_state_unlock (hndl);
+            return 0;
+        }
+        um_uma_shadow_flush (hndl, um_resolve_dev_id (dev), shadow);
+        ticket = shadow->ticket;
+        um_state_unlock (hndl);
+        // Until the flush is done, a detached request is released when done
+        if (ticket) {
+            um_request_wait (hndl, &ticket, 1, -1, false);
+        }
+    }
+}
+
 int um_set_uma_reg(um_state *hndl, const int dev, const uMaRegistry addr, const int value) {
     int args[2];
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
+    if (addr < UMA_REG_COUNT && um_uma_shadow_write (hndl, dev, addr, 1, &value)) {
+        return 0;
+    }
     args[0] = addr;
     args[1] = value;
     return um_cmd (hndl, dev, SMCP1_SET_UMA_REG, 2, args);
@@ -2018,6 +5037,9 @@ int um_get_uma_reg(um_state *hndl, const int dev, const uMaRegistry addr, int *v
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
+    if (addr < UMA_REG_COUNT && um_uma_shadow_read (hndl, dev, addr, 1, value)) {
+        return 1;
+    }
     args[0] = addr;
     ret = um_send_msg (hndl, dev, SMCP1_GET_UMA_REG, 1, args, 0, NULL, 2, resp);
     if (ret < 0) {
@@ -2037,6 +5059,9 @@ int um_set_uma_regs(um_state *hndl, const int dev, const int count, const uMaReg
     if (count < 1 || count > UMA_REG_COUNT) {
         return set_last_error (hndl, LIBUM_INVALID_ARG);
     }
+    if (um_uma_shadow_write (hndl, dev, 0, count, (const int *) values)) {
+        return 0;
+    }
     return um_cmd (hndl, dev, SMCP1_SET_UMA_REGS, count, (int *)values);
 }
 
@@ -2047,12 +5072,38 @@ int um_get_uma_regs(um_state *hndl, const int dev, const int count, int *values)
     if (count < 1 || count > UMA_REG_COUNT) {
         return set_last_error (hndl, LIBUM_INVALID_ARG);
     }
+    if (um_uma_shadow_read (hndl, dev, 0, count, values)) {
+        return count;
+    }
     return um_send_msg (hndl, dev, SMCP1_GET_UMA_REGS, 0, NULL, 0, NULL, count, values);
 }
 
+// Drop the cached values of a uMc channel changed by a command, all channels if chn is negative
+static void um_pressure_invalidate(um_state *hndl, const int dev, const int chn, const bool valve) {
+    int i;
+    um_device *device;
+
+    if (is_invalid_dev (dev) || um_is_group_id (um_resolve_dev_id (dev))) {
+        return;
+    }
+    um_state_lock (hndl);
+    device = um_device_get (hndl, um_resolve_dev_id (dev));
+    for (i = 0; i < 8; i++) {
+        if (chn >= 0 && i != chn) {
+            continue;
+        }
+        if (valve) {
+            device->valve_ts[i] = 0;
+        } else {
+            device->pressure_ts[i] = 0;
+        }
+    }
+    um_state_unlock (hndl);
+}
+
 // uMv specific commands
 int umc_set_pressure_setting(um_state *hndl, const int dev, const int channel, const float pressure_kpa) {
-    int args[2];
+    int ret, args[2];
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
@@ -2062,7 +5113,10 @@ int umc_set_pressure_setting(um_state *hndl, const int dev, const int channel, c
     }
     args[0] = channel - 1;
     args[1] = (int) (pressure_kpa * 1000.0);
-    return um_cmd (hndl, dev, SMCP1_UMV_SET_PRESSURE, 2, args);
+    ret = um_cmd (hndl, dev, SMCP1_UMV_SET_PRESSURE, 2, args);
+    // The measured pressure follows the new setting, also if the command got through without an ACK
+    um_pressure_invalidate (hndl, dev, args[0], false);
+    return ret;
 }
 
 int umc_get_pressure_setting(um_state *hndl, const int dev, const int channel, float *pressure_kpa) {
@@ -2083,20 +5137,82 @@ int umc_get_pressure_setting(um_state *hndl, const int dev, const int channel, f
     return abs (resp[1]);
 }
 
+// Cached uMc channel value, the pressure in Pa or the valve state. Returns false if not cached or too old
+static bool um_pressure_cached(um_state *hndl, const int dev, const int chn, const int time_limit, const bool valve,
+                               int *value, int *elapsedptr) {
+    bool found = false;
+    int dev_id = um_resolve_dev_id (dev);
+    unsigned long long ts, elapsed;
+    const um_device *device;
+
+    if (time_limit == LIBUM_TIMELIMIT_DISABLED || um_is_group_id (dev_id)) {
+        return false;
+    }
+    um_state_lock (hndl);
+    device = um_device_find (hndl, dev_id);
+    ts = valve ? device->valve_ts[chn] : device->pressure_ts[chn];
+    elapsed = get_elapsed (ts);
+    if (ts && (time_limit == LIBUM_TIMELIMIT_CACHE_ONLY || elapsed < (unsigned long) time_limit)) {
+        *value = valve ? (device->valves >> chn) & 1 : device->pressures[chn];
+        if (elapsedptr) {
+            *elapsedptr = (int) elapsed;
+        }
+        found = true;
+    }
+    um_state_unlock (hndl);
+    return found;
+}
+
+// Update the cache of a single uMc channel value read from the device
+static void um_pressure_store(um_state *hndl, const int dev, const int chn, const bool valve, const int value) {
+    int dev_id = um_resolve_dev_id (dev);
+    um_device *device;
+
+    if (um_is_group_id (dev_id)) {
+        return;
+    }
+    um_state_lock (hndl);
+    device = um_device_get (hndl, dev_id);
+    if (valve) {
+        device->valves = (device->valves & ~(1 << chn)) | (value ? 1 << chn : 0);
+        device->valve_ts[chn] = um_clock_ms ();
+    } else {
+        device->pressures[chn] = value;
+        device->pressure_ts[chn] = um_clock_ms ();
+    }
+    um_state_unlock (hndl);
+}
+
 int umc_measure_pressure(um_state *hndl, const int dev, const int channel, float *pressure_kpa) {
+    return umc_measure_pressure_ext (hndl, dev, channel, LIBUM_TIMELIMIT_DISABLED, pressure_kpa, NULL);
+}
+
+int umc_measure_pressure_ext(um_state *hndl, const int dev, const int channel, const int time_limit,
+                             float *pressure_kpa, int *elapsedptr) {
     int ret, resp[2], chn = channel - 1;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
     if (channel < 1 || channel > 8) {
         return set_last_error (hndl, LIBUM_INVALID_ARG);
     }
+    if (um_pressure_cached (hndl, dev, chn, time_limit, false, &resp[1], elapsedptr)) {
+        *pressure_kpa = (float) resp[1] / 1000.0f;
+        return abs (resp[1]);
+    }
     if ((ret = um_send_msg (hndl, dev, SMCP1_UMV_MEASURE_PRESSURE, 1, &chn, 0, NULL, 2, resp)) < 0) {
         return ret;
     }
     if (resp[0] != chn || ret != 2) {
         return set_last_error (hndl, LIBUM_INVALID_RESP);
     }
+    um_pressure_store (hndl, dev, chn, false, resp[1]);
+    if (elapsedptr) {
+        *elapsedptr = 0;
+    }
     *pressure_kpa = (float) resp[1] / 1000.0f;
     return abs (resp[1]);
 }
@@ -2119,7 +5235,7 @@ int umc_get_pressure_monitor_adc(um_state *hndl, const int dev, const int channe
 }
 
 int umc_set_valve(um_state *hndl, const int dev, const int channel, const int value) {
-    int args[2];
+    int ret, args[2];
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
@@ -2128,28 +5244,143 @@ int umc_set_valve(um_state *hndl, const int dev, const int channel, const int va
     }
     args[0] = channel - 1;
     args[1] = value;
-    return um_cmd (hndl, dev, SMCP1_UMV_SET_VALVE, 2, args);
+    if ((ret = um_cmd (hndl, dev, SMCP1_UMV_SET_VALVE, 2, args)) < 0) {
+        // The command may have got through without an ACK
+        um_pressure_invalidate (hndl, dev, args[0], true);
+        return ret;
+    }
+    um_pressure_store (hndl, dev, args[0], true, value);
+    return ret;
 }
 
 int umc_get_valve(um_state *hndl, const int dev, const int channel) {
+    return umc_get_valve_ext (hndl, dev, channel, LIBUM_TIMELIMIT_DISABLED, NULL);
+}
+
+int umc_get_valve_ext(um_state *hndl, const int dev, const int channel, const int time_limit, int *elapsedptr) {
     int ret, resp[2], chn = channel - 1;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
-
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
     if (channel < 1 || channel > 8) {
         return set_last_error (hndl, LIBUM_INVALID_ARG);
     }
-
+    if (um_pressure_cached (hndl, dev, chn, time_limit, true, &resp[1], elapsedptr)) {
+        return resp[1];
+    }
     if ((ret = um_send_msg (hndl, dev, SMCP1_UMV_GET_VALVE, 1, &chn, 0, NULL, 2, resp)) < 0) {
         return ret;
     }
     if (resp[0] != chn || ret != 2) {
         return set_last_error (hndl, LIBUM_INVALID_RESP);
     }
+    um_pressure_store (hndl, dev, chn, true, resp[1]);
+    if (elapsedptr) {
+        *elapsedptr = 0;
+    }
     return resp[1];
 }
 
+int umc_record_pressure(um_state *hndl, const int dev, const int channel, const int count, const int delay_ms,
+                        float *values) {
+    int i, n, ret, ticket, args[3], resp[UM_RECORD_CHUNK_SAMPLES + 1], recorded = 0;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    // The samples come in a response, not sent by a group
+    if (is_invalid_dev (dev) || um_is_group_id (um_resolve_dev_id (dev))) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (channel < 1 || channel > 8 || count < 1 || delay_ms < 0 || delay_ms > 10000 || !values) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    // Recorded in parts fitting in a response, each requested when the previous one arrived
+    while (recorded < count) {
+        n = count - recorded < UM_RECORD_CHUNK_SAMPLES ? count - recorded : UM_RECORD_CHUNK_SAMPLES;
+        args[0] = channel - 1;
+        args[1] = n;
+        args[2] = delay_ms;
+        // The device replies after sampling, the ACK deadline is extended by the sampling time
+        if ((ticket = um_request_submit_process (hndl, dev, SMCP1_UMV_RECORD_SEQUENCE, 3, args, 0, NULL, n + 1,
+                                                 (unsigned long long) n * delay_ms * 1000ULL)) < 0) {
+            return ticket;
+        }
+        if ((ret = um_async_result (hndl, ticket, n + 1, resp)) < 0) {
+            return ret;
+        }
+        if (ret < 1 || resp[0] != channel - 1) {
+            return set_last_error (hndl, LIBUM_INVALID_RESP);
+        }
+        for (i = 1; i < ret && i <= n; i++) {
+            values[recorded++] = (float) resp[i] / 1000.0f;
+        }
+        // Fewer samples than requested, e.g. not supported by the firmware
+        if (ret - 1 < n) {
+            break;
+        }
+    }
+    return recorded;
+}
+
+int umc_read_all_channels(um_state *hndl, const int dev, umc_channels *channels) {
+    static const int cmds[3] = {SMCP1_UMV_MEASURE_PRESSURE, SMCP1_UMV_GET_PRESSURE, SMCP1_UMV_GET_VALVE};
+    int i, ret, chn, resp[2], tickets[24], count = 0, error = LIBUM_INVALID_RESP;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    // The values come in responses, not sent by a group
+    if (is_invalid_dev (dev) || um_is_group_id (um_resolve_dev_id (dev))) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (!channels) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    memset(channels, 0, sizeof (umc_channels));
+
+    // All requests in flight at once
+    for (i = 0; i < 24; i++) {
+        chn = i % 8;
+        if ((tickets[i] = um_request_submit (hndl, dev, cmds[i / 8], 1, &chn, 0, NULL, 2)) < 0) {
+            ret = tickets[i];
+            while (i--) {
+                um_async_cancel (hndl, tickets[i]);
+            }
+            return ret;
+        }
+    }
+    // Responses are matched to the requests by the message id, whatever the arrival order
+    for (i = 0; i < 24; i++) {
+        chn = i % 8;
+        if ((ret = um_async_result (hndl, tickets[i], 2, resp)) != 2 || resp[0] != chn) {
+            error = ret < 0 ? ret : LIBUM_INVALID_RESP;
+            continue;
+        }
+        switch (cmds[i / 8]) {
+            case SMCP1_UMV_MEASURE_PRESSURE:
+                um_pressure_store (hndl, dev, chn, false, resp[1]);
+                channels->pressure_kpa[chn] = (float) resp[1] / 1000.0f;
+                channels->pressure_valid |= 1 << chn;
+                break;
+            case SMCP1_UMV_GET_PRESSURE:
+                channels->setting_kpa[chn] = (float) resp[1] / 1000.0f;
+                channels->setting_valid |= 1 << chn;
+                break;
+            default:
+                um_pressure_store (hndl, dev, chn, true, resp[1]);
+                channels->valves |= resp[1] ? 1 << chn : 0;
+                channels->valve_valid |= 1 << chn;
+                break;
+        }
+        count++;
+    }
+    return count > 0 ? count : set_last_error (hndl, error);
+}
+
 int umc_reset_fluid_detector(um_state *hndl, const int dev, const int channel) {
     int arg;
     if (!hndl) {
@@ -2174,7 +5405,7 @@ int umc_read_fluid_detectors(um_state *hndl, const int dev) {
 }
 
 int umc_reset_sensor_offset(um_state *hndl, const int dev, const int channel) {
-    int arg;
+    int ret, arg;
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
@@ -2184,13 +5415,17 @@ int umc_reset_sensor_offset(um_state *hndl, const int dev, const int channel) {
     }
     arg = channel - 1;
     if (channel > 0) {
-        return um_cmd (hndl, dev, SMCP1_UMV_RESET_SENSOR_OFFSET, 1, &arg);
+        ret = um_cmd (hndl, dev, SMCP1_UMV_RESET_SENSOR_OFFSET, 1, &arg);
+    } else {
+        ret = um_cmd (hndl, dev, SMCP1_UMV_RESET_SENSOR_OFFSET, 0, NULL);
     }
-    return um_cmd (hndl, dev, SMCP1_UMV_RESET_SENSOR_OFFSET, 0, NULL);
+    // The measured pressures change with the offset
+    um_pressure_invalidate (hndl, dev, arg, false);
+    return ret;
 }
 
 int umc_pressure_calib(um_state *hndl, const int dev, const int channel, const int delay) {
-    int args[2];
+    int ret, args[2];
     if (!hndl) {
         return set_last_error (hndl, LIBUM_NOT_OPEN);
     }
@@ -2204,9 +5439,162 @@ int umc_pressure_calib(um_state *hndl, const int dev, const int channel, const i
     args[0] = channel - 1;
     args[1] = delay;
     if (channel > 0) {
-        return um_cmd (hndl, dev, SMCP1_UMV_PRESSURE_CALIB, delay > 0 ? 2 : 1, args);
+        ret = um_cmd (hndl, dev, SMCP1_UMV_PRESSURE_CALIB, delay > 0 ? 2 : 1, args);
+    } else {
+        ret = um_cmd (hndl, dev, SMCP1_UMV_PRESSURE_CALIB, 0, NULL);
+    }
+    // The measured pressures change with the calibration
+    um_pressure_invalidate (hndl, dev, args[0], false);
+    return ret;
+}
+
+// Send the next part of a sequence, returns a ticket. Called with the state lock held
+static int um_sequence_send(um_state *hndl, const int dev_id, const int chn, um_sequence *sequence) {
+    int ticket, count = sequence->count - sequence->sent;
+
+    if (count > UM_SEQUENCE_PART_STEPS) {
+        count = UM_SEQUENCE_PART_STEPS;
+    }
+    if ((ticket = um_request_submit (hndl, dev_id, SMCP1_UMV_START_SEQUENCE, 1, &chn, count,
+                                     sequence->steps + sequence->sent, 0)) < 0) {
+        return ticket;
+    }
+    sequence->sent += count;
+    sequence->ticket = ticket;
+    sequence->busy_seen = false;
+    return ticket;
+}
+
+// Continue or complete the sequences of a device on a status change
+static void um_sequence_status(um_state *hndl, const int dev_id, const int status) {
+    int chn, ticket;
+    um_sequence *sequence;
+    um_device *device = um_device_get (hndl, dev_id);
+
+    um_state_lock (hndl);
+    for (chn = 0; chn < 8; chn++) {
+        if (!(sequence = device->sequences[chn]) || sequence->result < 0) {
+            continue;
+        }
+        if (status & (LIBUM_STATUS_UMC_CHN1_BUSY << chn)) {
+            sequence->busy_seen = true;
+            continue;
+        }
+        // The latest part not started yet
+        if (!sequence->busy_seen) {
+            continue;
+        }
+        if (sequence->sent == sequence->count) {
+            free (sequence);
+            device->sequences[chn] = NULL;
+            continue;
+        }
+        um_log_print (hndl, 2, __PRETTY_FUNCTION__, "dev %d channel %d sequence continued from step %d", dev_id,
+                      chn + 1, sequence->sent);
+        if ((ticket = um_sequence_send (hndl, dev_id, chn, sequence)) < 0) {
+            sequence->result = ticket;
+            continue;
+        }
+        // The lock is held, the ACK cannot have been processed yet
+        um_request_get (hndl, ticket)->flags |= UM_REQUEST_DETACHED;
+    }
+    um_state_unlock (hndl);
+}
+
+int umc_start_sequence(um_state *hndl, const int dev, const int channel, const umc_sequence_step *steps,
+                       const int count) {
+    int i, ret, value, chn = channel - 1;
+    um_sequence *sequence;
+    um_device *device;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    int dev_id = um_resolve_dev_id (dev);
+    // The parts are continued per device
+    if (um_is_group_id (dev_id)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (channel < 1 || channel > 8 || !steps || count < 1 || count > INT_MAX / (int) sizeof (int32_t)) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    if (!(sequence = malloc (sizeof (um_sequence) + count * sizeof (int32_t)))) {
+        return set_last_error (hndl, LIBUM_OS_ERROR);
+    }
+    // Period in ms in the upper half, pressure in 4 Pa units above the valve bit in the lower half
+    for (i = 0; i < count; i++) {
+        // Also rejects NaN
+        if (steps[i].period_ms < 1 || steps[i].period_ms > 0xffff || steps[i].valve < 0 || steps[i].valve > 1 ||
+            !(steps[i].pressure_kpa >= -65.536f && steps[i].pressure_kpa <= 65.532f)) {
+            free (sequence);
+            return set_last_error (hndl, LIBUM_INVALID_ARG);
+        }
+        value = (int) (steps[i].pressure_kpa * 250.0f + (steps[i].pressure_kpa < 0.0f ? -0.5f : 0.5f));
+        sequence->steps[i] = (int32_t) (((uint32_t) steps[i].period_ms << 16) | (((uint32_t) value << 1) & 0xfffe) |
+                                        (uint32_t) steps[i].valve);
+    }
+    sequence->count = count;
+    sequence->sent = 0;
+    sequence->result = 0;
+
+    // Registered before sending, the status notifications may arrive while waiting for the ACK
+    um_state_lock (hndl);
+    device = um_device_get (hndl, dev_id);
+    free (device->sequences[chn]);
+    device->sequences[chn] = sequence;
+    ret = um_sequence_send (hndl, dev_id, chn, sequence);
+    um_state_unlock (hndl);
+    if (ret >= 0) {
+        ret = um_async_result (hndl, ret, 0, NULL);
+    }
+    um_state_lock (hndl);
+    // Unless replaced meanwhile
+    if (device->sequences[chn] == sequence) {
+        sequence->ticket = 0;
+        if (ret < 0) {
+            free (sequence);
+            device->sequences[chn] = NULL;
+        }
+    }
+    um_state_unlock (hndl);
+    return ret < 0 ? ret : 0;
+}
+
+int umc_is_sequence_running(um_state *hndl, const int dev, const int channel) {
+    int ret, chn = channel - 1;
+    um_device *device;
+
+    if (!hndl) {
+        return set_last_error (hndl, LIBUM_NOT_OPEN);
+    }
+    if (is_invalid_dev (dev)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
+    }
+    if (channel < 1 || channel > 8) {
+        return set_last_error (hndl, LIBUM_INVALID_ARG);
+    }
+    int dev_id = um_resolve_dev_id (dev);
+    if (um_is_group_id (dev_id)) {
+        return set_last_error (hndl, LIBUM_INVALID_DEV);
     }
-    return um_cmd (hndl, dev, SMCP1_UMV_PRESSURE_CALIB, 0, NULL);
+    // Without the receiver thread apply the status notifications already arrived
+    if (!hndl->receiver) {
+        um_recv_drain (hndl, 0);
+    }
+    um_state_lock (hndl);
+    device = um_device_get (hndl, dev_id);
+    ret = device->sequences[chn] != NULL;
+    // Reported once
+    if (ret && device->sequences[chn]->result < 0) {
+        ret = device->sequences[chn]->result;
+        free (device->sequences[chn]);
+        device->sequences[chn] = NULL;
+    }
+    um_state_unlock (hndl);
+    return ret < 0 ? set_last_error (hndl, ret) : ret;
 }
 
 // uMs specific commands
@@ -1,6 +1,8 @@
 #include <gtest/gtest.h>
 #include <libum.h>
 #include <time.h>
+#include <chrono>
+#include <thread>
 
 namespace {
     TEST(LibumTestBasicC, test_um_get_version) {
@@ -28,6 +30,16 @@ namespace {
         EXPECT_TRUE(result >= sys_epoch - tolerance_ms);
     }
 
+    TEST(LibumTestBasicC, test_um_get_timestamp_ns) {
+        unsigned long long first = um_get_timestamp_ns ();
+        unsigned long long second = um_get_timestamp_ns ();
+        EXPECT_NE(0ULL, first);
+        EXPECT_LE(first, second);
+        // Advances at least the time slept
+        std::this_thread::sleep_for (std::chrono::milliseconds(1));
+        EXPECT_GE(um_get_timestamp_ns () - second, 1000000ULL);
+    }
+
     TEST(LibumTestBasicC, test_um_errorstr) {
         for (int error_code = -10; error_code <= 0; error_code++) {
             const char *error_str = um_errorstr ((const um_error) error_code);
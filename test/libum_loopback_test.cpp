@@ -0,0 +1,1205 @@
+#include <gtest/gtest.h>
+#include <libum.h>
+#include <smcp1.h>
+
+#include <string.h>
+#include <poll.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace {
+
+#define FAKE_DEV_ID_1    5
+#define FAKE_DEV_ID_2    7
+
+    // A device emulator on the loopback interface, answers to the SDK requests
+    class FakeDevice {
+    public:
+        typedef std::function<void(FakeDevice &dev, const smcp1_frame &req, const int32_t *args,
+                                   const int argc, const IPADDR &from)> Handler;
+
+        FakeDevice() : mSocket(INVALID_SOCKET), mRunning(false) {}
+
+        ~FakeDevice() { stop(); }
+
+        bool open() {
+            IPADDR addr;
+            int yes = 1;
+            memset(&addr, 0, sizeof (addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(SMCP1_DEF_UDP_PORT);
+            addr.sin_addr.s_addr = inet_addr ("127.0.0.1");
+            if ((mSocket = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) {
+                return false;
+            }
+            setsockopt (mSocket, SOL_SOCKET, SO_REUSEADDR, SOCKOPT_CAST &yes, sizeof (yes));
+            return bind (mSocket, (struct sockaddr *) &addr, sizeof (addr)) == 0;
+        }
+
+        // Serve requests in a thread until stopped
+        void start(Handler handler) {
+            mHandler = handler;
+            mRunning = true;
+            mThread = std::thread ([this]() { serve (); });
+        }
+
+        void stop() {
+            mRunning = false;
+            if (mThread.joinable()) {
+                mThread.join ();
+            }
+            if (mSocket != INVALID_SOCKET) {
+                closesocket (mSocket);
+                mSocket = INVALID_SOCKET;
+            }
+        }
+
+        // Send a frame with an INT32 sub block from the given device
+        void send(const IPADDR &to, const int sender, const int receiver, const int type, const int message_id,
+                  const int options, const std::vector<int32_t> &data) {
+            um_message msg;
+            smcp1_frame *frame = (smcp1_frame *) msg;
+            smcp1_subblock_header *sub_block = (smcp1_subblock_header *) (msg + SMCP1_FRAME_SIZE);
+            int32_t *data_ptr = (int32_t *) (msg + SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE);
+            size_t size = SMCP1_FRAME_SIZE;
+
+            memset(frame, 0, SMCP1_FRAME_SIZE);
+            frame->version = SMCP1_VERSION;
+            frame->sender_id = htons(sender);
+            frame->receiver_id = htons(receiver);
+            frame->type = htons(type);
+            frame->message_id = htons(message_id);
+            frame->options = htonl(options);
+            if (!data.empty ()) {
+                frame->sub_blocks = htons(1);
+                sub_block->data_type = htons(SMCP1_DATA_INT32);
+                sub_block->data_size = htons(data.size ());
+                for (size_t i = 0; i < data.size (); i++) {
+                    data_ptr[i] = htonl(data[i]);
+                }
+                size += SMCP1_SUB_BLOCK_HEADER_SIZE + data.size () * sizeof (int32_t);
+            }
+            sendto (mSocket, (const char *) msg, size, 0, (const struct sockaddr *) &to, sizeof (to));
+        }
+
+        // ACK or respond to a request on behalf of the given device
+        void ack(const smcp1_frame &req, const IPADDR &to, const int sender) {
+            send (to, sender, ntohs(req.sender_id), ntohs(req.type), ntohs(req.message_id), SMCP1_OPT_ACK, {});
+        }
+
+        void respond(const smcp1_frame &req, const IPADDR &to, const int sender, const std::vector<int32_t> &data) {
+            send (to, sender, ntohs(req.sender_id), ntohs(req.type), ntohs(req.message_id), 0, data);
+        }
+
+        // Send a notification to the SDK handle
+        void notify(um_state *hndl, const int sender, const int type, const std::vector<int32_t> &data) {
+            send (handleAddress (hndl), sender, SMCP1_ALL_CUS_OR_PCS, type, ++mNotifyId, SMCP1_OPT_NOTIFY, data);
+        }
+
+        // Arguments in the second sub block of the request being handled
+        const std::vector<int32_t> &args2() const { return mArgs2; }
+
+        static IPADDR handleAddress(um_state *hndl) {
+            IPADDR addr;
+            socklen_t len = sizeof (addr);
+            getsockname (hndl->socket, (struct sockaddr *) &addr, &len);
+            addr.sin_addr.s_addr = inet_addr ("127.0.0.1");
+            return addr;
+        }
+
+    private:
+        void serve() {
+            while (mRunning) {
+                um_message msg;
+                IPADDR from;
+                socklen_t len = sizeof (from);
+                fd_set fds;
+                struct timeval tv = {0, 10000};
+                FD_ZERO(&fds);
+                FD_SET(mSocket, &fds);
+                if (select ((int) mSocket + 1, &fds, NULL, NULL, &tv) <= 0) {
+                    continue;
+                }
+                int ret = recvfrom (mSocket, (char *) msg, sizeof (msg), 0, (struct sockaddr *) &from, &len);
+                if (ret < (int) SMCP1_FRAME_SIZE) {
+                    continue;
+                }
+                const smcp1_frame *req = (const smcp1_frame *) msg;
+                const smcp1_subblock_header *sub_block = (const smcp1_subblock_header *) (msg + SMCP1_FRAME_SIZE);
+                const int32_t *data_ptr = (const int32_t *) (msg + SMCP1_FRAME_SIZE + SMCP1_SUB_BLOCK_HEADER_SIZE);
+                std::vector<int32_t> args;
+                mArgs2.clear ();
+                if (ntohs(req->sub_blocks) > 0) {
+                    for (int i = 0; i < ntohs(sub_block->data_size); i++) {
+                        args.push_back (ntohl(data_ptr[i]));
+                    }
+                }
+                if (ntohs(req->sub_blocks) > 1) {
+                    sub_block = (const smcp1_subblock_header *) (data_ptr + args.size ());
+                    data_ptr = (const int32_t *) (sub_block + 1);
+                    for (int i = 0; i < ntohs(sub_block->data_size); i++) {
+                        mArgs2.push_back (ntohl(data_ptr[i]));
+                    }
+                }
+                mHandler (*this, *req, args.data (), (int) args.size (), from);
+            }
+        }
+
+        SOCKET mSocket;
+        volatile bool mRunning;
+        std::thread mThread;
+        Handler mHandler;
+        std::vector<int32_t> mArgs2;
+        int mNotifyId = 0;
+    };
+
+    class LibumTestLoopbackC : public ::testing::Test {
+    protected:
+        void SetUp() override {
+            ASSERT_TRUE(mDevice.open ());
+            mHandle = um_open ("127.0.0.1", 100, 0);
+            ASSERT_NE(nullptr, mHandle);
+        }
+
+        void TearDown() override {
+            mDevice.stop ();
+            um_close (mHandle);
+        }
+
+        FakeDevice mDevice;
+        um_state *mHandle = nullptr;
+    };
+
+    TEST_F(LibumTestLoopbackC, test_um_get_device_list) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_CMD_PING && ntohl(req.options) & SMCP1_OPT_REQ_ACK) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.ack (req, from, FAKE_DEV_ID_2);
+            }
+        });
+        int devs[8];
+        EXPECT_EQ(2, um_get_device_list (mHandle, devs, 8));
+        EXPECT_EQ(FAKE_DEV_ID_1, devs[0]);
+        EXPECT_EQ(FAKE_DEV_ID_2, devs[1]);
+        // The lowest ids when truncated, not the latest discovered ones
+        EXPECT_EQ(1, um_get_device_list (mHandle, devs, 1));
+        EXPECT_EQ(FAKE_DEV_ID_1, devs[0]);
+        EXPECT_EQ(1, um_has_unicast_address (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(2, um_clear_device_list (mHandle));
+        EXPECT_EQ(0, um_clear_device_list (mHandle));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_start_receiver) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_PARAMETER && argc == 1) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {args[0], 4});
+            }
+        });
+        ASSERT_EQ(0, um_start_receiver (mHandle));
+        EXPECT_EQ(0, um_start_receiver (mHandle));
+        // The socket is owned by the receiver thread
+        um_message msg;
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_recv_ext (mHandle, &msg, NULL, NULL, 0));
+
+        // Notification updates the cache without polling
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {1000, 2000, 3000, 4000});
+        for (int i = 0; i < 100 && um_get_position (mHandle, FAKE_DEV_ID_1, 'x') == 0.0; i++) {
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        }
+        float x = 0.0, y = 0.0, z = 0.0, d = 0.0;
+        EXPECT_EQ(4, um_get_positions (mHandle, FAKE_DEV_ID_1, LIBUM_TIMELIMIT_CACHE_ONLY, &x, &y, &z, &d, NULL));
+        EXPECT_FLOAT_EQ(1.0, x);
+        EXPECT_FLOAT_EQ(2.0, y);
+        EXPECT_FLOAT_EQ(3.0, z);
+        EXPECT_FLOAT_EQ(4.0, d);
+
+        // Response routed to the requester
+        EXPECT_EQ(4, um_get_axis_count (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(0, um_stop_receiver (mHandle));
+        EXPECT_EQ(0, um_stop_receiver (mHandle));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_stop_receiver_while_waiting) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_CMD_PING) {
+                std::this_thread::sleep_for (std::chrono::milliseconds(50));
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        for (int i = 0; i < 5; i++) {
+            ASSERT_EQ(0, um_start_receiver (mHandle));
+            // The waiting thread keeps the lock and the condition, then reads the socket itself
+            std::atomic<int> ret(-1);
+            std::thread requester ([this, &ret]() { ret = um_ping (mHandle, FAKE_DEV_ID_1); });
+            std::this_thread::sleep_for (std::chrono::milliseconds(10));
+            EXPECT_EQ(0, um_stop_receiver (mHandle));
+            requester.join ();
+            EXPECT_EQ(0, ret.load ());
+        }
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_cmd_async) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            int receiver = ntohs(req.receiver_id);
+            if (ntohs(req.type) == SMCP1_GET_PARAMETER && argc == 1 &&
+                (receiver == FAKE_DEV_ID_1 || receiver == FAKE_DEV_ID_2)) {
+                dev.ack (req, from, receiver);
+                dev.respond (req, from, receiver, {args[0], receiver * 10});
+            }
+        });
+        int param = SMCP1_PARAM_AXIS_COUNT, resp[2];
+        int tickets[2];
+        tickets[0] = um_cmd_async (mHandle, FAKE_DEV_ID_1, SMCP1_GET_PARAMETER, 1, &param, 2);
+        tickets[1] = um_cmd_async (mHandle, FAKE_DEV_ID_2, SMCP1_GET_PARAMETER, 1, &param, 2);
+        ASSERT_GT(tickets[0], 0);
+        ASSERT_GT(tickets[1], 0);
+        EXPECT_NE(tickets[0], tickets[1]);
+        EXPECT_EQ(2, um_async_wait_all (mHandle, tickets, 2, 1000));
+
+        // Replies matched to the requests regardless of the arrival order
+        EXPECT_EQ(2, um_async_result (mHandle, tickets[1], 2, resp));
+        EXPECT_EQ(FAKE_DEV_ID_2 * 10, resp[1]);
+        EXPECT_EQ(2, um_async_result (mHandle, tickets[0], 2, resp));
+        EXPECT_EQ(FAKE_DEV_ID_1 * 10, resp[1]);
+
+        // Tickets are released by harvesting the result
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_async_result (mHandle, tickets[0], 2, resp));
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_async_cancel (mHandle, tickets[1]));
+
+        // No reply from an unknown device
+        tickets[0] = um_cmd_async (mHandle, 9, SMCP1_GET_PARAMETER, 1, &param, 2);
+        ASSERT_GT(tickets[0], 0);
+        EXPECT_EQ(LIBUM_TIMEOUT, um_async_wait_any (mHandle, tickets, 1, 20));
+        EXPECT_EQ(0, um_async_cancel (mHandle, tickets[0]));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_positions_multi) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            int receiver = ntohs(req.receiver_id);
+            if (ntohs(req.type) == SMCP1_GET_POSITIONS) {
+                dev.ack (req, from, receiver);
+                dev.respond (req, from, receiver, {receiver * 1000, receiver * 2000, receiver * 3000});
+            }
+        });
+        int devs[2] = {FAKE_DEV_ID_1, FAKE_DEV_ID_2};
+        um_positions positions[2];
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_get_positions_multi (mHandle, devs, 0, 0, positions));
+        EXPECT_EQ(0, um_get_positions_multi (mHandle, devs, 2, LIBUM_TIMELIMIT_CACHE_ONLY, positions));
+        EXPECT_EQ(2, um_get_positions_multi (mHandle, devs, 2, LIBUM_TIMELIMIT_DISABLED, positions));
+        for (int i = 0; i < 2; i++) {
+            EXPECT_EQ(devs[i] * 1000, positions[i].x);
+            EXPECT_EQ(devs[i] * 2000, positions[i].y);
+            EXPECT_EQ(devs[i] * 3000, positions[i].z);
+            EXPECT_NE(0ULL, positions[i].updated_us);
+        }
+        // Served from the cache
+        mDevice.stop ();
+        memset(positions, 0, sizeof (positions));
+        EXPECT_EQ(2, um_get_positions_multi (mHandle, devs, 2, 10000, positions));
+        EXPECT_EQ(FAKE_DEV_ID_2 * 3000, positions[1].z);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_rtt) {
+        static std::atomic<int> pings;
+        pings = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_CMD_PING && ntohs(req.receiver_id) == FAKE_DEV_ID_1) {
+                // The third one pauses the device for much longer than the round trip
+                if (++pings == 3) {
+                    std::this_thread::sleep_for (std::chrono::milliseconds(30));
+                }
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        int srtt = -1, rttvar = -1;
+        EXPECT_EQ(100000, um_get_rtt (mHandle, FAKE_DEV_ID_1, &srtt, &rttvar));
+        EXPECT_EQ(0, srtt);
+        EXPECT_EQ(0, um_ping (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(0, um_ping (mHandle, FAKE_DEV_ID_1));
+        int rto = um_get_rtt (mHandle, FAKE_DEV_ID_1, &srtt, &rttvar);
+        EXPECT_GT(srtt, 0);
+        EXPECT_GE(rto, 2000);
+        EXPECT_LT(rto, 100000);
+        // Retransmitted sooner, but not given up before the session timeout
+        EXPECT_EQ(0, um_ping (mHandle, FAKE_DEV_ID_1));
+        EXPECT_GT(pings, 3);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_receive_drain) {
+        // More notifications queued than fit in a single receive batch
+        for (int i = 1; i <= 40; i++) {
+            mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {i * 1000, 0, 0});
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds(20));
+        EXPECT_EQ(40, um_receive (mHandle, 0));
+        EXPECT_EQ(0, um_receive (mHandle, 0));
+        EXPECT_FLOAT_EQ(40.0, um_get_position (mHandle, FAKE_DEV_ID_1, 'x'));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_process_readable) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_PARAMETER && argc == 1) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {args[0], 4});
+            }
+        });
+        int fd = um_get_socket_fd (mHandle);
+        ASSERT_GE(fd, 0);
+        EXPECT_EQ(-1, um_next_deadline_ms (mHandle));
+
+        // An external event loop waiting for the socket
+        int param = SMCP1_PARAM_AXIS_COUNT, resp[2];
+        int ticket = um_cmd_async (mHandle, FAKE_DEV_ID_1, SMCP1_GET_PARAMETER, 1, &param, 2);
+        ASSERT_GT(ticket, 0);
+        int deadline = um_next_deadline_ms (mHandle);
+        EXPECT_GE(deadline, 0);
+        EXPECT_LE(deadline, 100);
+        int processed = 0;
+        for (int i = 0; i < 100 && processed < 2; i++) {
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll (&pfd, 1, 10) > 0) {
+                processed += um_process_readable (mHandle, 1);
+            }
+        }
+        EXPECT_EQ(2, processed);
+        EXPECT_EQ(-1, um_next_deadline_ms (mHandle));
+        EXPECT_EQ(2, um_async_result (mHandle, ticket, 2, resp));
+        EXPECT_EQ(4, resp[1]);
+    }
+
+    struct NotifyLog {
+        int count = 0;
+        int dev = 0;
+        int type = 0;
+        um_notify_positions positions;
+        um_notify_drive_completed drive;
+        int axis_count = 0;
+    };
+
+    void logNotify(um_state *, const int dev, const int type, const void *payload, void *arg) {
+        NotifyLog *log = (NotifyLog *) arg;
+        log->count++;
+        log->dev = dev;
+        log->type = type;
+        if (type == SMCP1_NOTIFY_POSITION_CHANGED) {
+            log->positions = *(const um_notify_positions *) payload;
+        }
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_set_notify_handler) {
+        NotifyLog log;
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_set_notify_handler (mHandle, SMCP1_CMD_PING, logNotify, &log));
+        EXPECT_EQ(0, um_set_notify_handler (mHandle, SMCP1_NOTIFY_POSITION_CHANGED, logNotify, &log));
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {1000, 2000, 3000});
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_STATUS_CHANGED, {1});
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(2, um_receive (mHandle, 0));
+        EXPECT_EQ(1, log.count);
+        EXPECT_EQ(FAKE_DEV_ID_1, log.dev);
+        EXPECT_EQ(SMCP1_NOTIFY_POSITION_CHANGED, log.type);
+        EXPECT_EQ(3, log.positions.axis_count);
+        EXPECT_EQ(2000, log.positions.positions.y);
+
+        // Unregistered
+        EXPECT_EQ(0, um_set_notify_handler (mHandle, SMCP1_NOTIFY_POSITION_CHANGED, NULL, NULL));
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {1000, 2000, 3000});
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(1, um_receive (mHandle, 0));
+        EXPECT_EQ(1, log.count);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_notify_handler_in_receiver) {
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_PARAMETER && argc == 1) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {args[0], 3});
+            }
+        });
+        NotifyLog log;
+        // A blocking request from the handler, called by the receiver thread
+        um_notify_func handler = [](um_state *hndl, const int dev, const int, const void *payload, void *arg) {
+            NotifyLog *log = (NotifyLog *) arg;
+            log->drive = *(const um_notify_drive_completed *) payload;
+            log->axis_count = um_get_axis_count (hndl, dev);
+            log->count++;
+        };
+        EXPECT_EQ(0, um_set_notify_handler (mHandle, SMCP1_NOTIFY_GOTO_POS_COMPLETED, handler, &log));
+        ASSERT_EQ(0, um_start_receiver (mHandle));
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_GOTO_POS_COMPLETED, {0});
+        for (int i = 0; i < 100 && !log.count; i++) {
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        }
+        EXPECT_EQ(0, um_stop_receiver (mHandle));
+        EXPECT_EQ(1, log.count);
+        EXPECT_EQ(0, log.drive.error_code);
+        EXPECT_EQ(LIBUM_POS_DRIVE_COMPLETED, log.drive.drive_status);
+        EXPECT_EQ(3, log.axis_count);
+    }
+
+    struct PositionLog {
+        um_state *hndl;
+        float x;
+    };
+
+    TEST_F(LibumTestLoopbackC, test_um_log_func_reads_positions) {
+        // The position update is logged on the thread writing the cache
+        PositionLog log = {mHandle, 0.0f};
+        um_log_print_func func = [](int, const void *arg, const char *, const char *) {
+            PositionLog *log = (PositionLog *) arg;
+            log->x = um_get_position (log->hndl, FAKE_DEV_ID_1, 'x');
+        };
+        EXPECT_EQ(0, um_set_log_func (mHandle, 2, func, &log));
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {1000, 2000, 3000});
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(1, um_receive (mHandle, 0));
+        EXPECT_FLOAT_EQ(1.0, log.x);
+        EXPECT_EQ(0, um_set_log_func (mHandle, 0, NULL, NULL));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_position_history) {
+        um_position_sample samples[8];
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_set_position_history (mHandle, -1));
+        EXPECT_EQ(0, um_set_position_history (mHandle, 4));
+        for (int i = 1; i <= 6; i++) {
+            mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {i * 1000, 0, 0});
+            std::this_thread::sleep_for (std::chrono::milliseconds(1));
+            um_receive (mHandle, 0);
+        }
+        // The latest ones kept, oldest first
+        ASSERT_EQ(4, um_get_position_history (mHandle, FAKE_DEV_ID_1, 0, samples, 8));
+        for (int i = 0; i < 4; i++) {
+            EXPECT_EQ((i + 3) * 1000, samples[i].x);
+        }
+        EXPECT_LT(samples[0].timestamp_us, samples[3].timestamp_us);
+        EXPECT_EQ(2, um_get_position_history (mHandle, FAKE_DEV_ID_1, samples[1].timestamp_us, samples, 8));
+        EXPECT_EQ(5000, samples[0].x);
+        EXPECT_EQ(1, um_get_position_history (mHandle, FAKE_DEV_ID_1, 0, samples, 1));
+        EXPECT_EQ(0, um_get_position_history (mHandle, FAKE_DEV_ID_2, 0, samples, 8));
+        // A failed read adds no sample
+        EXPECT_EQ(LIBUM_TIMEOUT, um_read_positions (mHandle, FAKE_DEV_ID_2, LIBUM_TIMELIMIT_DISABLED));
+        EXPECT_EQ(0, um_get_position_history (mHandle, FAKE_DEV_ID_2, 0, samples, 8));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_predict_position) {
+        float x = 0.0, speed = 0.0;
+        EXPECT_EQ(0, um_predict_position (mHandle, FAKE_DEV_ID_1, um_get_timestamp_ns () / 1000, &x, NULL, NULL, NULL));
+        // Moving 1 um per 5 ms on x axis
+        for (int i = 0; i < 30; i++) {
+            mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {i * 1000, 5000, 0});
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+            um_receive (mHandle, 0);
+        }
+        ASSERT_EQ(1, um_get_speeds (mHandle, FAKE_DEV_ID_1, &speed, NULL, NULL, NULL, NULL));
+        EXPECT_GT(speed, 100.0);
+        EXPECT_LT(speed, 250.0);
+        float x0, y;
+        EXPECT_EQ(1, um_get_positions (mHandle, FAKE_DEV_ID_1, LIBUM_TIMELIMIT_CACHE_ONLY, &x0, NULL, NULL, NULL,
+                                       NULL));
+        EXPECT_EQ(2, um_predict_position (mHandle, FAKE_DEV_ID_1, um_get_timestamp_ns () / 1000 + 20000, &x, &y,
+                                          NULL, NULL));
+        EXPECT_GT(x, x0 + 2.0);
+        EXPECT_NEAR(5.0, y, 0.01);
+
+        // The y axis left out for 50 ms, its step is 1 um over 50 ms, not over 5 ms
+        for (int i = 30; i < 40; i++) {
+            mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {i * 1000});
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+            um_receive (mHandle, 0);
+        }
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {40000, 6000});
+        std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        um_receive (mHandle, 0);
+        ASSERT_EQ(2, um_get_speeds (mHandle, FAKE_DEV_ID_1, &x, &speed, NULL, NULL, NULL));
+        EXPECT_GT(speed, 0.0);
+        EXPECT_LT(speed, 10.0);
+
+        // Polled positions feed the filter too
+        static std::atomic<int> polls(0);
+        polls = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_POSITIONS && ntohs(req.receiver_id) == FAKE_DEV_ID_2) {
+                dev.ack (req, from, FAKE_DEV_ID_2);
+                dev.respond (req, from, FAKE_DEV_ID_2, {polls++ * 1000, 0, 0});
+            }
+        });
+        for (int i = 0; i < 30; i++) {
+            ASSERT_EQ(3, um_read_positions (mHandle, FAKE_DEV_ID_2, LIBUM_TIMELIMIT_DISABLED));
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        }
+        ASSERT_EQ(1, um_get_speeds (mHandle, FAKE_DEV_ID_2, &speed, NULL, NULL, NULL, NULL));
+        EXPECT_GT(speed, 50.0);
+        EXPECT_EQ(1, um_predict_position (mHandle, FAKE_DEV_ID_2, um_get_timestamp_ns () / 1000, &x, NULL, NULL,
+                                          NULL));
+        EXPECT_GT(x, 25.0);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_position_arrival_time) {
+        um_position_sample sample;
+        ASSERT_EQ(0, um_set_position_history (mHandle, 4));
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {1000, 0, 0});
+        std::this_thread::sleep_for (std::chrono::milliseconds(20));
+        um_receive (mHandle, 0);
+        ASSERT_EQ(1, um_get_position_history (mHandle, FAKE_DEV_ID_1, 0, &sample, 1));
+        EXPECT_LE(sample.timestamp_us, sample.processed_us);
+        EXPECT_LE(sample.processed_us, um_get_timestamp_ns () / 1000);
+#ifdef __linux__
+        // Timestamped by the kernel when queued, not when processed
+        EXPECT_NE(0, mHandle->rx_timestamps);
+        EXPECT_GE(sample.processed_us - sample.timestamp_us, 15000ULL);
+
+        // Also after a long application stall
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {2000, 0, 0});
+        std::this_thread::sleep_for (std::chrono::milliseconds(1100));
+        um_receive (mHandle, 0);
+        ASSERT_EQ(1, um_get_position_history (mHandle, FAKE_DEV_ID_1, sample.timestamp_us, &sample, 1));
+        EXPECT_EQ(2000, sample.x);
+        EXPECT_GE(sample.processed_us - sample.timestamp_us, 1000000ULL);
+#endif
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_positions_nowait) {
+        static std::atomic<int> requests(0);
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_POSITIONS && ntohs(req.receiver_id) == FAKE_DEV_ID_1) {
+                requests++;
+                std::this_thread::sleep_for (std::chrono::milliseconds(30));
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {1000, 2000, 3000});
+            }
+        });
+        float x = 0.0, y = 0.0, z = 0.0;
+        int elapsed = 0;
+        // Nothing cached yet, the callers share one request in flight
+        EXPECT_EQ(0, um_get_positions_nowait (mHandle, FAKE_DEV_ID_1, 100, &x, &y, &z, NULL, &elapsed));
+        EXPECT_EQ(-1, elapsed);
+        EXPECT_EQ(0, um_get_positions_nowait (mHandle, FAKE_DEV_ID_1, LIBUM_TIMELIMIT_DISABLED, &x, &y, &z, NULL,
+                                              NULL));
+        std::this_thread::sleep_for (std::chrono::milliseconds(60));
+        EXPECT_EQ(3, um_get_positions_nowait (mHandle, FAKE_DEV_ID_1, 1000, &x, &y, &z, NULL, &elapsed));
+        EXPECT_FLOAT_EQ(1.0, x);
+        EXPECT_FLOAT_EQ(3.0, z);
+        EXPECT_GE(elapsed, 0);
+        EXPECT_LT(elapsed, 100);
+        EXPECT_EQ(1, requests);
+        EXPECT_EQ(-1, um_next_deadline_ms (mHandle));
+        EXPECT_EQ(LIBUM_INVALID_DEV, um_get_positions_nowait (mHandle, SMCP1_ALL_DEVICES, 0, &x, NULL, NULL, NULL,
+                                                              NULL));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_positions_nowait_in_receiver) {
+        static std::atomic<int> requests(0);
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            // The first request is lost
+            if (ntohs(req.type) == SMCP1_GET_POSITIONS && ntohs(req.receiver_id) == FAKE_DEV_ID_1 &&
+                requests++ > 0) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {1000, 2000, 3000});
+            }
+        });
+        ASSERT_EQ(0, um_start_receiver (mHandle));
+        float x = 0.0, y = 0.0, z = 0.0;
+        int ret = 0;
+        // Retransmitted by the receiver thread, nobody waits for the request
+        for (int i = 0; i < 100 && (ret = um_get_positions_nowait (mHandle, FAKE_DEV_ID_1, 100, &x, &y, &z, NULL,
+                                                                   NULL)) == 0; i++) {
+            std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        }
+        EXPECT_EQ(3, ret);
+        EXPECT_FLOAT_EQ(1.0, x);
+        EXPECT_EQ(2, requests);
+        EXPECT_EQ(-1, um_next_deadline_ms (mHandle));
+        EXPECT_EQ(0, um_stop_receiver (mHandle));
+    }
+
+    struct NestedDrain {
+        FakeDevice *device;
+        std::vector<int> xs;
+    };
+
+    TEST_F(LibumTestLoopbackC, test_um_notify_handler_nested_drain) {
+        NestedDrain log;
+        log.device = &mDevice;
+        // Reads the socket from the handler while more notifications have arrived
+        um_notify_func handler = [](um_state *hndl, const int dev, const int, const void *payload, void *arg) {
+            NestedDrain *log = (NestedDrain *) arg;
+            log->xs.push_back (((const um_notify_positions *) payload)->positions.x);
+            if (log->xs.size () == 1) {
+                log->device->notify (hndl, dev, SMCP1_NOTIFY_POSITION_CHANGED, {97000, 0, 0});
+                log->device->notify (hndl, dev, SMCP1_NOTIFY_POSITION_CHANGED, {98000, 0, 0});
+                std::this_thread::sleep_for (std::chrono::milliseconds(10));
+                float x;
+                um_get_positions_nowait (hndl, dev, LIBUM_TIMELIMIT_CACHE_ONLY, &x, NULL, NULL, NULL, NULL);
+            }
+        };
+        EXPECT_EQ(0, um_set_notify_handler (mHandle, SMCP1_NOTIFY_POSITION_CHANGED, handler, &log));
+        for (int i = 1; i <= 3; i++) {
+            mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_POSITION_CHANGED, {i * 1000, 0, 0});
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        um_receive (mHandle, 0);
+        um_receive (mHandle, 0);
+        // Each notification handled once, in the order sent
+        std::vector<int> expected = {1000, 2000, 3000, 97000, 98000};
+        EXPECT_EQ(expected, log.xs);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_device_info_cache) {
+        static std::atomic<int> requests(0);
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            if (ntohs(req.receiver_id) != FAKE_DEV_ID_1) {
+                return;
+            }
+            if (ntohs(req.type) == SMCP1_GET_PARAMETER && argc == 1 && args[0] == SMCP1_PARAM_AXIS_COUNT) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {SMCP1_PARAM_AXIS_COUNT, 4});
+            } else if (ntohs(req.type) == SMCP1_GET_FEATURE && argc == 1) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {args[0], 1});
+            } else if (ntohs(req.type) == SMCP1_GET_VERSION) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {1, 2, 3, 4, 5});
+            } else if (ntohs(req.type) == SMCP1_SET_FEATURE) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        int version[5] = {0};
+        EXPECT_EQ(4, um_get_axis_count (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(4, um_get_axis_count (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(1, um_get_feature (mHandle, FAKE_DEV_ID_1, 3));
+        EXPECT_EQ(1, um_get_feature (mHandle, FAKE_DEV_ID_1, 3));
+        EXPECT_EQ(LIBUM_INVALID_DEV, um_get_feature (mHandle, -1, 3));
+        EXPECT_EQ(LIBUM_INVALID_DEV, um_get_ext_feature (mHandle, -1, 3));
+        EXPECT_EQ(5, um_read_version (mHandle, FAKE_DEV_ID_1, version, 5));
+        memset(version, 0, sizeof (version));
+        EXPECT_EQ(5, um_read_version (mHandle, FAKE_DEV_ID_1, version, 3));
+        EXPECT_EQ(3, version[2]);
+        EXPECT_EQ(0, version[3]);
+        EXPECT_EQ(3, requests);
+        // Setting a feature forgets its state
+        EXPECT_GE(um_set_feature (mHandle, FAKE_DEV_ID_1, 3, 1), 0);
+        EXPECT_EQ(1, um_get_feature (mHandle, FAKE_DEV_ID_1, 3));
+        EXPECT_EQ(4, requests);
+        // A rebooted device is asked again
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_MANIPULATOR_HELLO, {});
+        std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        um_receive (mHandle, 0);
+        EXPECT_EQ(4, um_get_axis_count (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(5, requests);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_get_features) {
+        static std::atomic<int> requests(0);
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.receiver_id) != FAKE_DEV_ID_1) {
+                return;
+            }
+            if (ntohs(req.type) == SMCP1_GET_FEATURES) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {0x1, 0x5});
+            } else if (ntohs(req.type) == SMCP1_GET_EXT_FEATURES) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {0x2});
+            }
+        });
+        uint64_t features = 0;
+        uint32_t ext_features = 0;
+        EXPECT_EQ(0, um_get_features (mHandle, FAKE_DEV_ID_1, 1000, &features, &ext_features));
+        EXPECT_EQ(0x100000005ULL, features);
+        EXPECT_EQ(0x2U, ext_features);
+        EXPECT_EQ(2, requests);
+        // The single feature getters and a new snapshot within the time limit use the cache
+        EXPECT_EQ(1, um_get_feature (mHandle, FAKE_DEV_ID_1, 2));
+        EXPECT_EQ(0, um_get_feature (mHandle, FAKE_DEV_ID_1, 1));
+        EXPECT_EQ(1, um_get_feature (mHandle, FAKE_DEV_ID_1, 32));
+        EXPECT_EQ(1, um_get_ext_feature (mHandle, FAKE_DEV_ID_1, 33));
+        EXPECT_EQ(0, um_get_ext_feature (mHandle, FAKE_DEV_ID_1, 34));
+        EXPECT_EQ(0, um_get_features (mHandle, FAKE_DEV_ID_1, 1000, NULL, NULL));
+        EXPECT_EQ(2, requests);
+        EXPECT_EQ(0, um_get_features (mHandle, FAKE_DEV_ID_1, LIBUM_TIMELIMIT_DISABLED, &features, NULL));
+        EXPECT_EQ(4, requests);
+        EXPECT_EQ(LIBUM_INVALID_DEV, um_get_features (mHandle, SMCP1_ALL_DEVICES, 0, &features, NULL));
+    }
+
+    // Known word values of the byte order test, all bytes differ
+    static int32_t payload_word(const int i, const int count, const bool response) {
+        int32_t word = (int32_t) (0x01020304u * (i + 1) ^ (unsigned) count << 8);
+        return response ? ~word : word;
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_payload_byte_order) {
+        static std::atomic<int> mismatches;
+        mismatches = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            // The fake decodes and encodes with the scalar ntohl and htonl, the reference for the SDK kernels
+            if (ntohs(req.type) == SMCP1_CMD_PING && ntohs(req.receiver_id) == FAKE_DEV_ID_1) {
+                std::vector<int32_t> resp;
+                for (int i = 0; i < argc; i++) {
+                    if (args[i] != payload_word (i, argc, false)) {
+                        mismatches++;
+                    }
+                    resp.push_back (payload_word (i, argc, true));
+                }
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, resp);
+            }
+        });
+        // Every length up to the vector widths and past them, the AVX2, SSE2 and scalar tail paths
+        int args[40], resp[40];
+        for (int count = 0; count <= 40; count++) {
+            for (int i = 0; i < count; i++) {
+                args[i] = payload_word (i, count, false);
+            }
+            int ticket = um_cmd_async (mHandle, FAKE_DEV_ID_1, SMCP1_CMD_PING, count, args, count);
+            ASSERT_GT(ticket, 0);
+            memset(resp, 0, sizeof (resp));
+            ASSERT_EQ(count, um_async_result (mHandle, ticket, count, resp));
+            for (int i = 0; i < count; i++) {
+                EXPECT_EQ(payload_word (i, count, true), resp[i]) << "count " << count << " word " << i;
+            }
+        }
+        EXPECT_EQ(0, mismatches);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_uma_ring) {
+        const um_uma_block *blocks;
+        unsigned long long received, dropped, missing;
+        IPADDR to = FakeDevice::handleAddress (mHandle);
+        auto samples = [&](const int id) {
+            mDevice.send (to, FAKE_DEV_ID_1, SMCP1_ALL_CUS_OR_PCS, SMCP1_NOTIFY_UMA_SAMPLES, id, SMCP1_OPT_NOTIFY,
+                          {id, -id, 0x01020304});
+        };
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_read_uma_ring (mHandle, &blocks));
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_set_uma_ring (mHandle, LIBUM_MAX_UMA_RING + 1));
+        // Rounded up to four blocks
+        ASSERT_EQ(0, um_set_uma_ring (mHandle, 3));
+        EXPECT_EQ(0, um_read_uma_ring (mHandle, &blocks));
+
+        // Id 12 lost on the way, id 15 does not fit
+        for (int id : {10, 11, 13, 14, 15}) {
+            samples (id);
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(5, um_receive (mHandle, 0));
+        ASSERT_EQ(4, um_read_uma_ring (mHandle, &blocks));
+        EXPECT_EQ(FAKE_DEV_ID_1, blocks[0].dev);
+        EXPECT_EQ(10, blocks[0].message_id);
+        EXPECT_EQ(3, blocks[0].word_count);
+        EXPECT_EQ(-10, (int32_t) blocks[0].words[1]);
+        EXPECT_EQ(0x01020304U, blocks[0].words[2]);
+        EXPECT_EQ(0, blocks[1].gap);
+        EXPECT_EQ(13, blocks[2].message_id);
+        EXPECT_EQ(1, blocks[2].gap);
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_release_uma_ring (mHandle, 5));
+        EXPECT_EQ(0, um_release_uma_ring (mHandle, 2));
+
+        // The span ends at the end of the ring
+        samples (16);
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(1, um_receive (mHandle, 0));
+        ASSERT_EQ(2, um_read_uma_ring (mHandle, &blocks));
+        EXPECT_EQ(14, blocks[1].message_id);
+        EXPECT_EQ(0, um_release_uma_ring (mHandle, 2));
+        ASSERT_EQ(1, um_read_uma_ring (mHandle, &blocks));
+        EXPECT_EQ(16, blocks[0].message_id);
+        EXPECT_EQ(0, blocks[0].gap);
+        EXPECT_EQ(1, blocks[0].dropped);
+        EXPECT_EQ(0, um_release_uma_ring (mHandle, 1));
+        EXPECT_EQ(0, um_read_uma_ring (mHandle, &blocks));
+
+        EXPECT_EQ(0, um_get_uma_ring_stats (mHandle, &received, &dropped, &missing));
+        EXPECT_EQ(6U, received);
+        EXPECT_EQ(1U, dropped);
+        EXPECT_EQ(1U, missing);
+        EXPECT_EQ(0, um_set_uma_ring (mHandle, 0));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_uma_recorder) {
+        const char *path = "libum_test_uma_recording.dat";
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *, const int, const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_GET_UMA_REGS) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+            }
+        });
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_stop_uma_recorder (mHandle));
+        ASSERT_EQ(0, um_start_uma_recorder (mHandle, FAKE_DEV_ID_1, path));
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_start_uma_recorder (mHandle, FAKE_DEV_ID_1, path));
+
+        // 1500 blocks fill the time index once, id 1000 is lost, the other device is not recorded
+        IPADDR to = FakeDevice::handleAddress (mHandle);
+        for (int id = 1; id <= 1501; id += 100) {
+            for (int i = id; i < id + 100 && i <= 1501; i++) {
+                if (i != 1000) {
+                    mDevice.send (to, FAKE_DEV_ID_1, SMCP1_ALL_CUS_OR_PCS, SMCP1_NOTIFY_UMA_SAMPLES, i,
+                                  SMCP1_OPT_NOTIFY, {i, -i, 3});
+                }
+            }
+            mDevice.send (to, FAKE_DEV_ID_2, SMCP1_ALL_CUS_OR_PCS, SMCP1_NOTIFY_UMA_SAMPLES, id, SMCP1_OPT_NOTIFY, {0});
+            std::this_thread::sleep_for (std::chrono::milliseconds(10));
+            um_receive (mHandle, 0);
+        }
+        EXPECT_EQ(0, um_stop_uma_recorder (mHandle));
+
+        FILE *file = fopen (path, "rb");
+        ASSERT_NE(nullptr, file);
+        std::vector<unsigned char> data;
+        unsigned char buf[4096];
+        size_t n;
+        while ((n = fread (buf, 1, sizeof (buf), file)) > 0) {
+            data.insert (data.end (), buf, buf + n);
+        }
+        fclose (file);
+        remove (path);
+
+        ASSERT_GE(data.size (), sizeof (um_uma_record_header));
+        const um_uma_record_header *header = (const um_uma_record_header *) data.data ();
+        EXPECT_STREQ(LIBUM_UMA_RECORD_MAGIC, header->magic);
+        EXPECT_EQ(FAKE_DEV_ID_1, header->dev);
+        EXPECT_EQ(LIBUM_UMA_RECORD_REGS, header->reg_count);
+        EXPECT_EQ(9, header->regs[9]);
+        EXPECT_EQ(1500U, header->block_count);
+        EXPECT_EQ(1U, header->missing);
+        EXPECT_EQ(header->header_size + header->data_size, data.size ());
+        EXPECT_EQ(2U, header->index_stride);
+        EXPECT_EQ(750U, header->index_count);
+
+        // The third block through the index
+        ASSERT_LT(header->index[1].offset, data.size ());
+        const um_uma_record_block *block = (const um_uma_record_block *) (data.data () + header->index[1].offset);
+        const int32_t *words = (const int32_t *) (block + 1);
+        EXPECT_EQ(header->index[1].timestamp_us, block->timestamp_us);
+        EXPECT_GE(block->timestamp_us, header->start_us);
+        EXPECT_EQ(3, block->message_id);
+        EXPECT_EQ(3, block->word_count);
+        EXPECT_EQ(-3, words[1]);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_uma_recorder_grow) {
+        const char *path = "libum_test_uma_recording_grow.dat";
+        ASSERT_EQ(0, um_start_uma_recorder (mHandle, FAKE_DEV_ID_1, path));
+
+        // Full size blocks past the first 16 MB of the file
+        const int count = 12000;
+        std::vector<int32_t> samples (368);
+        IPADDR to = FakeDevice::handleAddress (mHandle);
+        for (int id = 1; id <= count; id += 50) {
+            for (int i = id; i < id + 50 && i <= count; i++) {
+                samples[0] = i;
+                samples[367] = -i;
+                mDevice.send (to, FAKE_DEV_ID_1, SMCP1_ALL_CUS_OR_PCS, SMCP1_NOTIFY_UMA_SAMPLES, i, SMCP1_OPT_NOTIFY,
+                              samples);
+            }
+            std::this_thread::sleep_for (std::chrono::milliseconds(1));
+            um_receive (mHandle, 0);
+        }
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        while (um_receive (mHandle, 0) > 0);
+        EXPECT_EQ(0, um_stop_uma_recorder (mHandle));
+
+        FILE *file = fopen (path, "rb");
+        ASSERT_NE(nullptr, file);
+        std::vector<unsigned char> data;
+        unsigned char buf[65536];
+        size_t n;
+        while ((n = fread (buf, 1, sizeof (buf), file)) > 0) {
+            data.insert (data.end (), buf, buf + n);
+        }
+        fclose (file);
+        remove (path);
+
+        ASSERT_GE(data.size (), sizeof (um_uma_record_header));
+        const um_uma_record_header *header = (const um_uma_record_header *) data.data ();
+        EXPECT_EQ((unsigned) count, header->block_count + header->missing);
+        EXPECT_GT(header->block_count, 11500U);
+        EXPECT_EQ(header->header_size + header->data_size, data.size ());
+        EXPECT_GT(data.size (), 16U * 1024 * 1024);
+
+        // The latest indexed block is in the grown part
+        const um_uma_record_index *last = &header->index[header->index_count - 1];
+        ASSERT_GT(last->offset, 16U * 1024 * 1024);
+        ASSERT_LT(last->offset, data.size ());
+        const um_uma_record_block *block = (const um_uma_record_block *) (data.data () + last->offset);
+        const int32_t *words = (const int32_t *) (block + 1);
+        EXPECT_EQ(368, block->word_count);
+        EXPECT_EQ(block->message_id, words[0]);
+        EXPECT_EQ(-block->message_id, words[367]);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_umc_start_sequence) {
+        static std::vector<int32_t> parts[4];
+        static std::atomic<int> count;
+        count = 0;
+        mDevice.start ([this](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                              const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_UMV_START_SEQUENCE && argc == 1 && args[0] == 1 && count < 4) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                parts[count++] = dev.args2 ();
+                // Channel 2 runs the part
+                dev.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_STATUS_CHANGED, {LIBUM_STATUS_UMC_CHN2_BUSY});
+                std::this_thread::sleep_for (std::chrono::milliseconds(20));
+                dev.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_STATUS_CHANGED, {0});
+            }
+        });
+        std::vector<umc_sequence_step> steps(400, {10, 1.0f, 1});
+        steps[1] = {0xffff, -1.0f, 0};
+
+        EXPECT_EQ(LIBUM_INVALID_ARG, umc_start_sequence (mHandle, FAKE_DEV_ID_1, 9, steps.data (), 1));
+        EXPECT_EQ(LIBUM_INVALID_ARG, umc_start_sequence (mHandle, FAKE_DEV_ID_1, 2, steps.data (), 0));
+        umc_sequence_step invalid[] = {{0, 1.0f, 0}, {10, 70.0f, 0}, {10, 1.0f, 2}};
+        for (auto &step : invalid) {
+            EXPECT_EQ(LIBUM_INVALID_ARG, umc_start_sequence (mHandle, FAKE_DEV_ID_1, 2, &step, 1));
+        }
+        EXPECT_EQ(0, umc_is_sequence_running (mHandle, FAKE_DEV_ID_1, 2));
+
+        // Split in two parts, the second one sent when the first one completed
+        ASSERT_EQ(0, umc_start_sequence (mHandle, FAKE_DEV_ID_1, 2, steps.data (), (int) steps.size ()));
+        EXPECT_EQ(1, umc_is_sequence_running (mHandle, FAKE_DEV_ID_1, 2));
+        for (int i = 0; i < 100 && umc_is_sequence_running (mHandle, FAKE_DEV_ID_1, 2) == 1; i++) {
+            std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        }
+        EXPECT_EQ(0, umc_is_sequence_running (mHandle, FAKE_DEV_ID_1, 2));
+        ASSERT_EQ(2, count);
+        EXPECT_EQ(steps.size (), parts[0].size () + parts[1].size ());
+        EXPECT_EQ(0x000A01F5, parts[0][0]);
+        EXPECT_EQ((int32_t) 0xFFFFFE0C, parts[0][1]);
+        EXPECT_EQ(0x000A01F5, parts[1].back ());
+    }
+
+    TEST_F(LibumTestLoopbackC, test_umc_record_pressure) {
+        static std::atomic<int> requests;
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            if (ntohs(req.type) == SMCP1_UMV_RECORD_SEQUENCE && argc == 3) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                // The recording takes longer than the session timeout
+                std::this_thread::sleep_for (std::chrono::milliseconds(args[1] * args[2]));
+                std::vector<int32_t> resp = {args[0]};
+                for (int i = 0; i < args[1]; i++) {
+                    resp.push_back (1000 * (requests * 1000 + i));
+                }
+                requests++;
+                dev.respond (req, from, FAKE_DEV_ID_1, resp);
+            }
+        });
+        std::vector<float> values(400);
+        EXPECT_EQ(LIBUM_INVALID_ARG, umc_record_pressure (mHandle, FAKE_DEV_ID_1, 0, 10, 1, values.data ()));
+        EXPECT_EQ(LIBUM_INVALID_ARG, umc_record_pressure (mHandle, FAKE_DEV_ID_1, 1, 0, 1, values.data ()));
+
+        // Two parts
+        EXPECT_EQ(400, umc_record_pressure (mHandle, FAKE_DEV_ID_1, 3, 400, 1, values.data ()));
+        EXPECT_EQ(2, requests);
+        EXPECT_FLOAT_EQ(0.0f, values[0]);
+        EXPECT_FLOAT_EQ(368.0f, values[368]);
+        EXPECT_FLOAT_EQ(1000.0f, values[369]);
+        EXPECT_FLOAT_EQ(1030.0f, values[399]);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_umc_pressure_cache) {
+        static std::atomic<int> requests;
+        requests = 0;
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            int type = ntohs(req.type);
+            if ((type == SMCP1_UMV_MEASURE_PRESSURE || type == SMCP1_UMV_GET_VALVE) && argc == 1) {
+                requests++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {args[0], type == SMCP1_UMV_GET_VALVE ? 0 : 7000});
+            } else if (type == SMCP1_UMV_SET_VALVE || type == SMCP1_UMV_SET_PRESSURE ||
+                       type == SMCP1_UMV_RESET_SENSOR_OFFSET) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        float kpa = 0.0f;
+        int elapsed = -1;
+
+        // Valve bits and three channels
+        mDevice.notify (mHandle, FAKE_DEV_ID_1, SMCP1_NOTIFY_PRESSURE_CHANGED, {0x02, 1000, -2000, 3000});
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        EXPECT_EQ(1, um_receive (mHandle, 0));
+        EXPECT_EQ(2000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 2, LIBUM_TIMELIMIT_CACHE_ONLY, &kpa,
+                                                  &elapsed));
+        EXPECT_FLOAT_EQ(-2.0f, kpa);
+        EXPECT_GE(elapsed, 0);
+        EXPECT_EQ(1, umc_get_valve_ext (mHandle, FAKE_DEV_ID_1, 2, 1000, NULL));
+        EXPECT_EQ(0, umc_get_valve_ext (mHandle, FAKE_DEV_ID_1, 5, LIBUM_TIMELIMIT_CACHE_ONLY, NULL));
+        EXPECT_EQ(0, requests);
+
+        // Not notified, too old or cache disabled
+        EXPECT_EQ(7000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 5, LIBUM_TIMELIMIT_CACHE_ONLY, &kpa,
+                                                  NULL));
+        EXPECT_EQ(1, requests);
+        std::this_thread::sleep_for (std::chrono::milliseconds(5));
+        EXPECT_EQ(7000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 1, 2, &kpa, &elapsed));
+        EXPECT_EQ(0, elapsed);
+        EXPECT_EQ(0, umc_get_valve (mHandle, FAKE_DEV_ID_1, 2));
+        EXPECT_EQ(3, requests);
+
+        // Device reads are cached too
+        EXPECT_EQ(0, umc_get_valve_ext (mHandle, FAKE_DEV_ID_1, 2, LIBUM_TIMELIMIT_CACHE_ONLY, NULL));
+        EXPECT_EQ(7000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 5, 1000, &kpa, NULL));
+        EXPECT_FLOAT_EQ(7.0f, kpa);
+        EXPECT_EQ(3, requests);
+
+        // The valve set is cached, the pressures changed by a command are read again
+        EXPECT_EQ(0, umc_set_valve (mHandle, FAKE_DEV_ID_1, 2, 1));
+        EXPECT_EQ(1, umc_get_valve_ext (mHandle, FAKE_DEV_ID_1, 2, 1000, NULL));
+        EXPECT_EQ(3, requests);
+        EXPECT_EQ(0, umc_set_pressure_setting (mHandle, FAKE_DEV_ID_1, 5, 2.0f));
+        EXPECT_EQ(7000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 5, 1000, &kpa, NULL));
+        EXPECT_EQ(4, requests);
+        EXPECT_EQ(0, umc_reset_sensor_offset (mHandle, FAKE_DEV_ID_1, 0));
+        EXPECT_EQ(7000, umc_measure_pressure_ext (mHandle, FAKE_DEV_ID_1, 5, 1000, &kpa, NULL));
+        EXPECT_EQ(5, requests);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_umc_read_all_channels) {
+        struct Request {
+            smcp1_frame req;
+            int chn;
+            IPADDR from;
+        };
+        static std::vector<Request> received;
+        received.clear ();
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            int type = ntohs(req.type);
+            // Setting of the channel 8 is never answered
+            if (argc != 1 || (type == SMCP1_UMV_GET_PRESSURE && args[0] == 7)) {
+                return;
+            }
+            dev.ack (req, from, FAKE_DEV_ID_1);
+            received.push_back ({req, args[0], from});
+            // All requests arrive before the first response, which are sent in the reverse order
+            if (received.size () == 23) {
+                for (auto it = received.rbegin (); it != received.rend (); ++it) {
+                    int chn = it->chn, value;
+                    switch (ntohs(it->req.type)) {
+                        case SMCP1_UMV_MEASURE_PRESSURE: value = 1000 * chn; break;
+                        case SMCP1_UMV_GET_PRESSURE: value = -1000 * chn; break;
+                        default: value = chn & 1; break;
+                    }
+                    dev.respond (it->req, it->from, FAKE_DEV_ID_1, {chn, value});
+                }
+            }
+        });
+        umc_channels channels;
+        EXPECT_EQ(LIBUM_INVALID_ARG, umc_read_all_channels (mHandle, FAKE_DEV_ID_1, NULL));
+        EXPECT_EQ(23, umc_read_all_channels (mHandle, FAKE_DEV_ID_1, &channels));
+        EXPECT_EQ(0xff, channels.pressure_valid);
+        EXPECT_EQ(0x7f, channels.setting_valid);
+        EXPECT_EQ(0xff, channels.valve_valid);
+        EXPECT_FLOAT_EQ(3.0f, channels.pressure_kpa[3]);
+        EXPECT_FLOAT_EQ(-6.0f, channels.setting_kpa[6]);
+        EXPECT_EQ(0xaa, channels.valves);
+        // Cached
+        EXPECT_EQ(1, umc_get_valve_ext (mHandle, FAKE_DEV_ID_1, 2, LIBUM_TIMELIMIT_CACHE_ONLY, NULL));
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_uma_shadow) {
+        static std::atomic<int> reads, writes;
+        static std::vector<int32_t> written;
+        reads = writes = 0;
+        written.clear ();
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            int type = ntohs(req.type);
+            if (type == SMCP1_GET_UMA_REGS) {
+                reads++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {100, 101, 102, 103, 104, 105, 106, 107, 108, 109});
+            } else if (type == SMCP1_SET_UMA_REGS) {
+                written.assign (args, args + argc);
+                writes++;
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        int value = 0, values[UMA_REG_COUNT];
+        EXPECT_EQ(LIBUM_INVALID_ARG, um_flush_uma_regs (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(0, um_set_uma_shadow (mHandle, FAKE_DEV_ID_1, 50));
+        EXPECT_EQ(1, reads);
+
+        // Reads from the shadow
+        EXPECT_EQ(1, um_get_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 3, &value));
+        EXPECT_EQ(103, value);
+        EXPECT_EQ(UMA_REG_COUNT, um_get_uma_regs (mHandle, FAKE_DEV_ID_1, UMA_REG_COUNT, values));
+        EXPECT_EQ(109, values[9]);
+        EXPECT_EQ(1, reads);
+
+        // The first write is sent right away, the next ones are coalesced
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 2, 7));
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 0, 8));
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 4, 9));
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 4, 10));
+        EXPECT_EQ(1, um_get_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 4, &value));
+        EXPECT_EQ(10, value);
+        EXPECT_EQ(0, um_flush_uma_regs (mHandle, FAKE_DEV_ID_1));
+        EXPECT_EQ(2, writes);
+        EXPECT_EQ(std::vector<int32_t>({8, 101, 7, 103, 10}), written);
+
+        // Flushed by um_receive after the interval
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 1, 5));
+        EXPECT_EQ(2, writes);
+        std::this_thread::sleep_for (std::chrono::milliseconds(60));
+        um_receive (mHandle, 0);
+        std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        um_receive (mHandle, 0);
+        EXPECT_EQ(3, writes);
+        EXPECT_EQ(std::vector<int32_t>({8, 5}), written);
+
+        // Disabled, read from the device again
+        EXPECT_EQ(0, um_set_uma_shadow (mHandle, FAKE_DEV_ID_1, -1));
+        EXPECT_EQ(UMA_REG_COUNT, um_get_uma_regs (mHandle, FAKE_DEV_ID_1, UMA_REG_COUNT, values));
+        EXPECT_EQ(2, reads);
+        EXPECT_EQ(3, writes);
+    }
+
+    TEST_F(LibumTestLoopbackC, test_um_uma_shadow_in_receiver) {
+        static std::atomic<int> writes;
+        static std::vector<int32_t> written;
+        writes = 0;
+        written.clear ();
+        mDevice.start ([](FakeDevice &dev, const smcp1_frame &req, const int32_t *args, const int argc,
+                          const IPADDR &from) {
+            int type = ntohs(req.type);
+            if (type == SMCP1_GET_UMA_REGS) {
+                dev.ack (req, from, FAKE_DEV_ID_1);
+                dev.respond (req, from, FAKE_DEV_ID_1, {100, 101, 102, 103, 104, 105, 106, 107, 108, 109});
+            } else if (type == SMCP1_SET_UMA_REGS && writes++ != 1) {
+                // The first attempt of the coalesced flush is lost
+                written.assign (args, args + argc);
+                dev.ack (req, from, FAKE_DEV_ID_1);
+            }
+        });
+        EXPECT_EQ(0, um_set_uma_shadow (mHandle, FAKE_DEV_ID_1, 50));
+        ASSERT_EQ(0, um_start_receiver (mHandle));
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 2, 7));
+        EXPECT_EQ(0, um_set_uma_reg (mHandle, FAKE_DEV_ID_1, (uMaRegistry) 1, 5));
+        // Flushed and retransmitted by the receiver thread while the socket is idle
+        for (int i = 0; i < 100 && writes < 3; i++) {
+            std::this_thread::sleep_for (std::chrono::milliseconds(10));
+        }
+        EXPECT_EQ(0, um_stop_receiver (mHandle));
+        EXPECT_EQ(3, writes);
+        EXPECT_EQ(std::vector<int32_t>({100, 5}), written);
+    }
+}
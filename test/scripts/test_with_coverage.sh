@@ -16,13 +16,14 @@ while getopts 'c' OPTION; do
   esac
 done
 
-TEST_ROOT_PATH="$(dirname ${0})/.."
+TEST_ROOT_PATH="$(cd "$(dirname ${0})/.." && pwd)"
 TEST_BUILD_FOLDER="build"
 TEST_BUILD_FOLDER_PATH="${TEST_ROOT_PATH}/${TEST_BUILD_FOLDER}"
+SPARSE_BUILD_FOLDER_PATH="${TEST_ROOT_PATH}/build-sparse"
 
 if [[ ${CLEAN} == 1 ]]
 then
-    rm -rf "${TEST_BUILD_FOLDER_PATH}"
+    rm -rf "${TEST_BUILD_FOLDER_PATH}" "${SPARSE_BUILD_FOLDER_PATH}"
     mkdir -p "${TEST_BUILD_FOLDER_PATH}"
 fi
 
@@ -40,10 +41,16 @@ cmake .. -DENABLE_COVERAGE=true && cmake --build .
 # Run all
 #./libum_test && cmake --build . --target coverage
 # uMp tests
-./libum_test --gtest_filter=LibumTestBasic*:LibumTestUmp* && cmake --build . --target coverage
+./libum_test --gtest_filter=LibumTestBasic*:LibumTestUmp*:LibumTestLoopback* && cmake --build . --target coverage
 
 if [ $? -eq 0 ];
 then
   cd coverage
   echo "Code coverage report: file://$(pwd)/index.html"
 fi
+
+# Sparse device table configuration. Changes the um_state layout, thus the library and
+# the tests are built together from the top level project with LIBUM_SPARSE_DEVICE_TABLE.
+cmake -S "${TEST_ROOT_PATH}/.." -B "${SPARSE_BUILD_FOLDER_PATH}" -DBUILD_TESTS=ON -DLIBUM_SPARSE_DEVICE_TABLE=ON
+cmake --build "${SPARSE_BUILD_FOLDER_PATH}"
+"${SPARSE_BUILD_FOLDER_PATH}/bin/libum_test" --gtest_filter=LibumTestBasic*:LibumTestLoopback*